@@ -28,7 +28,7 @@
 #define FSU_EYE_APP_CONFIG__H
 
 /*
- * @brief Frequency at which to upload image data to AWS
+ * @brief Minimum interval between images uploaded to AWS on motion
  */
 #define FSU_EYE_IMAGE_REPORT_FREQ_SECONDS            "2"
 
@@ -37,4 +37,109 @@
  */
 #define FSU_EYE_INFO_REPORT_FREQ_SECONDS             "900" // Every 15 minutes
 
+/*
+ * @brief Delivery latency in milliseconds the stream rate controller aims to hold
+ */
+#define FSU_EYE_STREAM_TARGET_LATENCY_MS             "300"
+
+/*
+ * @brief Motion detection sensitivity, 0 (least sensitive) to 100 (most sensitive)
+ */
+#define FSU_EYE_MOTION_SENSITIVITY                   "50"
+
+/*
+ * @brief Interval at which an image is uploaded when no motion has been detected
+ */
+#define FSU_EYE_HEARTBEAT_FREQ_SECONDS               "600"
+
+/*
+ * @brief Hamming distance between image hashes at or below which an image counts as a duplicate and is not uploaded
+ */
+#define FSU_EYE_DUPLICATE_DISTANCE                   "4"
+
+/*
+ * @brief Consecutive duplicate uploads skipped before one is forced, 0 disables duplicate suppression
+ */
+#define FSU_EYE_DUPLICATE_REFRESH                    "10"
+
+/*
+ * @brief Seconds of frames kept before a trigger, uploaded as part of a burst
+ */
+#define FSU_EYE_HISTORY_SECONDS                      "5"
+
+/*
+ * @brief Frame rate at which frames are recorded into the pre-event history
+ */
+#define FSU_EYE_HISTORY_FPS                          "2"
+
+/*
+ * @brief Frames recorded after a trigger and uploaded as part of the burst
+ */
+#define FSU_EYE_BURST_POST_FRAMES                    "10"
+
+/*
+ * @brief Sensor frame size given by its width in pixels, e.g. 640 for VGA
+ */
+#define FSU_EYE_CAMERA_FRAME_SIZE                    "640"
+
+/*
+ * @brief Sensor JPEG quality, 0-63 where lower is better
+ */
+#define FSU_EYE_CAMERA_QUALITY                       "12"
+
+/*
+ * @brief Sensor clock in Hz
+ */
+#define FSU_EYE_CAMERA_XCLK                          "20000000"
+
+/*
+ * @brief Driver frame buffers, 0 picks them by PSRAM availability
+ */
+#define FSU_EYE_CAMERA_FB_COUNT                      "0"
+
+/*
+ * @brief Still frame size given by its width in pixels, 0 takes stills at the stream frame size
+ */
+#define FSU_EYE_CAMERA_STILL_FRAME_SIZE              "0"
+
+/*
+ * @brief Set to 1 to only upload images exposed after they were requested
+ */
+#define FSU_EYE_FRESH_CAPTURE                        "1"
+
+/*
+ * @brief Fresh frames skipped before an upload to let exposure settle
+ */
+#define FSU_EYE_CAPTURE_SETTLE_FRAMES                "0"
+
+/*
+ * @brief Seconds without a capture or viewer after which the sensor is powered down, 0 keeps it running
+ */
+#define FSU_EYE_SENSOR_IDLE_SECONDS                  "0"
+
+/*
+ * @brief Image uploads are sent as previews scaled down by this factor, 2, 4 or 8, 0 sends full images
+ */
+#define FSU_EYE_PREVIEW_SCALE                        "0"
+
+/*
+ * @brief Region of uploaded images as left,top,width,height in percent of the frame, the whole frame disables cropping
+ */
+#define FSU_EYE_CROP_REGION                          "0,0,100,100"
+
+/*
+ * @brief Largest size in bytes an uploaded image is captured at, the JPEG quality is lowered to stay below it, 0 disables
+ */
+#define FSU_EYE_IMAGE_SIZE_BUDGET                    "0"
+
+/*
+ * @brief Default privacy masks, left,top,width,height in percent separated by semicolons, none by default
+ */
+#define FSU_EYE_PRIVACY_MASKS                        "0,0,0,0"
+
+/*
+ * @brief Default timestamp overlay, off
+ */
+#define FSU_EYE_TIMESTAMP_OVERLAY                    "0"
+
 #endif /* FSU_EYE_APP_CONFIG__H */
@@ -33,6 +33,30 @@
  *  @{
  */
 #define FSU_HTTP_SERVER_PORT    80
+
+/*
+ * @brief Number of simultaneous camera stream viewers, each frame is captured
+ * once and fanned out to all of them
+ */
+#define FSU_HTTP_SERVER_MAX_STREAM_CLIENTS    3
+
+/*
+ * @brief Sender tasks the stream clients are spread over, each client is
+ * served by one of them for as long as it is connected
+ */
+#define FSU_HTTP_SERVER_STREAM_WORKERS    2
+
+/*
+ * @brief Frames a websocket stream client may have unacked before the server
+ * holds back new ones
+ */
+#define FSU_HTTP_SERVER_WS_WINDOW    2
+
+/*
+ * @brief Time in ms a websocket stream client may leave its oldest frame
+ * unacked before it is disconnected
+ */
+#define FSU_HTTP_SERVER_WS_ACK_TIMEOUT_MS    5000
 /** @}*/
 
 
@@ -36,7 +36,28 @@ char _kvs_defaults[kvs_entry_count][KVS_SERVICE_MAXIMUM_VALUE_SIZE] = {
   FSU_EYE_WIFI_SSID,
   FSU_EYE_WIFI_PASSWORD,
   FSU_EYE_IMAGE_REPORT_FREQ_SECONDS,
-  FSU_EYE_INFO_REPORT_FREQ_SECONDS
+  FSU_EYE_INFO_REPORT_FREQ_SECONDS,
+  FSU_EYE_STREAM_TARGET_LATENCY_MS,
+  FSU_EYE_MOTION_SENSITIVITY,
+  FSU_EYE_HEARTBEAT_FREQ_SECONDS,
+  FSU_EYE_DUPLICATE_DISTANCE,
+  FSU_EYE_DUPLICATE_REFRESH,
+  FSU_EYE_HISTORY_SECONDS,
+  FSU_EYE_HISTORY_FPS,
+  FSU_EYE_BURST_POST_FRAMES,
+  FSU_EYE_CAMERA_FRAME_SIZE,
+  FSU_EYE_CAMERA_QUALITY,
+  FSU_EYE_CAMERA_XCLK,
+  FSU_EYE_CAMERA_FB_COUNT,
+  FSU_EYE_CAMERA_STILL_FRAME_SIZE,
+  FSU_EYE_FRESH_CAPTURE,
+  FSU_EYE_CAPTURE_SETTLE_FRAMES,
+  FSU_EYE_SENSOR_IDLE_SECONDS,
+  FSU_EYE_PREVIEW_SCALE,
+  FSU_EYE_CROP_REGION,
+  FSU_EYE_IMAGE_SIZE_BUDGET,
+  FSU_EYE_PRIVACY_MASKS,
+  FSU_EYE_TIMESTAMP_OVERLAY
 };
 
 #endif /* FSU_EYE_KVS_DEFAULTS__H */
@@ -33,6 +33,7 @@
 #define AWS_SERVICE_CMD_MQTT_CONNECT_SUBSCRIBE  (0U)
 #define AWS_SERVICE_CMD_MQTT_PUBLISH_MESSAGE    (1U)
 #define AWS_SERVICE_CMD_MQTT_PUBLISH_IMAGE      (2U)
+#define AWS_SERVICE_CMD_MQTT_PUBLISH_PREVIEW    (3U)  // arg: image_info_t*, sent to the preview topic
 
 typedef struct message_info {
   char* msg;
@@ -45,6 +46,8 @@ typedef struct image_info {
   size_t width;
   size_t height;
   uint8_t format;
+  struct cam_frame *frame; // Frame backing buf, the AWS service takes over this
+                           // reference and sets it to NULL when doing so
 } image_info_t;
 
 /*
@@ -0,0 +1,74 @@
+/*
+* @file camera_budget.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_BUDGET__H
+#define CAMERA_BUDGET__H
+
+#include "camera_service.h"
+
+#include "esp_camera.h"
+
+#include <stdint.h>
+
+typedef struct cam_budget_stats {
+  uint32_t captures;        // Captures made under a budget
+  uint32_t retries;         // Captures taken again at a lower quality since they did not fit
+  uint32_t misses;          // Captures that did not fit even after retrying
+  uint64_t quality_sum;     // Sum of the qualities captures were uploaded at
+} cam_budget_stats_t;
+
+/*
+* @brief Learns how large frames get at the quality the sensor runs at.
+* Called by the frame producer for every frame it gets from the driver.
+* @param fb the driver frame
+* @param quality JPEG quality the sensor is set to
+*/
+void CAM_BUDGET_observe(const camera_fb_t *fb, uint8_t quality);
+
+/*
+* @brief Picks the best quality a frame is expected to fit the budget at.
+* @param frame_size frame size of the capture
+* @param quality best quality that may be picked, 0-63 where lower is better
+* @param budget size in bytes the frame has to fit
+* @retval the quality to capture at, never better than quality
+*/
+uint8_t CAM_BUDGET_quality(framesize_t frame_size, uint8_t quality, size_t budget);
+
+/*
+* @brief Records a capture made under a budget and learns from its size.
+* @param frame the captured frame
+* @param quality JPEG quality it was captured at
+* @param budget size in bytes the frame had to fit
+* @param final set if the capture is uploaded, otherwise it is taken again
+*/
+void CAM_BUDGET_captured(const cam_frame_t *frame, uint8_t quality, size_t budget, uint8_t final);
+
+/*
+* @brief Copies the budget counters into the provided struct.
+*/
+void CAM_BUDGET_get_stats(cam_budget_stats_t *stats);
+
+#endif /* ifndef CAMERA_BUDGET__H */
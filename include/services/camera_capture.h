@@ -0,0 +1,68 @@
+/*
+* @file camera_capture.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_CAPTURE__H
+#define CAMERA_CAPTURE__H
+
+#include "esp_http_server.h"
+
+#include <stdint.h>
+
+typedef struct cam_capture_stats {
+  uint32_t requests;
+  uint32_t not_modified;  // Requests answered with 304 and no body
+  uint32_t conversions;   // Frames converted to JPEG for the cache
+} cam_capture_stats_t;
+
+/*
+* @brief Sets up the still capture endpoint.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_CAPTURE_init();
+
+/*
+* @brief Turns away new requests, waits for the ones being answered to release
+* their frames and drops the cached frame.
+* @retval EXIT_SUCCESS if no request holds a frame anymore, EXIT_FAILURE if one
+* was still being answered after the wait
+*/
+int CAM_CAPTURE_deinit();
+
+/*
+* @brief URI handler returning the newest frame as a single JPEG. The frame is
+* taken from the frame ring, so pollers never trigger a capture of their own.
+* Sends an ETag, and a Last-Modified once the wall clock is set, and answers
+* with 304 Not Modified if the ETag matches or the frame is not newer than
+* If-Modified-Since.
+*/
+esp_err_t CAM_CAPTURE_http_handler(httpd_req_t *req);
+
+/*
+* @brief Copies the capture counters into the provided struct.
+*/
+void CAM_CAPTURE_get_stats(cam_capture_stats_t *stats);
+
+#endif /* ifndef CAMERA_CAPTURE__H */
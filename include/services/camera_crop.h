@@ -0,0 +1,57 @@
+/*
+* @file camera_crop.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_CROP__H
+#define CAMERA_CROP__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+typedef struct cam_crop_stats {
+  uint32_t cropped;         // Frames cut down to the region
+  uint32_t failed;          // Frames that could not be cropped and were kept whole
+  uint32_t last_us;         // Duration of the last crop
+  uint32_t max_us;
+  uint64_t bytes_saved;     // Bytes of all frames cut away by cropping
+} cam_crop_stats_t;
+
+/*
+* @brief Cuts the configured Crop Region out of a JPEG frame, widened to whole
+* MCUs, see CAM_JPEG_crop. Not thread safe, meant to be called from the task
+* doing the uploads.
+* @param frame the JPEG frame
+* @retval the cropped frame with a reference held, or NULL if no region is set
+* or the frame could not be cropped
+*/
+cam_frame_t* CAM_CROP_region(const cam_frame_t *frame);
+
+/*
+* @brief Copies the crop counters into the provided struct.
+*/
+void CAM_CROP_get_stats(cam_crop_stats_t *stats);
+
+#endif /* ifndef CAMERA_CROP__H */
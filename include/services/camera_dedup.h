@@ -0,0 +1,62 @@
+/*
+* @file camera_dedup.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_DEDUP__H
+#define CAMERA_DEDUP__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+typedef struct cam_dedup_stats {
+  uint32_t checked;       // Frames hashed
+  uint32_t skipped;       // Uploads skipped as duplicates
+  uint64_t bytes_saved;   // Size of the skipped frames
+  uint32_t last_us;       // Duration of the last hash, luma plane included
+  uint64_t total_us;
+} cam_dedup_stats_t;
+
+/*
+* @brief Decides if a frame is worth uploading by comparing its perceptual
+* hash with the hash of the last uploaded frame. Not thread safe, meant to be
+* called from the task doing the uploads.
+* @param frame frame to be uploaded
+* @retval 1 if the frame duplicates the last upload and should be skipped, otherwise 0
+*/
+uint8_t CAM_DEDUP_is_duplicate(cam_frame_t *frame);
+
+/*
+* @brief Records the frame last passed to CAM_DEDUP_is_duplicate as uploaded,
+* later frames are compared against it.
+*/
+void CAM_DEDUP_uploaded();
+
+/*
+* @brief Copies the duplicate suppression counters into the provided struct.
+*/
+void CAM_DEDUP_get_stats(cam_dedup_stats_t *stats);
+
+#endif /* ifndef CAMERA_DEDUP__H */
@@ -0,0 +1,97 @@
+/*
+* @file camera_frame_ring.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_FRAME_RING__H
+#define CAMERA_FRAME_RING__H
+
+#include "camera_service.h"
+
+#include "esp_camera.h"
+
+#include "FreeRTOS.h"
+
+#include <stdint.h>
+
+#define CAM_RING_MAX_SLOTS      (4U)
+#define CAM_RING_MAX_BUFFERS    (CAM_RING_MAX_SLOTS + 1U)
+
+typedef struct cam_ring_stats {
+  uint32_t published;   // Frames accepted into the ring
+  uint32_t evicted;     // Frames pushed out of the ring by newer ones
+  uint32_t unread;      // Evicted frames no reader had acquired, readers starve if close to published
+  uint32_t dropped;     // Frames discarded since no frame handle was free
+} cam_ring_stats_t;
+
+/*
+* @brief Sets up the ring.
+* @param slots number of frames the ring keeps published, at most CAM_RING_MAX_SLOTS
+* @param buffers number of frame buffers the driver was configured with
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_RING_init(uint8_t slots, uint8_t buffers);
+
+/*
+* @brief Drops the references held by the ring and tears it down once every
+* frame handed out has been released. No consumer may acquire new frames
+* while this is called.
+* @param wait maximum ticks to wait for frames still held to be released
+* @retval EXIT_SUCCESS if torn down, EXIT_FAILURE if frames are still held, the
+* ring then stays set up, empty, and the driver must be kept running
+*/
+int CAM_RING_deinit(TickType_t wait);
+
+/*
+* @brief Publishes a freshly captured driver buffer as the newest frame. The
+* ring takes ownership of the buffer, which goes back to the driver once the
+* frame is evicted and every consumer has released it.
+* @param fb buffer returned by esp_camera_fb_get
+* @retval EXIT_SUCCESS if published, EXIT_FAILURE if the frame was dropped
+*/
+int CAM_RING_publish(camera_fb_t *fb);
+
+/*
+* @brief Makes sure the driver has a buffer to capture into, evicting the
+* oldest unused frame or waiting for consumers to release theirs if needed.
+* @param wait maximum ticks to wait for a consumer to release its frame
+* @retval EXIT_SUCCESS if the driver has a buffer available, otherwise EXIT_FAILURE
+*/
+int CAM_RING_reclaim(TickType_t wait);
+
+/*
+* @brief Acquires the newest frame with a sequence number above after_seq,
+* waiting for the producer if no such frame exists yet.
+* @param after_seq sequence number of the last frame seen, 0 for any frame
+* @param wait maximum ticks to wait for a new frame
+* @retval the frame with a reference held, or NULL on timeout
+*/
+cam_frame_t* CAM_RING_acquire(uint32_t after_seq, TickType_t wait);
+
+/*
+* @brief Copies the ring counters into the provided struct.
+*/
+void CAM_RING_get_stats(cam_ring_stats_t *stats);
+
+#endif /* ifndef CAMERA_FRAME_RING__H */
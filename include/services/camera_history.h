@@ -0,0 +1,82 @@
+/*
+* @file camera_history.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_HISTORY__H
+#define CAMERA_HISTORY__H
+
+#include <stdint.h>
+
+typedef struct cam_history_stats {
+  uint32_t frames;        // Frames currently held
+  uint32_t bytes;         // Arena bytes currently used
+  uint32_t capacity;      // Arena size
+  uint32_t recorded;
+  uint32_t evicted;       // Frames pushed out, by age or to make room
+  uint32_t dropped;       // Frames not recorded since burst frames filled the arena
+  uint32_t bursts;
+  uint32_t burst_frames;  // Frames uploaded as part of a burst
+  uint32_t captures;
+  uint32_t capture_frames;      // Frames recorded by the last burst capture
+  uint32_t capture_missed;      // Sensor frames the last burst capture did not keep up with
+  uint32_t capture_fps_tenths;  // Frame rate the last burst capture achieved, in 0.1 fps
+  uint32_t drain_ms;            // From the end of the last burst capture until its last frame was uploaded
+} cam_history_stats_t;
+
+/*
+* @brief Starts recording the pre-event history into a PSRAM arena, and the
+* task draining bursts to AWS. Without PSRAM the history stays disabled.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_HISTORY_init();
+
+/*
+* @brief Stops recording and draining. Must be called before the frame ring
+* is torn down.
+*/
+void CAM_HISTORY_deinit();
+
+/*
+* @brief Uploads every frame in the history, followed by the configured number
+* of frames recorded after this call, oldest first.
+* @retval EXIT_SUCCESS if the burst was started, otherwise EXIT_FAILURE
+*/
+int CAM_HISTORY_trigger();
+
+/*
+* @brief Records the next frames back to back, at the rate the sensor delivers
+* them, and uploads them once all are recorded. Nothing is sent while the
+* capture runs.
+* @param frames number of frames to capture, at most the history holds
+* @retval EXIT_SUCCESS if the capture was started, otherwise EXIT_FAILURE
+*/
+int CAM_HISTORY_capture(uint32_t frames);
+
+/*
+* @brief Copies the history counters into the provided struct.
+*/
+void CAM_HISTORY_get_stats(cam_history_stats_t *stats);
+
+#endif /* ifndef CAMERA_HISTORY__H */
@@ -0,0 +1,169 @@
+/*
+* @file camera_jpeg.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_JPEG__H
+#define CAMERA_JPEG__H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAM_JPEG_MAX_COMPONENTS     (3U)
+// Largest side of the block a scaled scan reduces every 8x8 block to
+#define CAM_JPEG_MAX_SCALED_SIZE    (4U)
+// Rectangles a single mask pass blanks
+#define CAM_JPEG_MAX_RECTS          (8U)
+
+/*
+* @brief Frame and scan parameters of a baseline JPEG.
+*/
+typedef struct cam_jpeg_info {
+  uint16_t width;
+  uint16_t height;
+  uint8_t components;
+  uint8_t h_max;                // Largest sampling factors, an MCU is 8*h_max by 8*v_max pixels
+  uint8_t v_max;
+  uint16_t mcus_x;
+  uint16_t mcus_y;
+  uint16_t restart_interval;    // MCUs between restart markers, 0 if none
+  struct {
+    uint8_t id;
+    uint8_t h;                  // Horizontal and vertical sampling factors
+    uint8_t v;
+    uint8_t tq;                 // Quantization table
+    uint8_t td;                 // DC and AC Huffman tables
+    uint8_t ta;
+  } comp[CAM_JPEG_MAX_COMPONENTS];
+  uint16_t dc_quant[4];         // DC step of each quantization table
+  const uint8_t *quant[4];      // 8-bit quantization tables in zigzag order, NULL if absent or 16-bit
+  size_t header_len;            // Offset of the entropy coded data
+  size_t sof_offset;            // Offset of the frame header, past its marker
+  size_t dri_offset;            // Offset of the restart interval marker, 0 if none
+} cam_jpeg_info_t;
+
+/*
+* @brief Rectangle of a frame, in pixels.
+*/
+typedef struct cam_jpeg_rect {
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+} cam_jpeg_rect_t;
+
+/*
+* @brief Called for every 8x8 block of a scan with its mean value.
+* @param arg user argument given to the scan
+* @param component index of the component in the frame, 0 is luma
+* @param bx, by position of the block in the component, in blocks
+* @param value mean of the block, 0-255
+*/
+typedef void (*cam_jpeg_dc_cb)(void *arg, uint8_t component, uint16_t bx, uint16_t by, uint8_t value);
+
+/*
+* @brief Called for every 8x8 block of a scaled scan with its pixels at the
+* reduced size.
+* @param arg user argument given to the scan
+* @param component index of the component in the frame, 0 is luma
+* @param bx, by position of the block in the component, in blocks
+* @param pixels size by size pixels, row by row
+* @param size side of the reduced block, 1, 2 or 4
+*/
+typedef void (*cam_jpeg_block_cb)(void *arg, uint8_t component, uint16_t bx, uint16_t by, const uint8_t *pixels, uint8_t size);
+
+/*
+* @brief Sets up the scanner.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_JPEG_init();
+
+/*
+* @brief Parses the headers of a baseline JPEG up to the start of its scan.
+* @param buf, len the JPEG
+* @param info filled with the frame and scan parameters
+* @retval EXIT_SUCCESS on success, EXIT_FAILURE if malformed or not baseline
+*/
+int CAM_JPEG_parse(const uint8_t *buf, size_t len, cam_jpeg_info_t *info);
+
+/*
+* @brief Walks the entropy coded data of a baseline JPEG and reports the DC
+* value of every block, i.e. a 1/8 scale image, without inverse DCT. AC
+* coefficients are Huffman decoded only to be skipped.
+* @param buf, len the JPEG
+* @param info optional, filled with the frame parameters
+* @param cb called for every block
+* @param arg passed to cb
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_JPEG_scan_dc(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, cam_jpeg_dc_cb cb, void *arg);
+
+/*
+* @brief Walks the entropy coded data of a baseline JPEG and reports every
+* block scaled down to size by size pixels, i.e. a 1/2, 1/4 or 1/8 scale image.
+* Only the low frequency coefficients that make up the smaller block are kept
+* and transformed back with a size point inverse DCT, the full 8x8 inverse DCT
+* is never run. Needs 8-bit quantization tables unless size is 1.
+* @param buf, len the JPEG
+* @param info optional, filled with the frame parameters
+* @param size side of the reduced block, 1, 2 or 4
+* @param cb called for every block
+* @param arg passed to cb
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_JPEG_scan_scaled(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, uint8_t size, cam_jpeg_block_cb cb, void *arg);
+
+/*
+* @brief Cuts a rectangle of whole MCUs out of a baseline JPEG without
+* decoding it. The Huffman codes of the MCUs inside are copied, only the DC
+* differences at the edges of the rectangle are coded again, with the same
+* tables. Restart markers are dropped from the output.
+* @param buf, len the JPEG
+* @param mx, my top left MCU of the rectangle
+* @param mw, mh width and height of the rectangle in MCUs
+* @param out, out_size buffer receiving the cropped JPEG
+* @param out_len set to the length of the cropped JPEG
+* @retval EXIT_SUCCESS on success, EXIT_FAILURE if malformed, the rectangle is
+* outside the frame or the output does not fit out_size
+*/
+int CAM_JPEG_crop(const uint8_t *buf, size_t len, uint16_t mx, uint16_t my, uint16_t mw, uint16_t mh,
+                  uint8_t *out, size_t out_size, size_t *out_len);
+
+/*
+* @brief Blanks rectangles of a baseline JPEG to black without decoding it.
+* The rectangles are widened outwards to whole MCUs, their blocks are coded
+* again as flat with the same tables, the Huffman codes of all other blocks
+* are copied and only the DC differences next to the rectangles change.
+* Restart markers are dropped from the output.
+* @param buf, len the JPEG
+* @param rects, count rectangles to blank, in pixels, up to CAM_JPEG_MAX_RECTS
+* @param out, out_size buffer receiving the masked JPEG, must not overlap buf
+* @param out_len set to the length of the masked JPEG
+* @retval EXIT_SUCCESS on success, EXIT_FAILURE if malformed or the output
+* does not fit out_size
+*/
+int CAM_JPEG_mask(const uint8_t *buf, size_t len, const cam_jpeg_rect_t *rects, uint8_t count,
+                  uint8_t *out, size_t out_size, size_t *out_len);
+
+#endif /* ifndef CAMERA_JPEG__H */
@@ -0,0 +1,69 @@
+/*
+* @file camera_jpeg_pool.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_JPEG_POOL__H
+#define CAMERA_JPEG_POOL__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+typedef struct cam_jpool_stats {
+  uint32_t encodes;
+  uint32_t pooled;              // Encodes written into a pool buffer
+  uint32_t fallbacks;           // Encodes that had to allocate, pool exhausted or frame too large
+  uint32_t overflows;           // Encodes that did not fit a pool buffer
+  uint32_t buffer_size;
+  uint8_t buffers;              // Pool buffers, 0 until the first encode or if they could not be allocated
+  uint8_t in_use;
+  uint8_t max_in_use;
+  uint8_t fragmentation;        // Internal heap fragmentation in percent, after the last encode
+  uint8_t max_fragmentation;
+} cam_jpool_stats_t;
+
+/*
+* @brief Sets up the pool. Its buffers are allocated on the first encode, sized
+* for that frame, and allocated again for a larger frame once none of them is
+* in use.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_JPOOL_init();
+
+/*
+* @brief Encodes a raw frame into a pool buffer, falling back to a one-off
+* allocation if the pool is exhausted or the frame does not fit.
+* @param frame the raw frame
+* @param quality JPEG quality, 1-100
+* @retval the JPEG frame with a reference held, or NULL if encoding failed
+*/
+cam_frame_t* CAM_JPOOL_encode(cam_frame_t *frame, uint8_t quality);
+
+/*
+* @brief Copies the pool counters into the provided struct.
+*/
+void CAM_JPOOL_get_stats(cam_jpool_stats_t *stats);
+
+#endif /* ifndef CAMERA_JPEG_POOL__H */
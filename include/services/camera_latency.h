@@ -0,0 +1,110 @@
+/*
+* @file camera_latency.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_LATENCY__H
+#define CAMERA_LATENCY__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+// Upper bounds of the histogram buckets in milliseconds, the last bucket is open
+#define CAM_LAT_BUCKET_BOUNDS_MS    { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 }
+#define CAM_LAT_BUCKETS             (12U)
+
+#define CAM_LAT_REPORT_LEN          (0xC00U)
+
+/*
+* @brief Consumers whose frame delivery is timed, each has its own histograms.
+*/
+typedef enum {
+  cam_lat_stream,     // HTTP multipart and websocket stream clients
+  cam_lat_upload,     // MQTT image uploads, until the publish completed
+  cam_lat_consumer_count
+} cam_lat_consumer_t;
+
+/*
+* @brief Stretches of the way from the sensor to the network, a frame goes
+* through them in this order.
+*/
+typedef enum {
+  cam_lat_capture,    // Sensor start of frame until the driver handed it out
+  cam_lat_encode,     // Handed out until a JPEG version was ready
+  cam_lat_queue,      // JPEG ready until the consumer sent its first byte
+  cam_lat_send,       // First byte until the last byte was sent or the publish completed
+  cam_lat_total,      // Sensor start of frame until the last byte
+  cam_lat_stage_count
+} cam_lat_stage_t;
+
+typedef struct cam_lat_histogram {
+  uint32_t buckets[CAM_LAT_BUCKETS];
+  uint32_t count;
+  uint32_t max_us;
+} cam_lat_histogram_t;
+
+/*
+* @brief Sets up the histograms.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_LAT_init();
+
+/*
+* @brief Records a delivered frame. Stages the frame has no timestamp for, like
+* frames replayed from the pre-event history, are left out.
+* @param consumer the consumer that delivered the frame
+* @param frame the delivered frame
+* @param first_sent esp_timer time the consumer sent its first byte
+* @param last_sent esp_timer time the consumer was done with the frame
+*/
+void CAM_LAT_record(cam_lat_consumer_t consumer, const cam_frame_t *frame, int64_t first_sent, int64_t last_sent);
+
+/*
+* @brief Copies the histogram of one stage of a consumer.
+*/
+void CAM_LAT_get(cam_lat_consumer_t consumer, cam_lat_stage_t stage, cam_lat_histogram_t *histogram);
+
+/*
+* @brief Estimates a percentile of a stage from its histogram.
+* @param percent the percentile, 1-100
+* @retval upper bound in milliseconds of the bucket holding the percentile, the
+* maximum seen if it is in the open bucket, 0 if nothing was recorded
+*/
+uint32_t CAM_LAT_percentile_ms(cam_lat_consumer_t consumer, cam_lat_stage_t stage, uint8_t percent);
+
+/*
+* @brief Writes every histogram as a JSON object.
+* @param buf buffer receiving the report, CAM_LAT_REPORT_LEN is always enough
+* @param len size of the buffer
+* @retval length of the report, excluding the terminator
+*/
+size_t CAM_LAT_report(char *buf, size_t len);
+
+/*
+* @brief Clears every histogram, e.g. after a setting was changed.
+*/
+void CAM_LAT_reset();
+
+#endif /* ifndef CAMERA_LATENCY__H */
@@ -0,0 +1,74 @@
+/*
+* @file camera_luma.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_LUMA__H
+#define CAMERA_LUMA__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+// A VGA frame gives a full 1/8 scale plane, larger frames are subsampled down
+#define CAM_LUMA_MAX_WIDTH      (80U)
+#define CAM_LUMA_MAX_HEIGHT     (60U)
+
+/*
+* @brief Small grayscale version of a frame for scene analysis. Rows are
+* CAM_LUMA_MAX_WIDTH bytes apart and word aligned, so they can be processed a
+* word at a time.
+*/
+typedef struct cam_luma {
+  uint8_t data[CAM_LUMA_MAX_WIDTH * CAM_LUMA_MAX_HEIGHT] __attribute__((aligned(4)));
+  uint16_t width;   // Always a multiple of 8
+  uint16_t height;
+  uint32_t seq;     // Sequence number of the source frame
+} cam_luma_t;
+
+typedef struct cam_luma_stats {
+  uint32_t scans;       // JPEG frames scanned
+  uint32_t failures;
+  uint32_t last_us;     // Duration of the last JPEG scan
+  uint32_t max_us;
+  uint64_t total_us;
+} cam_luma_stats_t;
+
+/*
+* @brief Builds a 1/8 scale luma plane of a frame. For JPEG frames the plane
+* is made of the DC coefficient of every luma block, found by walking the
+* entropy coded data without decoding the image. Raw formats are subsampled
+* directly.
+* @param frame source frame, JPEG, grayscale, YUV422 or RGB565
+* @param luma destination plane
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_LUMA_from_frame(cam_frame_t *frame, cam_luma_t *luma);
+
+/*
+* @brief Copies the JPEG scan counters into the provided struct.
+*/
+void CAM_LUMA_get_stats(cam_luma_stats_t *stats);
+
+#endif /* ifndef CAMERA_LUMA__H */
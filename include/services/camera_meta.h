@@ -0,0 +1,59 @@
+/*
+* @file camera_meta.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_META__H
+#define CAMERA_META__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+// Room for the JPEG start and the comment segment, see CAM_META_prefix
+#define CAM_META_PREFIX_SIZE        (0x180U)
+
+/*
+* @brief Builds the start of a JPEG frame with a comment segment carrying the
+* thing name, sequence number, capture time and sensor settings. The frame
+* itself is left as is, the image with the metadata is the prefix followed by
+* the frame from skip on, so it can be sent from both without a copy.
+* @param frame the JPEG frame
+* @param prefix buffer for the prefix, CAM_META_PREFIX_SIZE fits any
+* @param size size of the prefix buffer
+* @param skip set to the bytes of the frame replaced by the prefix
+* @retval length of the prefix, 0 if the frame is no JPEG or it did not fit
+*/
+size_t CAM_META_prefix(const cam_frame_t *frame, uint8_t *prefix, size_t size, size_t *skip);
+
+/*
+* @brief Copies the frame with the metadata into a new frame, for transports
+* that cannot send from several buffers.
+* @param frame the JPEG frame
+* @retval the new frame with a reference held, or NULL if no metadata could be
+* added
+*/
+cam_frame_t* CAM_META_embed(const cam_frame_t *frame);
+
+#endif /* ifndef CAMERA_META__H */
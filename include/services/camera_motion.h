@@ -0,0 +1,64 @@
+/*
+* @file camera_motion.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_MOTION__H
+#define CAMERA_MOTION__H
+
+#include <stdint.h>
+
+typedef struct cam_motion_stats {
+  uint32_t analysed;        // Frame pairs compared
+  uint32_t events;          // Comparisons in which motion was detected
+  uint16_t changed_blocks;  // Blocks over the threshold in the last comparison
+  uint16_t blocks;          // Blocks compared in the last comparison
+  uint32_t analysis_us;     // Duration of the last analysis, luma extraction included
+} cam_motion_stats_t;
+
+/*
+* @brief Starts the motion detector, which periodically compares a small luma
+* plane of the newest frame with the previous one.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_MOTION_init();
+
+/*
+* @brief Stops the motion detector. Must be called before the frame ring is
+* torn down.
+*/
+void CAM_MOTION_deinit();
+
+/*
+* @brief Checks for motion since the last call and clears the event.
+* @retval 1 if motion was detected since the last call, otherwise 0
+*/
+uint8_t CAM_MOTION_take_event();
+
+/*
+* @brief Copies the motion detector counters into the provided struct.
+*/
+void CAM_MOTION_get_stats(cam_motion_stats_t *stats);
+
+#endif /* ifndef CAMERA_MOTION__H */
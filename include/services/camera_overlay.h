@@ -0,0 +1,61 @@
+/*
+* @file camera_overlay.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_OVERLAY__H
+#define CAMERA_OVERLAY__H
+
+#include "esp_camera.h"
+
+#include <stdint.h>
+
+#define CAM_OVERLAY_MAX_MASKS       (4U)
+
+typedef struct cam_overlay_stats {
+  uint32_t processed;   // Frames masked or stamped
+  uint32_t skipped;     // Frames not stamped since the sensor delivered JPEG
+  uint32_t refused;     // Frames dropped since their masks could not be applied
+  uint32_t last_us;     // Duration of the last masking and stamping
+  uint32_t max_us;
+} cam_overlay_stats_t;
+
+/*
+* @brief Blanks the Privacy Masks and burns in the capture time, as configured
+* in KVS, directly in the buffer of a raw RGB565, YUV422 or grayscale frame.
+* Frames from the sensor JPEG encoder get their masks blanked in the coded data,
+* the timestamp is not burnt into them. Meant to be called by the frame producer
+* only, before the frame is published.
+* @param fb buffer returned by esp_camera_fb_get
+* @retval EXIT_SUCCESS if the frame may be published, EXIT_FAILURE if masks are
+* set but could not be applied and the frame must be dropped
+*/
+int CAM_OVERLAY_apply(camera_fb_t *fb);
+
+/*
+* @brief Copies the overlay counters into the provided struct.
+*/
+void CAM_OVERLAY_get_stats(cam_overlay_stats_t *stats);
+
+#endif /* ifndef CAMERA_OVERLAY__H */
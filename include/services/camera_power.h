@@ -0,0 +1,84 @@
+/*
+* @file camera_power.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_POWER__H
+#define CAMERA_POWER__H
+
+#include "esp_camera.h"
+
+#include "FreeRTOS.h"
+
+#include <stdint.h>
+
+typedef struct cam_power_stats {
+  uint32_t sleeps;
+  uint32_t wakes;
+  uint32_t wake_us;           // From a wake up until the first frame was published
+  uint32_t max_wake_us;
+  uint8_t duty_percent;       // Share of the time the sensor was powered since start
+  uint32_t power_mw;          // Average sensor power estimated from the duty cycle
+} cam_power_stats_t;
+
+/*
+* @brief Sets up sensor power management for a started driver, with the
+* sensor powered.
+* @param config the configuration the driver was started with
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_POWER_init(const camera_config_t *config);
+
+/*
+* @brief Powers the sensor up for good, before the driver is stopped.
+*/
+void CAM_POWER_deinit();
+
+/*
+* @brief Tells that frames are needed now, waking the sensor if it is powered
+* down. Consumers acting for a user, e.g. uploads and viewers, call this, the
+* sensor is powered down once nobody did for the configured idle time.
+*/
+void CAM_POWER_demand();
+
+/*
+* @brief Called by the frame producer before asking the driver for a frame.
+* Powers the sensor down if it has been idle for long enough, and while it is
+* down waits for a wake up.
+* @param wait maximum ticks to wait for a wake up
+* @retval 1 if the sensor is powered down and no frame should be requested
+*/
+uint8_t CAM_POWER_suspended(TickType_t wait);
+
+/*
+* @brief Called by the frame producer for every published frame.
+*/
+void CAM_POWER_frame_published();
+
+/*
+* @brief Copies the power counters into the provided struct.
+*/
+void CAM_POWER_get_stats(cam_power_stats_t *stats);
+
+#endif /* ifndef CAMERA_POWER__H */
@@ -0,0 +1,58 @@
+/*
+* @file camera_preview.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_PREVIEW__H
+#define CAMERA_PREVIEW__H
+
+#include "camera_service.h"
+
+#include <stdint.h>
+
+typedef struct cam_preview_stats {
+  uint32_t made;            // Previews made
+  uint32_t failed;          // Frames that could not be scaled down
+  uint32_t last_us;         // Duration of the last preview, encoding included
+  uint32_t max_us;
+  uint8_t last_percent;     // Size of the last preview relative to its frame
+} cam_preview_stats_t;
+
+/*
+* @brief Scales a JPEG frame down without decoding it to full size. Every 8x8
+* block is reduced in the DCT domain, see CAM_JPEG_scan_scaled, and the small
+* image is encoded again. Not thread safe, meant to be called from the task
+* doing the uploads.
+* @param frame the JPEG frame
+* @param scale factor to scale down by, 2, 4 or 8
+* @retval the preview JPEG with a reference held, or NULL if the frame could not be scaled
+*/
+cam_frame_t* CAM_PREVIEW_make(const cam_frame_t *frame, uint8_t scale);
+
+/*
+* @brief Copies the preview counters into the provided struct.
+*/
+void CAM_PREVIEW_get_stats(cam_preview_stats_t *stats);
+
+#endif /* ifndef CAMERA_PREVIEW__H */
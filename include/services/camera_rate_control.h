@@ -0,0 +1,100 @@
+/*
+* @file camera_rate_control.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_RATE_CONTROL__H
+#define CAMERA_RATE_CONTROL__H
+
+#include "esp_camera.h"
+
+#include <stdint.h>
+
+typedef struct cam_rc_stats {
+  uint32_t latency_ms;          // Smoothed worst-client delivery latency
+  uint32_t target_ms;
+  uint8_t quality;
+  framesize_t frame_size;
+  uint32_t frame_interval_ms;   // Minimum time between frames sent to a client
+  uint32_t adjustments;
+} cam_rc_stats_t;
+
+/*
+* @brief Sets up the stream rate controller. The provided settings are the
+* best the controller will ever restore the sensor to.
+* @param frame_size configured sensor frame size
+* @param quality configured JPEG quality, 0-63 where lower is better
+*/
+void CAM_RC_init(framesize_t frame_size, uint8_t quality);
+
+/*
+* @brief Moves the controller to new configured settings, applying them to the
+* sensor right away and restarting adaptation from there.
+* @param frame_size new configured sensor frame size
+* @param quality new configured JPEG quality, 0-63 where lower is better
+* @retval EXIT_SUCCESS if the sensor took the frame size, otherwise EXIT_FAILURE
+*/
+int CAM_RC_set_baseline(framesize_t frame_size, uint8_t quality);
+
+/*
+* @brief Hands the sensor over to other settings, e.g. for a still, until
+* CAM_RC_resume is called. The controller does not adapt in between.
+* @param frame_size frame size to switch the sensor to
+* @param quality JPEG quality to switch the sensor to
+* @retval EXIT_SUCCESS if the sensor took the frame size, otherwise EXIT_FAILURE
+*/
+int CAM_RC_hold(framesize_t frame_size, uint8_t quality);
+
+/*
+* @brief Switches the sensor back to the stream settings after CAM_RC_hold and
+* lets the controller adapt again.
+*/
+void CAM_RC_resume();
+
+/*
+* @brief Reports the delivery latency of a frame that was completely sent to a
+* stream client, measured from when the frame was captured.
+*/
+void CAM_RC_report(int64_t latency_us);
+
+/*
+* @brief Runs the controller, adjusting quality, frame size and frame interval
+* towards the target latency. Cheap to call often, it only acts once per
+* control interval.
+* @param clients number of connected stream clients, with none the configured
+* settings are restored
+*/
+void CAM_RC_update(uint8_t clients);
+
+/*
+* @brief Minimum time in microseconds between two frames sent to one client.
+*/
+int64_t CAM_RC_frame_interval_us();
+
+/*
+* @brief Copies the controller state into the provided struct.
+*/
+void CAM_RC_get_stats(cam_rc_stats_t *stats);
+
+#endif /* ifndef CAMERA_RATE_CONTROL__H */
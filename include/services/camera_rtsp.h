@@ -0,0 +1,58 @@
+/*
+* @file camera_rtsp.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_RTSP__H
+#define CAMERA_RTSP__H
+
+#include <stdint.h>
+
+typedef struct cam_rtsp_stats {
+  uint32_t frames;      // Frames sent, summed over all sessions
+  uint32_t packets;
+  uint64_t bytes;
+  uint32_t skipped;     // Frames that could not be packetized, e.g. grayscale
+  uint8_t clients;
+} cam_rtsp_stats_t;
+
+/*
+* @brief Starts the RTSP server task. Sessions receive the frames of the frame
+* ring as RTP/JPEG (RFC 2435), over UDP or interleaved on the RTSP connection.
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_RTSP_init();
+
+/*
+* @brief Stops the RTSP server and closes every session. Must be called before
+* the frame ring is torn down.
+*/
+void CAM_RTSP_deinit();
+
+/*
+* @brief Copies the RTSP counters into the provided struct.
+*/
+void CAM_RTSP_get_stats(cam_rtsp_stats_t *stats);
+
+#endif /* ifndef CAMERA_RTSP__H */
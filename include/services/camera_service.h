@@ -27,7 +27,100 @@
 #ifndef CAMERA_SERVICE__H
 #define CAMERA_SERVICE__H
 
+#include "kvs_service.h"
+
+#include "esp_camera.h"
+
+#include "FreeRTOS.h"
+
+#include <stdint.h>
+
 #define CAM_SERVICE_CMD_CAPTURE_SEND_IMAGE  (0U)
+#define CAM_SERVICE_CMD_GET_MOTION          (1U)  // arg: uint8_t*, set to 1 if motion occurred since the last call
+#define CAM_SERVICE_CMD_GET_INFO            (2U)  // arg: cam_service_info_t*
+#define CAM_SERVICE_CMD_BURST_UPLOAD        (3U)  // Uploads the pre-event history and the frames following it
+#define CAM_SERVICE_CMD_SET_FRAME_SIZE      (4U)  // arg: uint32_t*, frame width in pixels, e.g. 640 for VGA
+#define CAM_SERVICE_CMD_SET_QUALITY         (5U)  // arg: uint32_t*, sensor JPEG quality 0-63, lower is better
+#define CAM_SERVICE_CMD_SET_XCLK            (6U)  // arg: uint32_t*, sensor clock in Hz, applied in whole MHz
+#define CAM_SERVICE_CMD_SET_FB_COUNT        (7U)  // arg: uint32_t*, driver frame buffers, restarts the driver
+#define CAM_SERVICE_CMD_PUBLISH_LATENCY     (8U)  // arg: uint32_t*, optional, histograms are cleared after publishing if non-zero
+#define CAM_SERVICE_CMD_BURST_CAPTURE       (9U)  // arg: uint32_t*, optional, frames to capture at full rate before uploading them
+#define CAM_SERVICE_CMD_SET_STILL_SIZE      (10U) // arg: uint32_t*, still frame width in pixels, 0 for the stream frame size
+#define CAM_SERVICE_CMD_SEND_FULL_IMAGE     (11U) // Like CAM_SERVICE_CMD_CAPTURE_SEND_IMAGE, always in full size and never skipped
+
+/*
+* @brief Argument of CAM_SERVICE_CMD_GET_INFO. The buffer receives the camera
+* diagnostics as comma separated JSON members, without enclosing braces, to
+* be merged into the info message.
+*/
+typedef struct cam_service_info {
+  char *buf;
+  size_t len;
+} cam_service_info_t;
+
+/*
+* @brief Reference counted handle to a captured frame. A single frame can be
+* shared between every consumer without copying, the backing buffer is freed
+* through free_fn once the last reference is released.
+*/
+typedef struct cam_frame {
+  uint8_t *buf;
+  size_t len;
+  size_t width;
+  size_t height;
+  pixformat_t format;
+  uint32_t seq;
+  int64_t timestamp;                        // esp_timer time the frame was published
+  int64_t captured;                         // esp_timer time the sensor started the frame, 0 if unknown
+  int64_t encoded;                          // esp_timer time the JPEG version was ready, 0 if unknown
+  int64_t wall_time;                        // Wall clock time the frame was started, in us since the epoch, 0 if unknown
+  int16_t quality;                          // Sensor JPEG quality the frame was taken at, -1 if not encoded by the sensor
+  camera_fb_t *fb;                          // Driver buffer backing buf, if any
+  void (*free_fn)(struct cam_frame *frame); // Invoked when refs drops to zero
+  uint32_t refs;
+} cam_frame_t;
+
+/*
+* @brief Acquires the newest captured frame with a sequence number above
+* after_seq, waiting for the sensor if there is none yet.
+* @param after_seq sequence number of the last frame seen, 0 for any frame
+* @param wait maximum ticks to wait for a frame
+* @retval the frame with a reference held by the caller, or NULL on timeout
+*/
+cam_frame_t* CAM_SERVICE_frame_acquire(uint32_t after_seq, TickType_t wait);
+
+/*
+* @brief Takes an additional reference to a frame, e.g. before handing it over
+* to another task.
+*/
+void CAM_SERVICE_frame_retain(cam_frame_t *frame);
+
+/*
+* @brief Releases a reference to a frame, freeing it when it was the last one.
+*/
+void CAM_SERVICE_frame_release(cam_frame_t *frame);
+
+/*
+* @brief Returns a JPEG version of a frame. JPEG frames are shared as is, other
+* formats are converted into a new heap backed frame with the same sequence
+* number and timestamp.
+* @param frame the frame to convert, the caller keeps its reference
+* @retval the JPEG frame with a reference held by the caller, or NULL on failure
+*/
+cam_frame_t* CAM_SERVICE_frame_to_jpeg(cam_frame_t *frame);
+
+/*
+* @brief Tells whether a frame belongs to the stream. Frames captured while the
+* sensor is switched to the still profile do not, and are skipped by live views.
+*/
+int CAM_SERVICE_is_stream_frame(const cam_frame_t *frame);
+
+/*
+* @brief Reads an unsigned KVS entry.
+* @param key the entry to read, must be of unsigned type
+* @param fallback value returned if the entry could not be read
+*/
+uint64_t CAM_SERVICE_kvs_get_uint(kvs_entry_id_t key, uint64_t fallback);
 
 /*
 * @brief Registers the camera service to the system controller.
@@ -0,0 +1,101 @@
+/*
+* @file camera_stream.h
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CAMERA_STREAM__H
+#define CAMERA_STREAM__H
+
+#include "fsu_http_server_config.h"
+
+#include "esp_http_server.h"
+
+#include <stdint.h>
+
+typedef struct cam_stream_worker_stats {
+  uint32_t frames;          // Parts completely sent by the worker
+  uint32_t frames_skipped;
+  uint64_t bytes;
+  uint32_t send_calls;
+  uint32_t acks;
+  uint8_t clients;
+  uint8_t pending;          // Clients with a part being sent, i.e. the queue depth of the worker
+  uint8_t max_pending;
+} cam_stream_worker_stats_t;
+
+typedef struct cam_stream_stats {
+  uint32_t frames;          // Parts completely sent, summed over all clients
+  uint32_t frames_skipped;  // Frames slow clients skipped to catch up
+  uint64_t bytes;
+  uint32_t send_calls;
+  uint32_t acks;            // Acks received from websocket clients
+  uint8_t clients;
+  cam_stream_worker_stats_t workers[FSU_HTTP_SERVER_STREAM_WORKERS];
+} cam_stream_stats_t;
+
+/*
+* @brief Starts the stream hub, which captures each frame once, and the pool of
+* sender workers, which fan it out to the stream clients assigned to them.
+* @param server handle of the running http server
+* @retval EXIT_SUCCESS on success, otherwise EXIT_FAILURE
+*/
+int CAM_STREAM_init(httpd_handle_t server);
+
+/*
+* @brief Stops the stream hub and drops every client, releasing their frames.
+*/
+void CAM_STREAM_deinit();
+
+/*
+* @brief URI handler for the multipart stream. Sends the response header and
+* hands the connection over to the hub, leaving the http server task free.
+*/
+esp_err_t CAM_STREAM_http_handler(httpd_req_t *req);
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+/*
+* @brief URI handler for the websocket stream. Hands the connection over to the
+* hub after the handshake, then takes the acks of the client. Each frame is a
+* binary message of the 4 byte big endian frame sequence number followed by
+* the JPEG, and the client acks it by sending the sequence number back, either
+* as 4 bytes or as decimal text. At most FSU_HTTP_SERVER_WS_WINDOW frames are
+* in flight unacked, a client that leaves a frame unacked for longer than
+* FSU_HTTP_SERVER_WS_ACK_TIMEOUT_MS is disconnected. Pings are answered
+* between messages, never inside one.
+*/
+esp_err_t CAM_STREAM_ws_handler(httpd_req_t *req);
+#endif /* CONFIG_HTTPD_WS_SUPPORT */
+
+/*
+* @brief Socket close function for the http server config. Removes a stream
+* client before its socket is closed, so the hub never writes to a stale fd.
+*/
+void CAM_STREAM_close_fn(httpd_handle_t server, int sockfd);
+
+/*
+* @brief Copies the stream counters into the provided struct.
+*/
+void CAM_STREAM_get_stats(cam_stream_stats_t *stats);
+
+#endif /* ifndef CAMERA_STREAM__H */
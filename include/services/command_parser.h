@@ -39,6 +39,7 @@ typedef struct fsu_service_argument {
   union {
     message_info_t info_msg;
     kvs_entry_t kvs;
+    uint32_t value;
   } as;
 } cp_fsu_service_argument_t;
 
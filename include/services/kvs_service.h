@@ -42,6 +42,27 @@ typedef enum {
   kvs_entry_wifi_password,
   kvs_entry_eye_image_report_interval,
   kvs_entry_eye_info_report_interval,
+  kvs_entry_eye_stream_target_latency,
+  kvs_entry_eye_motion_sensitivity,
+  kvs_entry_eye_heartbeat_interval,
+  kvs_entry_eye_duplicate_distance,
+  kvs_entry_eye_duplicate_refresh,
+  kvs_entry_eye_history_seconds,
+  kvs_entry_eye_history_fps,
+  kvs_entry_eye_burst_post_frames,
+  kvs_entry_eye_camera_frame_size,
+  kvs_entry_eye_camera_quality,
+  kvs_entry_eye_camera_xclk,
+  kvs_entry_eye_camera_fb_count,
+  kvs_entry_eye_camera_still_frame_size,
+  kvs_entry_eye_fresh_capture,
+  kvs_entry_eye_capture_settle_frames,
+  kvs_entry_eye_sensor_idle_seconds,
+  kvs_entry_eye_preview_scale,
+  kvs_entry_eye_crop_region,
+  kvs_entry_eye_image_size_budget,
+  kvs_entry_eye_privacy_masks,
+  kvs_entry_eye_timestamp_overlay,
   kvs_entry_count
 } kvs_entry_id_t;
 
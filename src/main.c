@@ -58,17 +58,21 @@
 
 #define MICROSECONDS              (1000000U)
 
+// The camera diagnostics and the closing brace are appended to this
 #define EYE_APP_PUBLISH_INFO      ("{" \
                                       "\"fsu-eye version\":\"%u.%u.%u\"," \
                                       "\"webserver local ip\":\"%d.%d.%d.%d\"," \
-                                      "\"info report freq\":\"%llu\"" \
-                                      "\"image report freq\":\"%llu\"" \
-                                      "\"uptime\":\"%llu\"" \
-                                  "}")
+                                      "\"info report freq\":\"%llu\"," \
+                                      "\"image report freq\":\"%llu\"," \
+                                      "\"uptime\":\"%llu\"")
 
-#define EYE_APP_PUBLISH_INFO_LEN  (0x100U)
+#define EYE_APP_PUBLISH_INFO_LEN  (0x600U)
+#define EYE_APP_CAMERA_INFO_LEN   (0x500U)
 
 static message_info_t publish_msg;
+// Kept off the app task stack, the camera diagnostics make them large
+static char publish_info_msg[EYE_APP_PUBLISH_INFO_LEN];
+static char camera_info_msg[EYE_APP_CAMERA_INFO_LEN];
 
 static void eye_app(void * pArgument)
 {
@@ -77,9 +81,15 @@ static void eye_app(void * pArgument)
   uint64_t last_time_message = 0;
   uint64_t image_freq = UINT64_MAX;
   uint64_t info_freq = UINT64_MAX;
+  uint64_t heartbeat_freq = UINT64_MAX;
+  uint8_t motion = 0;
 
   ip_address_t ip = {0};
-  char publish_info_msg[EYE_APP_PUBLISH_INFO_LEN] = {'\0'};
+  cam_service_info_t camera_info = {
+    .buf = camera_info_msg,
+    .len = EYE_APP_CAMERA_INFO_LEN
+  };
+  size_t info_len = 0;
 
   kvs_entry_t freq_entry = {
     .key = kvs_entry_count,
@@ -113,18 +123,31 @@ static void eye_app(void * pArgument)
         memset(&ip, 0, sizeof(ip_address_t));
       }
 
-      snprintf(publish_info_msg, EYE_APP_PUBLISH_INFO_LEN, EYE_APP_PUBLISH_INFO, APP_VERSION_MAJOR,
-                                                                                 APP_VERSION_MINOR,
-                                                                                 APP_VERSION_BUILD,
-                                                                                 ip.ip4_addr1,
-                                                                                 ip.ip4_addr2,
-                                                                                 ip.ip4_addr3,
-                                                                                 ip.ip4_addr4,
-                                                                                 image_freq,
-                                                                                 info_freq,
-                                                                                 (current_tic / MICROSECONDS));
+      info_len = snprintf(publish_info_msg, EYE_APP_PUBLISH_INFO_LEN, EYE_APP_PUBLISH_INFO, APP_VERSION_MAJOR,
+                                                                                            APP_VERSION_MINOR,
+                                                                                            APP_VERSION_BUILD,
+                                                                                            ip.ip4_addr1,
+                                                                                            ip.ip4_addr2,
+                                                                                            ip.ip4_addr3,
+                                                                                            ip.ip4_addr4,
+                                                                                            info_freq,
+                                                                                            image_freq,
+                                                                                            (current_tic / MICROSECONDS));
+
+      if (SC_send_cmd(sc_service_camera, CAM_SERVICE_CMD_GET_INFO, &camera_info) == EXIT_SUCCESS
+        && info_len < EYE_APP_PUBLISH_INFO_LEN)
+      {
+        snprintf(&publish_info_msg[info_len], EYE_APP_PUBLISH_INFO_LEN - info_len, ",%s", camera_info_msg);
+      }
+      info_len = strlen(publish_info_msg);
+      if (info_len < EYE_APP_PUBLISH_INFO_LEN - 1)
+      {
+        publish_info_msg[info_len++] = '}';
+        publish_info_msg[info_len] = '\0';
+      }
+
       publish_msg.msg = publish_info_msg;
-      publish_msg.msg_len = strlen(EYE_APP_PUBLISH_INFO);
+      publish_msg.msg_len = info_len;
 
       ESP_LOGI(LOG_TAG, "Sending Info!\n");
       SC_send_cmd(sc_service_aws, AWS_SERVICE_CMD_MQTT_PUBLISH_MESSAGE, &publish_msg);
@@ -143,11 +166,32 @@ static void eye_app(void * pArgument)
       image_freq = UINT64_MAX;
     }
 
+    memset(freq_entry.value, '\0', KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+    freq_entry.key = kvs_entry_eye_heartbeat_interval;
+    SC_send_cmd(sc_service_kvs, KVS_SERVICE_CMD_GET_KEY_VALUE, &freq_entry);
+
+    if ((heartbeat_freq = strtoull(freq_entry.value, NULL, 10)) <= 0)
+    {
+      ESP_LOGI(LOG_TAG, "Error on fetching Heartbeat Frequency from KVS\n");
+      heartbeat_freq = UINT64_MAX;
+    }
+
+    // The image interval limits how often motion uploads, without motion an
+    // image is only uploaded on every heartbeat
     if (current_tic - last_time_camera > MICROSECONDS * image_freq)
     {
-      ESP_LOGI(LOG_TAG, "Taking Picture!\n");
-      SC_send_cmd(sc_service_camera, CAM_SERVICE_CMD_CAPTURE_SEND_IMAGE, NULL);
-      last_time_camera = esp_timer_get_time();
+      if (SC_send_cmd(sc_service_camera, CAM_SERVICE_CMD_GET_MOTION, &motion) != EXIT_SUCCESS)
+      {
+        // Without motion detection fall back to periodic uploads
+        motion = 1;
+      }
+
+      if (motion || current_tic - last_time_camera > MICROSECONDS * heartbeat_freq)
+      {
+        ESP_LOGI(LOG_TAG, "Taking Picture%s!\n", motion ? " on motion" : "");
+        SC_send_cmd(sc_service_camera, CAM_SERVICE_CMD_CAPTURE_SEND_IMAGE, NULL);
+        last_time_camera = esp_timer_get_time();
+      }
     }
 
     vTaskDelay(500 / portTICK_PERIOD_MS);
@@ -25,21 +25,28 @@
 */
 
 #include "aws_service.h"
+#include "camera_service.h"
+#include "camera_latency.h"
+#include "camera_meta.h"
 #include "command_parser.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include "types/iot_mqtt_types.h"
 
 #include "platform/iot_network_freertos.h"
 #include "platform/iot_network.h"
 #include "iot_mqtt.h"
 #include "semphr.h"
+#include "queue.h"
+#include "platform/iot_threads.h"
 
 #include "fsu_eye_aws_credentials.h"
 #include "private/iot_default_root_certificates.h"
 
 #include "aws_dev_mode_key_provisioning.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "jsmn.h"
 #include "stdbool.h"
@@ -61,6 +68,12 @@
 #define PUBLISH_RETRY_LIMIT           (1U)
 #define PUBLISH_RETRY_MS              (1000U)
 
+// Remote camera commands are run by their own task, a capture or restart
+// would otherwise hold up the MQTT callbacks, publish completions included
+#define REMOTE_QUEUE_LEN              (4U)
+#define REMOTE_TASK_PRIORITY          (tskIDLE_PRIORITY + 4U)
+#define REMOTE_TASK_STACKSIZE         (0x1800U)
+
 #define TOPIC_FILTER_COUNT            1
 
 #define FSU_EYE_RULES_TOPIC           "$aws/rules/"
@@ -72,6 +85,8 @@
 #define FSU_EYE_TOPIC_LWT             (FSU_EYE_TOPIC_ROOT "/lwt")
 #define FSU_EYE_TOPIC_INFO            (FSU_EYE_RULES_TOPIC "info_to_s3/" FSU_EYE_TOPIC_ROOT "/info")
 #define FSU_EYE_TOPIC_IMAGE           (FSU_EYE_RULES_TOPIC "image_to_s3/" FSU_EYE_TOPIC_ROOT "/image")
+// An ordinary topic, so that previews can be watched as they come in
+#define FSU_EYE_TOPIC_PREVIEW         (FSU_EYE_TOPIC_ROOT "/preview")
 
 #define LWT_MESSAGE                   ("{"\
                                           "\"id\":\"" FSU_EYE_AWS_IOT_THING_NAME "\"" \
@@ -88,6 +103,23 @@
                                          "\"msg\":" EYE_MSG_INFO_FORMAT ""\
                                        "}")
 
+/*
+* @brief Context of an image publish, from IotMqtt_Publish until its completion
+* callback. Several publishes may be awaiting their PUBACK at the same time.
+*/
+typedef struct aws_publish_context {
+  cam_frame_t *frame;
+  int64_t started;                // esp_timer time the publish was queued
+} aws_publish_context_t;
+
+/*
+* @brief Camera command received over MQTT, waiting for the remote task.
+*/
+typedef struct aws_remote_command {
+  uint8_t cmd;
+  uint32_t value;
+} aws_remote_command_t;
+
 // App version struct, used by OTA Agent to decide if new firmware is an upgrade
 const AppVersion32_t xAppFirmwareVersion =
 {
@@ -102,6 +134,7 @@ static uint8_t _connected = 0;
 static char _payload[EYE_PUBLISH_MAX_LEN];
 static SemaphoreHandle_t _payload_mutex;
 static uint8_t _publish_complete;
+static QueueHandle_t _remote_queue = NULL;
 static cp_fsu_service_argument_t rx_cmd;
 
 
@@ -162,6 +195,24 @@ static int AWS_SERVICE_PKCS11_provision_key(void)
   return EXIT_SUCCESS;
 }
 
+static void AWS_SERVICE_remote_runner(void *arg)
+{
+  aws_remote_command_t command;
+
+  while (1)
+  {
+    if (xQueueReceive(_remote_queue, &command, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+
+    if (SC_send_cmd(sc_service_camera, command.cmd, &command.value) != EXIT_SUCCESS)
+    {
+      ESP_LOGI(LOG_TAG, "Remote camera command %u failed\n", command.cmd);
+    }
+  }
+}
+
 static int AWS_SERVICE_init()
 {
   if (_initialized)
@@ -182,6 +233,21 @@ static int AWS_SERVICE_init()
   memset(_payload, '\0', EYE_PUBLISH_MAX_LEN);
   _payload_mutex = xSemaphoreCreateMutex();
 
+  // The remote task is kept across reinitializations, it only waits on the queue
+  if (NULL == _remote_queue)
+  {
+    if ((_remote_queue = xQueueCreate(REMOTE_QUEUE_LEN, sizeof(aws_remote_command_t))) == NULL
+      || !Iot_CreateDetachedThread(AWS_SERVICE_remote_runner, NULL, REMOTE_TASK_PRIORITY, REMOTE_TASK_STACKSIZE))
+    {
+      ESP_LOGI(LOG_TAG, "Could not create remote command task\n");
+      if (_remote_queue)
+      {
+        vQueueDelete(_remote_queue);
+        _remote_queue = NULL;
+      }
+    }
+  }
+
   // For some reason the MQTT Connect method does not utilize the private key,
   // it is instead always fetched from the internal PKCS11 provisioned list
   AWS_SERVICE_PKCS11_provision_key();
@@ -203,11 +269,27 @@ static void _publish_complete_callback(void *param1,
 {
   ESP_LOGI(LOG_TAG, "MQTT publish complete!\n");
   _publish_complete = 1;
+
+  // The payload of an image publish is a camera frame, which may only be
+  // released now that the library is done with it
+  if (NULL != param1)
+  {
+    aws_publish_context_t *context = (aws_publish_context_t*) param1;
+
+    if (IOT_MQTT_SUCCESS == param->u.operation.result)
+    {
+      CAM_LAT_record(cam_lat_upload, context->frame, context->started, esp_timer_get_time());
+    }
+    CAM_SERVICE_frame_release(context->frame);
+    free(context);
+  }
 }
 
 static void _mqtt_subscription_callback(void *param1,
                                        IotMqttCallbackParam_t *const param)
 {
+  aws_remote_command_t command;
+
   ESP_LOGI(LOG_TAG, "MQTT subscribe received: %.*s\n", param->u.message.info.payloadLength,
                                                              (const char*) param->u.message.info.pPayload);
 
@@ -217,6 +299,7 @@ static void _mqtt_subscription_callback(void *param1,
     if (CP_parse_upstream_json(&rx_cmd, param->u.message.info.pPayload, param->u.message.info.payloadLength) != EXIT_SUCCESS)
     {
       ESP_LOGI(LOG_TAG, "Failed to parse upsteam command\n");
+      return;
     }
 
     switch (rx_cmd.sid)
@@ -225,6 +308,21 @@ static void _mqtt_subscription_callback(void *param1,
         SC_send_cmd(rx_cmd.sid, rx_cmd.cmd, &rx_cmd.as.kvs);
         break;
 
+      case sc_service_camera:
+        // Queries return through local pointers and have no remote counterpart
+        if (CAM_SERVICE_CMD_GET_MOTION == rx_cmd.cmd || CAM_SERVICE_CMD_GET_INFO == rx_cmd.cmd)
+        {
+          ESP_LOGI(LOG_TAG, "Camera command not supported for remote access\n");
+          break;
+        }
+        command.cmd = rx_cmd.cmd;
+        command.value = rx_cmd.as.value;
+        if (NULL == _remote_queue || xQueueSend(_remote_queue, &command, 0) != pdTRUE)
+        {
+          ESP_LOGI(LOG_TAG, "Camera busy, remote command dropped\n");
+        }
+        break;
+
       default:
         ESP_LOGI(LOG_TAG, "Service ID not supported for remote access\n");
     }
@@ -296,7 +394,7 @@ static int AWS_SERVICE_subscribe(IotMqttConnection_t mqtt_connection,
   return status;
 }
 
-static int AWS_SERVICE_mqtt_publish(const void *msg, size_t len, const char *topic, size_t topic_len)
+static int AWS_SERVICE_mqtt_publish(const void *msg, size_t len, const char *topic, size_t topic_len, void *context)
 {
   if (!_initialized || !_connected)
   {
@@ -309,7 +407,7 @@ static int AWS_SERVICE_mqtt_publish(const void *msg, size_t len, const char *top
   _publish_complete = 0;
 
   publish_complete.function = _publish_complete_callback;
-  publish_complete.pCallbackContext = NULL;
+  publish_complete.pCallbackContext = context;
 
   publish_info.qos = IOT_MQTT_QOS_1;
   publish_info.pTopicName = topic;
@@ -333,27 +431,75 @@ static int AWS_SERVICE_mqtt_publish(const void *msg, size_t len, const char *top
   return EXIT_SUCCESS;
 }
 
-static int AWS_SERVICE_publish_image(image_info_t *image_info)
+static int AWS_SERVICE_publish_image(image_info_t *image_info, const char *topic)
 {
+  aws_publish_context_t *context = NULL;
+  cam_frame_t *frame = NULL;
+  cam_frame_t *embedded = NULL;
+  const uint8_t *buf = NULL;
+  size_t len = 0;
+  int status = EXIT_FAILURE;
+
+  if (NULL == image_info)
+  {
+    ESP_LOGW(LOG_TAG, "Provided image was NULL.\n");
+    return EXIT_FAILURE;
+  }
+
+  // Take over the frame reference, it is released by the publish complete
+  // callback, or right here if the publish never got queued
+  frame = image_info->frame;
+  image_info->frame = NULL;
+
   if (!_initialized || !_connected)
   {
+    CAM_SERVICE_frame_release(frame);
     return EXIT_FAILURE;
   }
 
-  if (NULL == image_info)
+  buf = image_info->buf;
+  len = image_info->len;
+
+  // The MQTT library takes the payload as one buffer, the image is copied
+  // together with its metadata. Without memory for that it goes out as is.
+  if (frame && frame->buf == image_info->buf && frame->len == image_info->len
+    && (embedded = CAM_META_embed(frame)) != NULL)
   {
-    ESP_LOGW(LOG_TAG, "Provided image was NULL.\n");
+    CAM_SERVICE_frame_release(frame);
+    frame = embedded;
+    buf = frame->buf;
+    len = frame->len;
+  }
+
+  // The frame goes to the completion callback along with the time it was
+  // sent, the frame may be shared with other consumers and is not written to
+  if ((context = malloc(sizeof(aws_publish_context_t))) == NULL)
+  {
+    CAM_SERVICE_frame_release(frame);
     return EXIT_FAILURE;
   }
+  context->frame = frame;
 
   if(xSemaphoreTake(_payload_mutex, (TickType_t) 10U) == pdTRUE)
   {
-    AWS_SERVICE_mqtt_publish(image_info->buf, image_info->len, FSU_EYE_TOPIC_IMAGE, strlen(FSU_EYE_TOPIC_IMAGE));
+    context->started = esp_timer_get_time();
+    status = AWS_SERVICE_mqtt_publish(buf, len, topic, strlen(topic), context);
     xSemaphoreGive(_payload_mutex);
 
-    return EXIT_SUCCESS;
+    // Never queued, so the completion callback will not run for it
+    if (EXIT_SUCCESS != status)
+    {
+      ESP_LOGW(LOG_TAG, "Image publish could not be queued\n");
+      CAM_SERVICE_frame_release(frame);
+      free(context);
+    }
+
+    return status;
   }
 
+  CAM_SERVICE_frame_release(frame);
+  free(context);
+
   return EXIT_FAILURE;
 }
 
@@ -385,7 +531,7 @@ static int AWS_SERVICE_publish_info(message_info_t *info)
     len = snprintf(_payload, EYE_PUBLISH_MAX_LEN, EYE_INFO_MSG, FSU_EYE_AWS_IOT_THING_NAME, info->msg);
     if (len > 0)
     {
-      AWS_SERVICE_mqtt_publish(_payload, len, FSU_EYE_TOPIC_INFO, strlen(FSU_EYE_TOPIC_INFO));
+      AWS_SERVICE_mqtt_publish(_payload, len, FSU_EYE_TOPIC_INFO, strlen(FSU_EYE_TOPIC_INFO), NULL);
       xSemaphoreGive(_payload_mutex);
 
       return EXIT_SUCCESS;
@@ -489,7 +635,10 @@ static int AWS_SERVICE_recv_msg(uint8_t cmd, void* arg)
       return AWS_SERVICE_publish_info((message_info_t*)arg);
 
     case (AWS_SERVICE_CMD_MQTT_PUBLISH_IMAGE):
-      return AWS_SERVICE_publish_image((image_info_t*)arg);
+      return AWS_SERVICE_publish_image((image_info_t*)arg, FSU_EYE_TOPIC_IMAGE);
+
+    case (AWS_SERVICE_CMD_MQTT_PUBLISH_PREVIEW):
+      return AWS_SERVICE_publish_image((image_info_t*)arg, FSU_EYE_TOPIC_PREVIEW);
   }
   return EXIT_FAILURE;
 }
@@ -0,0 +1,158 @@
+/*
+* @file camera_budget.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_budget.h"
+#include "camera_frame_ring.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#define LOG_TAG                       "CAMERA BUDGET"
+
+#define CAM_BUDGET_QUALITY_WORST      (63U)
+
+// The sensor quality is a quantizer scale, the size of a frame falls roughly
+// with its inverse. The offset keeps the best qualities from blowing up.
+#define CAM_BUDGET_QUALITY_OFFSET     (2U)
+// Fixed point scale of the learned bytes per pixel
+#define CAM_BUDGET_MODEL_SCALE        (256U)
+
+// Stream frames are learned from slowly, captures taken for upload quickly
+#define CAM_BUDGET_OBSERVE_WEIGHT     (8U)
+#define CAM_BUDGET_CAPTURE_WEIGHT     (2U)
+
+// After a quality change the frames queued in the driver still carry the old
+// one, so that many frames are not learned from
+#define CAM_BUDGET_SETTLE_FRAMES      (CAM_RING_MAX_BUFFERS + 1U)
+
+// Predictions aim this far below the budget, in percent
+#define CAM_BUDGET_TARGET_PERCENT     (90U)
+
+// Bytes per pixel times (quality + offset), scaled. 0 until the first frame
+static volatile uint32_t _model = 0;
+
+static uint8_t _observed_quality = 0;
+static uint8_t _settle = CAM_BUDGET_SETTLE_FRAMES;
+
+static cam_budget_stats_t _stats;
+
+static void CAM_BUDGET_learn(size_t len, size_t width, size_t height, pixformat_t format, uint8_t quality, uint32_t weight)
+{
+  uint64_t pixels = (uint64_t) width * height;
+  uint32_t sample = 0;
+  uint32_t model = _model;
+
+  if (PIXFORMAT_JPEG != format || !pixels)
+  {
+    return;
+  }
+
+  sample = (uint32_t) ((uint64_t) len * (quality + CAM_BUDGET_QUALITY_OFFSET) * CAM_BUDGET_MODEL_SCALE / pixels);
+  _model = model ? (uint32_t) (((uint64_t) model * (weight - 1U) + sample) / weight) : sample;
+}
+
+void CAM_BUDGET_observe(const camera_fb_t *fb, uint8_t quality)
+{
+  if (NULL == fb)
+  {
+    return;
+  }
+
+  if (quality != _observed_quality)
+  {
+    _observed_quality = quality;
+    _settle = CAM_BUDGET_SETTLE_FRAMES;
+  }
+
+  if (_settle)
+  {
+    _settle--;
+    return;
+  }
+
+  CAM_BUDGET_learn(fb->len, fb->width, fb->height, fb->format, quality, CAM_BUDGET_OBSERVE_WEIGHT);
+}
+
+uint8_t CAM_BUDGET_quality(framesize_t frame_size, uint8_t quality, size_t budget)
+{
+  uint64_t pixels = 0;
+  uint64_t target = (uint64_t) budget * CAM_BUDGET_TARGET_PERCENT / 100U;
+  uint64_t scale = 0;
+  uint32_t model = _model;
+
+  if (!model || !budget || frame_size >= FRAMESIZE_INVALID)
+  {
+    return quality;
+  }
+
+  pixels = (uint64_t) resolution[frame_size].width * resolution[frame_size].height;
+
+  // Smallest quantizer scale whose expected size fits the target
+  scale = (model * pixels + CAM_BUDGET_MODEL_SCALE * target - 1U) / (CAM_BUDGET_MODEL_SCALE * target);
+  scale = (scale > CAM_BUDGET_QUALITY_OFFSET) ? scale - CAM_BUDGET_QUALITY_OFFSET : 0;
+
+  if (scale > CAM_BUDGET_QUALITY_WORST)
+  {
+    return CAM_BUDGET_QUALITY_WORST;
+  }
+  return (scale > quality) ? (uint8_t) scale : quality;
+}
+
+void CAM_BUDGET_captured(const cam_frame_t *frame, uint8_t quality, size_t budget, uint8_t final)
+{
+  if (NULL == frame)
+  {
+    return;
+  }
+
+  CAM_BUDGET_learn(frame->len, frame->width, frame->height, frame->format, quality, CAM_BUDGET_CAPTURE_WEIGHT);
+
+  if (!final)
+  {
+    _stats.retries++;
+    ESP_LOGI(LOG_TAG, "Capture of %u bytes at quality %u over the budget of %u\n", (uint32_t) frame->len, quality, (uint32_t) budget);
+    return;
+  }
+
+  _stats.captures++;
+  _stats.quality_sum += quality;
+  if (frame->len > budget)
+  {
+    _stats.misses++;
+    ESP_LOGI(LOG_TAG, "Capture of %u bytes at quality %u does not fit the budget of %u\n", (uint32_t) frame->len, quality, (uint32_t) budget);
+  }
+}
+
+void CAM_BUDGET_get_stats(cam_budget_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_budget_stats_t));
+}
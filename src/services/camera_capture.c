@@ -0,0 +1,331 @@
+/*
+* @file camera_capture.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_capture.h"
+#include "camera_service.h"
+#include "camera_power.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "esp_log.h"
+
+#define LOG_TAG                         "CAMERA CAPTURE"
+
+// Time to wait for a frame if the ring is momentarily empty
+#define CAM_CAPTURE_FRAME_WAIT_MS       (2000U)
+
+#define CAM_CAPTURE_ETAG_LEN            (32U)
+#define CAM_CAPTURE_DATE_LEN            (32U)
+#define CAM_CAPTURE_HEADER_LEN          (64U)
+
+// Time deinit waits for requests being answered, bounded by the server send timeout
+#define CAM_CAPTURE_DEINIT_WAIT_MS      (10000U)
+#define CAM_CAPTURE_DEINIT_POLL_MS      (50U)
+
+// Newest frame converted to JPEG, only used if the sensor does not deliver
+// JPEG. JPEG frames are served straight from the ring and never cached here,
+// a cached reference would keep a driver buffer from the producer.
+static cam_frame_t *_converted = NULL;
+static cam_capture_stats_t _stats;
+
+static SemaphoreHandle_t _capture_mutex = NULL;
+static uint8_t _initialized = 0;
+static uint8_t _in_flight = 0;    // Requests being answered, each may hold a ring frame
+
+// Returns the newest frame as JPEG with a reference held
+static cam_frame_t* CAM_CAPTURE_latest()
+{
+  cam_frame_t *frame = NULL;
+  cam_frame_t *jpeg = NULL;
+  cam_frame_t *previous = NULL;
+
+  CAM_POWER_demand();
+  frame = CAM_SERVICE_frame_acquire(0, CAM_CAPTURE_FRAME_WAIT_MS / portTICK_PERIOD_MS);
+
+  if (!frame)
+  {
+    return NULL;
+  }
+
+  if (PIXFORMAT_JPEG == frame->format)
+  {
+    return frame;
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  if (_converted && _converted->seq == frame->seq)
+  {
+    jpeg = _converted;
+    CAM_SERVICE_frame_retain(jpeg);
+  }
+  xSemaphoreGive(_capture_mutex);
+
+  if (!jpeg && (jpeg = CAM_SERVICE_frame_to_jpeg(frame)) != NULL)
+  {
+    CAM_SERVICE_frame_retain(jpeg);
+
+    xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+    previous = _converted;
+    _converted = jpeg;
+    _stats.conversions++;
+    xSemaphoreGive(_capture_mutex);
+
+    CAM_SERVICE_frame_release(previous);
+  }
+
+  CAM_SERVICE_frame_release(frame);
+
+  return jpeg;
+}
+
+// Formats the wall clock time the frame was captured as an HTTP date. The time
+// is taken once as the frame is published, so the date is the same for every
+// request. Fails while the clock was unset, the date would be meaningless.
+static int CAM_CAPTURE_http_date(cam_frame_t *frame, char *date, size_t len)
+{
+  time_t captured = (time_t) (frame->wall_time / 1000000LL);
+  struct tm tm;
+
+  if (!frame->wall_time)
+  {
+    return EXIT_FAILURE;
+  }
+
+  gmtime_r(&captured, &tm);
+
+  if (strftime(date, len, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0)
+  {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Parses an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT" into seconds
+// since the epoch, returns -1 if malformed
+static int64_t CAM_CAPTURE_parse_date(const char *date)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4] = {0};
+  const char *found = NULL;
+  int day = 0, year = 0, hour = 0, minute = 0, second = 0;
+  int m = 0, y = 0;
+  int64_t days = 0;
+
+  if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour, &minute, &second) != 6
+    || strlen(month) != 3 || (found = strstr(months, month)) == NULL || (found - months) % 3
+    || day < 1 || day > 31 || year < 1970 || hour > 23 || minute > 59 || second > 60)
+  {
+    return -1;
+  }
+
+  // Days from the civil date, with March as the first month of the year
+  m = (int) (found - months) / 3 + 1;
+  y = year - (m <= 2);
+  days = (int64_t) 365 * y + y / 4 - y / 100 + y / 400 + (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1 - 719468;
+
+  return days * 86400LL + hour * 3600LL + minute * 60LL + second;
+}
+
+// Reads a request header into the buffer, returns 0 if it is absent or too long
+static uint8_t CAM_CAPTURE_get_header(httpd_req_t *req, const char *field, char *value, size_t len)
+{
+  size_t value_len = httpd_req_get_hdr_value_len(req, field);
+
+  if (0 == value_len || value_len >= len)
+  {
+    return 0;
+  }
+
+  return httpd_req_get_hdr_value_str(req, field, value, len) == ESP_OK;
+}
+
+int CAM_CAPTURE_init()
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (!_capture_mutex && (_capture_mutex = xSemaphoreCreateMutex()) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  memset(&_stats, 0, sizeof(_stats));
+  _initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_CAPTURE_deinit()
+{
+  cam_frame_t *frame = NULL;
+  uint8_t in_flight = 0;
+
+  if (!_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  _initialized = 0;
+  in_flight = _in_flight;
+  xSemaphoreGive(_capture_mutex);
+
+  // New requests are turned away from here on, the ones already taken finish
+  for (uint32_t waited = 0; in_flight && waited < CAM_CAPTURE_DEINIT_WAIT_MS; waited += CAM_CAPTURE_DEINIT_POLL_MS)
+  {
+    vTaskDelay(CAM_CAPTURE_DEINIT_POLL_MS / portTICK_PERIOD_MS);
+
+    xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+    in_flight = _in_flight;
+    xSemaphoreGive(_capture_mutex);
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  frame = _converted;
+  _converted = NULL;
+  xSemaphoreGive(_capture_mutex);
+
+  CAM_SERVICE_frame_release(frame);
+
+  if (in_flight)
+  {
+    ESP_LOGW(LOG_TAG, "%u requests still being answered\n", in_flight);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static esp_err_t CAM_CAPTURE_respond(httpd_req_t *req)
+{
+  cam_frame_t *frame = NULL;
+  char etag[CAM_CAPTURE_ETAG_LEN];
+  char date[CAM_CAPTURE_DATE_LEN];
+  char header[CAM_CAPTURE_HEADER_LEN];
+  int64_t since = 0;
+  uint8_t has_date = 0;
+  uint8_t not_modified = 0;
+  esp_err_t res = ESP_OK;
+
+  if ((frame = CAM_CAPTURE_latest()) == NULL)
+  {
+    ESP_LOGW(LOG_TAG, "No frame available\n");
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // Sequence numbers restart at boot, the capture time keeps tags from two
+  // boots apart
+  snprintf(etag, sizeof(etag), "\"%x-%x\"", frame->seq, (uint32_t) frame->timestamp);
+  has_date = CAM_CAPTURE_http_date(frame, date, sizeof(date)) == EXIT_SUCCESS;
+
+  // If-None-Match takes precedence, If-Modified-Since is only used without it
+  if (CAM_CAPTURE_get_header(req, "If-None-Match", header, sizeof(header)))
+  {
+    not_modified = strstr(header, etag) != NULL || strcmp(header, "*") == 0;
+  }
+  else if (has_date && CAM_CAPTURE_get_header(req, "If-Modified-Since", header, sizeof(header))
+    && (since = CAM_CAPTURE_parse_date(header)) >= 0)
+  {
+    not_modified = frame->wall_time / 1000000LL <= since;
+  }
+
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  if (has_date)
+  {
+    httpd_resp_set_hdr(req, "Last-Modified", date);
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  _stats.requests++;
+  _stats.not_modified += not_modified;
+  xSemaphoreGive(_capture_mutex);
+
+  if (not_modified)
+  {
+    httpd_resp_set_status(req, "304 Not Modified");
+    res = httpd_resp_send(req, NULL, 0);
+  }
+  else
+  {
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    res = httpd_resp_send(req, (const char *) frame->buf, frame->len);
+  }
+
+  CAM_SERVICE_frame_release(frame);
+
+  return res;
+}
+
+esp_err_t CAM_CAPTURE_http_handler(httpd_req_t *req)
+{
+  esp_err_t res = ESP_OK;
+
+  if (NULL == _capture_mutex)
+  {
+    return ESP_FAIL;
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  if (!_initialized)
+  {
+    xSemaphoreGive(_capture_mutex);
+    return ESP_FAIL;
+  }
+  _in_flight++;
+  xSemaphoreGive(_capture_mutex);
+
+  res = CAM_CAPTURE_respond(req);
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  _in_flight--;
+  xSemaphoreGive(_capture_mutex);
+
+  return res;
+}
+
+void CAM_CAPTURE_get_stats(cam_capture_stats_t *stats)
+{
+  if (!_initialized || NULL == stats)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_capture_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_capture_stats_t));
+  xSemaphoreGive(_capture_mutex);
+}
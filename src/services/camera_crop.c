@@ -0,0 +1,171 @@
+/*
+* @file camera_crop.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_crop.h"
+#include "camera_jpeg.h"
+#include "kvs_service.h"
+#include "system_controller.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define LOG_TAG                       "CAMERA CROP"
+
+// Room for DC differences at the left edge of the region that take more
+// bits than in the full frame, per MCU row and component
+#define CAM_CROP_ROW_SLACK            (4U)
+
+/*
+* @brief Region to crop, in percent of the frame.
+*/
+typedef struct cam_crop_region {
+  uint32_t left;
+  uint32_t top;
+  uint32_t width;
+  uint32_t height;
+} cam_crop_region_t;
+
+static cam_crop_stats_t _stats;
+
+// Reads the region from KVS, returns EXIT_FAILURE if it is the whole frame or invalid
+static int CAM_CROP_get_region(cam_crop_region_t *region)
+{
+  kvs_entry_t entry = {
+    .key = kvs_entry_eye_crop_region,
+    .value_len = KVS_SERVICE_MAXIMUM_VALUE_SIZE
+  };
+
+  memset(entry.value, '\0', KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+
+  if (SC_send_cmd(sc_service_kvs, KVS_SERVICE_CMD_GET_KEY_VALUE, &entry) != EXIT_SUCCESS
+    || sscanf(entry.value, "%u,%u,%u,%u", &region->left, &region->top, &region->width, &region->height) != 4)
+  {
+    return EXIT_FAILURE;
+  }
+
+  // Each part is checked on its own first, their sum could wrap
+  if (region->left > 100U || region->top > 100U || region->width > 100U || region->height > 100U
+    || !region->width || !region->height
+    || region->left + region->width > 100U || region->top + region->height > 100U)
+  {
+    ESP_LOGI(LOG_TAG, "Invalid Crop Region <%s>\n", entry.value);
+    return EXIT_FAILURE;
+  }
+
+  return (region->width < 100U || region->height < 100U) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void CAM_CROP_free(cam_frame_t *frame)
+{
+  free(frame->buf);
+  free(frame);
+}
+
+cam_frame_t* CAM_CROP_region(const cam_frame_t *frame)
+{
+  cam_crop_region_t region;
+  cam_jpeg_info_t info;
+  cam_frame_t *cropped = NULL;
+  uint32_t caps = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  int64_t start = esp_timer_get_time();
+  uint16_t mx = 0, my = 0, mw = 0, mh = 0;
+  size_t size = 0;
+
+  if (NULL == frame || PIXFORMAT_JPEG != frame->format
+    || CAM_CROP_get_region(&region) != EXIT_SUCCESS)
+  {
+    return NULL;
+  }
+
+  if (CAM_JPEG_parse(frame->buf, frame->len, &info) != EXIT_SUCCESS)
+  {
+    _stats.failed++;
+    return NULL;
+  }
+
+  // Widened outwards to whole MCUs
+  mx = region.left * info.mcus_x / 100U;
+  my = region.top * info.mcus_y / 100U;
+  mw = ((region.left + region.width) * info.mcus_x + 99U) / 100U - mx;
+  mh = ((region.top + region.height) * info.mcus_y + 99U) / 100U - my;
+
+  // The region holds at most the entropy coded data of its MCUs
+  size = frame->len + (size_t) mh * info.components * CAM_CROP_ROW_SLACK;
+
+  if ((cropped = calloc(1, sizeof(cam_frame_t))) == NULL
+    || (cropped->buf = heap_caps_malloc(size, caps)) == NULL)
+  {
+    free(cropped);
+    _stats.failed++;
+    return NULL;
+  }
+
+  if (CAM_JPEG_crop(frame->buf, frame->len, mx, my, mw, mh, cropped->buf, size, &cropped->len) != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "Frame %u could not be cropped\n", frame->seq);
+    CAM_CROP_free(cropped);
+    _stats.failed++;
+    return NULL;
+  }
+
+  cropped->width = (mx + mw == info.mcus_x) ? info.width - mx * 8U * info.h_max : mw * 8U * info.h_max;
+  cropped->height = (my + mh == info.mcus_y) ? info.height - my * 8U * info.v_max : mh * 8U * info.v_max;
+  cropped->format = PIXFORMAT_JPEG;
+  cropped->seq = frame->seq;
+  cropped->timestamp = frame->timestamp;
+  cropped->captured = frame->captured;
+  cropped->wall_time = frame->wall_time;
+  cropped->encoded = frame->encoded;
+  cropped->quality = frame->quality;
+  cropped->free_fn = CAM_CROP_free;
+  cropped->refs = 1;
+
+  _stats.cropped++;
+  _stats.bytes_saved += (frame->len > cropped->len) ? frame->len - cropped->len : 0;
+  _stats.last_us = (uint32_t) (esp_timer_get_time() - start);
+  if (_stats.last_us > _stats.max_us)
+  {
+    _stats.max_us = _stats.last_us;
+  }
+
+  return cropped;
+}
+
+void CAM_CROP_get_stats(cam_crop_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_crop_stats_t));
+}
@@ -0,0 +1,165 @@
+/*
+* @file camera_dedup.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_dedup.h"
+#include "camera_luma.h"
+#include "kvs_service.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                       "CAMERA DEDUP"
+
+// The plane is reduced to a grid one column wider than high, comparing
+// horizontal neighbours gives 8 bits per row
+#define CAM_DEDUP_HASH_ROWS           (8U)
+#define CAM_DEDUP_HASH_COLS           (CAM_DEDUP_HASH_ROWS + 1U)
+
+#define CAM_DEDUP_DEFAULT_DISTANCE    (4U)
+#define CAM_DEDUP_DEFAULT_REFRESH     (10U)
+
+static cam_luma_t _luma;
+static uint64_t _uploaded_hash = 0;
+static uint8_t _has_uploaded = 0;
+static uint64_t _pending_hash = 0;
+static uint8_t _has_pending = 0;
+static uint32_t _consecutive_skips = 0;
+static cam_dedup_stats_t _stats;
+
+/*
+* @brief Difference hash of a luma plane. Averages the plane down to a 9x8
+* grid and sets a bit wherever a cell is brighter than its right neighbour,
+* which survives recompression, noise and global exposure changes.
+*/
+static uint64_t CAM_DEDUP_dhash(const cam_luma_t *luma)
+{
+  uint32_t cells[CAM_DEDUP_HASH_ROWS][CAM_DEDUP_HASH_COLS];
+  uint16_t x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+  uint32_t sum = 0;
+  uint64_t hash = 0;
+
+  for (uint8_t r = 0; r < CAM_DEDUP_HASH_ROWS; ++r)
+  {
+    y0 = r * luma->height / CAM_DEDUP_HASH_ROWS;
+    y1 = (r + 1) * luma->height / CAM_DEDUP_HASH_ROWS;
+
+    for (uint8_t c = 0; c < CAM_DEDUP_HASH_COLS; ++c)
+    {
+      x0 = c * luma->width / CAM_DEDUP_HASH_COLS;
+      x1 = (c + 1) * luma->width / CAM_DEDUP_HASH_COLS;
+
+      sum = 0;
+      for (uint16_t y = y0; y < y1; ++y)
+      {
+        for (uint16_t x = x0; x < x1; ++x)
+        {
+          sum += luma->data[y * CAM_LUMA_MAX_WIDTH + x];
+        }
+      }
+      // Cells of a row all have the same height, only the width varies
+      cells[r][c] = (x1 > x0) ? sum / (x1 - x0) : 0;
+    }
+  }
+
+  for (uint8_t r = 0; r < CAM_DEDUP_HASH_ROWS; ++r)
+  {
+    for (uint8_t c = 0; c < CAM_DEDUP_HASH_ROWS; ++c)
+    {
+      hash = (hash << 1) | (cells[r][c] > cells[r][c + 1]);
+    }
+  }
+
+  return hash;
+}
+
+uint8_t CAM_DEDUP_is_duplicate(cam_frame_t *frame)
+{
+  uint64_t refresh = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_duplicate_refresh, CAM_DEDUP_DEFAULT_REFRESH);
+  uint64_t max_distance = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_duplicate_distance, CAM_DEDUP_DEFAULT_DISTANCE);
+  int64_t start = esp_timer_get_time();
+  uint32_t elapsed = 0;
+  uint8_t distance = 0;
+
+  _has_pending = 0;
+
+  // Upload anything that cannot be hashed
+  if (NULL == frame || CAM_LUMA_from_frame(frame, &_luma) != EXIT_SUCCESS)
+  {
+    return 0;
+  }
+
+  _pending_hash = CAM_DEDUP_dhash(&_luma);
+  _has_pending = 1;
+
+  elapsed = (uint32_t) (esp_timer_get_time() - start);
+  _stats.checked++;
+  _stats.last_us = elapsed;
+  _stats.total_us += elapsed;
+
+  if (!_has_uploaded || 0 == refresh || _consecutive_skips >= refresh)
+  {
+    return 0;
+  }
+
+  distance = __builtin_popcountll(_pending_hash ^ _uploaded_hash);
+  if (distance > max_distance)
+  {
+    return 0;
+  }
+
+  _consecutive_skips++;
+  _stats.skipped++;
+  _stats.bytes_saved += frame->len;
+
+  ESP_LOGI(LOG_TAG, "Frame %u is %u bits from the last upload, skipped\n", frame->seq, distance);
+
+  return 1;
+}
+
+void CAM_DEDUP_uploaded()
+{
+  _consecutive_skips = 0;
+
+  // Frames that could not be hashed leave the reference as it was
+  if (_has_pending)
+  {
+    _uploaded_hash = _pending_hash;
+    _has_uploaded = 1;
+    _has_pending = 0;
+  }
+}
+
+void CAM_DEDUP_get_stats(cam_dedup_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_dedup_stats_t));
+}
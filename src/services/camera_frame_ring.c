@@ -0,0 +1,447 @@
+/*
+* @file camera_frame_ring.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_frame_ring.h"
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "event_groups.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                   "CAMERA RING"
+
+#define CAM_RING_NEW_FRAME_BIT    (1U << 0)
+#define CAM_RING_RELEASED_BIT     (1U << 1)
+
+// Longest a frame no reader has taken yet is kept from being evicted, readers
+// run at or below the producer priority and need a moment to get to it
+#define CAM_RING_HOLD_US          (100000LL)
+// A reader dropping its reference does not free a frame still in the ring,
+// so nothing signals it. Reclaim looks again this often while frames are held.
+#define CAM_RING_RECLAIM_POLL_MS  (5U)
+// Wall clock times before this are taken as an unset clock, 2021-01-01
+#define CAM_RING_VALID_TIME       (1609459200LL)
+
+// Frame handles for driver buffers, one per buffer the driver may hand out
+static cam_frame_t _pool[CAM_RING_MAX_BUFFERS];
+static uint8_t _taken[CAM_RING_MAX_BUFFERS];   // Set once a reader acquired the frame
+static cam_frame_t *_slots[CAM_RING_MAX_SLOTS];
+static uint8_t _slot_count = 0;
+static uint8_t _buffer_count = 0;
+static uint8_t _outstanding = 0;
+static uint32_t _seq = 0;
+static cam_ring_stats_t _stats;
+
+static SemaphoreHandle_t _ring_mutex;
+static EventGroupHandle_t _ring_events;
+
+static uint8_t _initialized = 0;
+
+// Last reference to a driver frame is gone, hand the buffer back. The bit is
+// set with the mutex held, once CAM_RING_deinit sees the last frame returned
+// no release touches the ring anymore.
+static void CAM_RING_free_frame(cam_frame_t *frame)
+{
+  esp_camera_fb_return(frame->fb);
+
+  xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+  frame->fb = NULL;
+  frame->buf = NULL;
+  _outstanding--;
+  xEventGroupSetBits(_ring_events, CAM_RING_RELEASED_BIT);
+  xSemaphoreGive(_ring_mutex);
+}
+
+// Maps the driver start of frame time, taken from the system clock, onto the
+// esp_timer time the frame was handed out at
+static int64_t CAM_RING_captured(const camera_fb_t *fb, int64_t published)
+{
+  struct timeval now;
+  int64_t age = 0;
+
+  gettimeofday(&now, NULL);
+  age = (int64_t) (now.tv_sec - fb->timestamp.tv_sec) * 1000000LL + (now.tv_usec - fb->timestamp.tv_usec);
+
+  // Drivers that do not stamp their frames leave the capture time unknown
+  if ((!fb->timestamp.tv_sec && !fb->timestamp.tv_usec) || age < 0 || age > published)
+  {
+    return 0;
+  }
+  return published - age;
+}
+
+// Wall clock time the frame was started at, taken once so that every consumer
+// reports the same time for it. 0 while the clock is unset.
+static int64_t CAM_RING_wall_time(const cam_frame_t *frame)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  if (now.tv_sec < CAM_RING_VALID_TIME)
+  {
+    return 0;
+  }
+
+  return (int64_t) now.tv_sec * 1000000LL + now.tv_usec
+    - (esp_timer_get_time() - (frame->captured ? frame->captured : frame->timestamp));
+}
+
+// Must be called with the ring mutex held
+static int CAM_RING_newest(uint32_t after_seq)
+{
+  int newest = -1;
+
+  for (uint8_t i = 0; i < _slot_count; ++i)
+  {
+    if (_slots[i] && _slots[i]->seq > after_seq
+      && (newest < 0 || _slots[i]->seq > _slots[newest]->seq))
+    {
+      newest = i;
+    }
+  }
+  return newest;
+}
+
+// Must be called with the ring mutex held. Counts frames pushed out before
+// any reader got to them.
+static void CAM_RING_evicted(const cam_frame_t *frame)
+{
+  _stats.evicted++;
+  _stats.unread += !_taken[frame - _pool];
+}
+
+// Must be called with the ring mutex held. Prefers an empty slot, otherwise
+// the oldest frame. If only_unused is set, frames held by consumers are skipped.
+static int CAM_RING_oldest(uint8_t only_unused)
+{
+  int oldest = -1;
+
+  for (uint8_t i = 0; i < _slot_count; ++i)
+  {
+    if (!_slots[i])
+    {
+      if (!only_unused)
+      {
+        return i;
+      }
+      continue;
+    }
+    if ((!only_unused || 1 == _slots[i]->refs)
+      && (oldest < 0 || _slots[i]->seq < _slots[oldest]->seq))
+    {
+      oldest = i;
+    }
+  }
+  return oldest;
+}
+
+int CAM_RING_init(uint8_t slots, uint8_t buffers)
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (0 == slots || CAM_RING_MAX_SLOTS < slots
+    || 0 == buffers || CAM_RING_MAX_BUFFERS < buffers)
+  {
+    ESP_LOGW(LOG_TAG, "Invalid ring geometry, %u slots for %u buffers\n", slots, buffers);
+    return EXIT_FAILURE;
+  }
+
+  memset(_pool, 0, sizeof(_pool));
+  memset(_taken, 0, sizeof(_taken));
+  memset(_slots, 0, sizeof(_slots));
+  memset(&_stats, 0, sizeof(_stats));
+  _slot_count = slots;
+  _buffer_count = buffers;
+  _outstanding = 0;
+  _seq = 0;
+
+  _ring_mutex = xSemaphoreCreateMutex();
+  _ring_events = xEventGroupCreate();
+
+  _initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_RING_deinit(TickType_t wait)
+{
+  cam_frame_t *frame = NULL;
+  TickType_t start = xTaskGetTickCount();
+  TickType_t elapsed = 0;
+  uint8_t outstanding = 0;
+
+  if (!_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  for (uint8_t i = 0; i < _slot_count; ++i)
+  {
+    xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+    frame = _slots[i];
+    _slots[i] = NULL;
+    xSemaphoreGive(_ring_mutex);
+
+    if (frame)
+    {
+      CAM_SERVICE_frame_release(frame);
+    }
+  }
+
+  // Frames still handed out, to an upload waiting for its ack for instance,
+  // go back to the driver through the ring once released
+  while (1)
+  {
+    xEventGroupClearBits(_ring_events, CAM_RING_RELEASED_BIT);
+
+    xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+    outstanding = _outstanding;
+    xSemaphoreGive(_ring_mutex);
+
+    if (!outstanding)
+    {
+      break;
+    }
+
+    elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= wait
+      || !(xEventGroupWaitBits(_ring_events, CAM_RING_RELEASED_BIT, pdTRUE, pdFALSE, wait - elapsed) & CAM_RING_RELEASED_BIT))
+    {
+      ESP_LOGW(LOG_TAG, "%u frames still in use, ring kept\n", outstanding);
+      return EXIT_FAILURE;
+    }
+  }
+
+  vEventGroupDelete(_ring_events);
+  vSemaphoreDelete(_ring_mutex);
+  _initialized = 0;
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_RING_publish(camera_fb_t *fb)
+{
+  cam_frame_t *frame = NULL;
+  cam_frame_t *evicted = NULL;
+  sensor_t *s = esp_camera_sensor_get();
+  int slot = -1;
+
+  if (!_initialized || NULL == fb)
+  {
+    return EXIT_FAILURE;
+  }
+
+  xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+
+  for (uint8_t i = 0; i < CAM_RING_MAX_BUFFERS; ++i)
+  {
+    if (!_pool[i].fb)
+    {
+      frame = &_pool[i];
+      break;
+    }
+  }
+
+  if (!frame)
+  {
+    _stats.dropped++;
+    xSemaphoreGive(_ring_mutex);
+
+    esp_camera_fb_return(fb);
+    return EXIT_FAILURE;
+  }
+
+  _taken[frame - _pool] = 0;
+  frame->fb = fb;
+  frame->buf = fb->buf;
+  frame->len = fb->len;
+  frame->width = fb->width;
+  frame->height = fb->height;
+  frame->format = fb->format;
+  frame->seq = ++_seq;
+  frame->timestamp = esp_timer_get_time();
+  frame->captured = CAM_RING_captured(fb, frame->timestamp);
+  frame->wall_time = CAM_RING_wall_time(frame);
+  frame->encoded = (PIXFORMAT_JPEG == fb->format) ? frame->timestamp : 0;
+  // The setting in effect as the frame is handed out, frames already queued
+  // in the driver when it changed still carry the old one
+  frame->quality = (PIXFORMAT_JPEG == fb->format && s) ? s->status.quality : -1;
+  frame->free_fn = CAM_RING_free_frame;
+  frame->refs = 1; // Held by the ring itself
+  _outstanding++;
+
+  slot = CAM_RING_oldest(0);
+  if (_slots[slot])
+  {
+    evicted = _slots[slot];
+    CAM_RING_evicted(evicted);
+  }
+  _slots[slot] = frame;
+  _stats.published++;
+
+  xSemaphoreGive(_ring_mutex);
+
+  if (evicted)
+  {
+    CAM_SERVICE_frame_release(evicted);
+  }
+
+  // Wake every waiting reader, the bit is only a doorbell and is cleared again
+  xEventGroupSetBits(_ring_events, CAM_RING_NEW_FRAME_BIT);
+  xEventGroupClearBits(_ring_events, CAM_RING_NEW_FRAME_BIT);
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_RING_reclaim(TickType_t wait)
+{
+  cam_frame_t *evicted = NULL;
+  TickType_t start = xTaskGetTickCount();
+  TickType_t elapsed = 0;
+  TickType_t poll = CAM_RING_RECLAIM_POLL_MS / portTICK_PERIOD_MS;
+  int slot = -1;
+
+  if (!_initialized)
+  {
+    return EXIT_FAILURE;
+  }
+
+  poll = poll ? poll : 1;
+
+  while (1)
+  {
+    xEventGroupClearBits(_ring_events, CAM_RING_RELEASED_BIT);
+
+    xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+
+    if (_outstanding < _buffer_count)
+    {
+      xSemaphoreGive(_ring_mutex);
+      return EXIT_SUCCESS;
+    }
+
+    // With every buffer in the ring, a single one without PSRAM, the only
+    // frame left to evict may be the one just published. It is kept until a
+    // reader took it, or for a moment if nobody comes for it.
+    slot = CAM_RING_oldest(1);
+    if (slot >= 0 && _slots[slot]->seq == _seq && !_taken[_slots[slot] - _pool]
+      && esp_timer_get_time() - _slots[slot]->timestamp < CAM_RING_HOLD_US)
+    {
+      slot = -1;
+    }
+
+    evicted = NULL;
+    if (slot >= 0)
+    {
+      evicted = _slots[slot];
+      _slots[slot] = NULL;
+      CAM_RING_evicted(evicted);
+    }
+
+    xSemaphoreGive(_ring_mutex);
+
+    if (evicted)
+    {
+      // Nobody else holds it, so this returns the buffer to the driver
+      CAM_SERVICE_frame_release(evicted);
+      continue;
+    }
+
+    elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= wait)
+    {
+      return EXIT_FAILURE;
+    }
+
+    // Woken early if a frame goes back to the driver, otherwise looks again
+    // once readers had a chance to take or drop theirs
+    xEventGroupWaitBits(_ring_events, CAM_RING_RELEASED_BIT, pdTRUE, pdFALSE,
+                        (wait - elapsed < poll) ? wait - elapsed : poll);
+  }
+}
+
+cam_frame_t* CAM_RING_acquire(uint32_t after_seq, TickType_t wait)
+{
+  cam_frame_t *frame = NULL;
+  TickType_t start = xTaskGetTickCount();
+  TickType_t elapsed = 0;
+  int slot = -1;
+
+  if (!_initialized)
+  {
+    return NULL;
+  }
+
+  while (1)
+  {
+    xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+
+    if ((slot = CAM_RING_newest(after_seq)) >= 0)
+    {
+      frame = _slots[slot];
+      _taken[frame - _pool] = 1;
+      CAM_SERVICE_frame_retain(frame);
+    }
+
+    xSemaphoreGive(_ring_mutex);
+
+    if (frame)
+    {
+      return frame;
+    }
+
+    elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= wait)
+    {
+      return NULL;
+    }
+
+    // A frame published between the check above and this wait is picked up
+    // on the next doorbell at the latest, i.e. one frame period later
+    xEventGroupWaitBits(_ring_events, CAM_RING_NEW_FRAME_BIT, pdFALSE, pdFALSE, wait - elapsed);
+  }
+}
+
+void CAM_RING_get_stats(cam_ring_stats_t *stats)
+{
+  if (!_initialized || NULL == stats)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_ring_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_ring_stats_t));
+  xSemaphoreGive(_ring_mutex);
+}
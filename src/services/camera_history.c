@@ -0,0 +1,622 @@
+/*
+* @file camera_history.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_history.h"
+#include "camera_service.h"
+#include "aws_service.h"
+#include "system_controller.h"
+#include "kvs_service.h"
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "event_groups.h"
+#include "platform/iot_threads.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                             "CAMERA HISTORY"
+
+// The arena bounds the history, whatever the configured duration and rate
+#define CAM_HISTORY_ARENA_SIZE              (0x100000U)
+#define CAM_HISTORY_MAX_FRAMES              (64U)
+#define CAM_HISTORY_MAX_FPS                 (10U)
+
+#define CAM_HISTORY_DEFAULT_SECONDS         (5U)
+#define CAM_HISTORY_DEFAULT_FPS             (2U)
+#define CAM_HISTORY_DEFAULT_POST_FRAMES     (10U)
+#define CAM_HISTORY_DEFAULT_CAPTURE_FRAMES  (20U)
+
+#define CAM_HISTORY_RECORD_PRIORITY         (tskIDLE_PRIORITY + 4U)
+#define CAM_HISTORY_RECORD_STACKSIZE        (0x1000U)
+#define CAM_HISTORY_DRAIN_PRIORITY          (tskIDLE_PRIORITY + 3U)
+#define CAM_HISTORY_DRAIN_STACKSIZE         (0x1000U)
+#define CAM_HISTORY_STOP_POLL_MS            (50U)
+
+#define CAM_HISTORY_FRAME_WAIT_MS           (1000U)
+#define CAM_HISTORY_DRAIN_WAIT_MS           (1000U)
+
+#define CAM_HISTORY_BURST_BIT               (1U << 0)   // Burst frames are waiting for upload
+#define CAM_HISTORY_RELEASED_BIT            (1U << 1)   // The frame being uploaded was released
+
+#define CAM_HISTORY_RECORD(i)               (&_records[(_oldest + (i)) % CAM_HISTORY_MAX_FRAMES])
+
+/*
+* @brief A JPEG copied into the arena. Records are laid out in the arena in
+* the order they were recorded, wrapping around at its end.
+*/
+typedef struct cam_history_record {
+  uint32_t offset;
+  uint32_t len;
+  uint32_t seq;
+  int64_t timestamp;
+  uint16_t width;
+  uint16_t height;
+  int16_t quality;
+  uint8_t burst;      // Waiting to be uploaded as part of a burst
+  uint8_t in_flight;  // Being uploaded
+} cam_history_record_t;
+
+// Allocated once and kept, an upload may still point into it after deinit
+static uint8_t *_arena = NULL;
+static cam_history_record_t _records[CAM_HISTORY_MAX_FRAMES];
+static uint8_t _oldest = 0;
+static uint8_t _count = 0;
+static uint32_t _post_frames = 0;   // Frames still to be added to the running burst
+static uint32_t _capture_frames = 0;  // Frames still to be recorded by the running burst capture
+static int64_t _capture_first = 0;    // Publish time of the first and last frame of the burst capture
+static int64_t _capture_last = 0;
+static int64_t _drain_started = 0;    // End of the last burst capture, until its drain completed
+
+// Handle of the burst frame being uploaded, only one is in flight at a time
+static cam_frame_t _drain_frame;
+
+static cam_history_stats_t _stats;
+
+static SemaphoreHandle_t _history_mutex = NULL;
+static EventGroupHandle_t _history_events = NULL;
+
+static volatile uint8_t _record_running = 0;
+static volatile uint8_t _record_active = 0;
+static volatile uint8_t _drain_running = 0;
+static volatile uint8_t _drain_active = 0;
+
+// Must be called with the history mutex held. Frames queued for a burst or
+// being uploaded are never evicted.
+static int CAM_HISTORY_evict_oldest()
+{
+  cam_history_record_t *record = CAM_HISTORY_RECORD(0);
+
+  if (0 == _count || record->burst || record->in_flight)
+  {
+    return EXIT_FAILURE;
+  }
+
+  _stats.bytes -= record->len;
+  _oldest = (_oldest + 1U) % CAM_HISTORY_MAX_FRAMES;
+  _count--;
+  _stats.evicted++;
+
+  return EXIT_SUCCESS;
+}
+
+// Must be called with the history mutex held. Finds room for len bytes after
+// the newest record, wrapping to the start of the arena if needed.
+static int CAM_HISTORY_find_space(uint32_t len, uint32_t *offset)
+{
+  cam_history_record_t *oldest = CAM_HISTORY_RECORD(0);
+  cam_history_record_t *newest = CAM_HISTORY_RECORD(_count - 1U);
+  uint32_t tail = 0;
+
+  if (0 == _count)
+  {
+    *offset = 0;
+    return (len <= CAM_HISTORY_ARENA_SIZE) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (CAM_HISTORY_MAX_FRAMES == _count)
+  {
+    return EXIT_FAILURE;
+  }
+
+  tail = newest->offset + newest->len;
+
+  if (newest->offset >= oldest->offset)
+  {
+    // Used space is one block, free space is after it and before it
+    if (tail + len <= CAM_HISTORY_ARENA_SIZE)
+    {
+      *offset = tail;
+      return EXIT_SUCCESS;
+    }
+    if (len <= oldest->offset)
+    {
+      *offset = 0;
+      return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+  }
+
+  // Used space wraps, free space is between newest and oldest
+  if (tail + len <= oldest->offset)
+  {
+    *offset = tail;
+    return EXIT_SUCCESS;
+  }
+  return EXIT_FAILURE;
+}
+
+static void CAM_HISTORY_record(cam_frame_t *frame, uint64_t seconds)
+{
+  cam_history_record_t *record = NULL;
+  int64_t now = esp_timer_get_time();
+  uint32_t offset = 0;
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+
+  // Age out frames older than the configured history
+  while (_count && now - CAM_HISTORY_RECORD(0)->timestamp > (int64_t) seconds * 1000000LL)
+  {
+    if (CAM_HISTORY_evict_oldest() != EXIT_SUCCESS)
+    {
+      break;
+    }
+  }
+
+  // Only frames belonging to a burst are kept without any history configured
+  if (0 == seconds && 0 == _post_frames && 0 == _capture_frames)
+  {
+    xSemaphoreGive(_history_mutex);
+    return;
+  }
+
+  while (CAM_HISTORY_find_space(frame->len, &offset) != EXIT_SUCCESS)
+  {
+    if (CAM_HISTORY_evict_oldest() != EXIT_SUCCESS)
+    {
+      _stats.dropped++;
+      xSemaphoreGive(_history_mutex);
+      return;
+    }
+  }
+
+  memcpy(&_arena[offset], frame->buf, frame->len);
+
+  record = CAM_HISTORY_RECORD(_count);
+  record->offset = offset;
+  record->len = frame->len;
+  record->seq = frame->seq;
+  record->timestamp = frame->timestamp;
+  record->width = frame->width;
+  record->height = frame->height;
+  record->quality = frame->quality;
+  record->in_flight = 0;
+  record->burst = 0;
+
+  if (_capture_frames)
+  {
+    // Uploaded in one go once the capture is done
+    record->burst = 1;
+  }
+  else if (_post_frames)
+  {
+    record->burst = 1;
+    _post_frames--;
+    xEventGroupSetBits(_history_events, CAM_HISTORY_BURST_BIT);
+  }
+
+  _count++;
+  _stats.bytes += frame->len;
+  _stats.recorded++;
+
+  xSemaphoreGive(_history_mutex);
+}
+
+// Records the next frame of a burst capture. Frames are taken as they come,
+// without throttling, KVS lookups or network I/O in between.
+static void CAM_HISTORY_capture_frame(uint32_t *seq, uint64_t seconds)
+{
+  cam_frame_t *frame = NULL;
+  cam_frame_t *jpeg = NULL;
+  uint32_t frame_seq = 0;
+  int64_t timestamp = 0;
+
+  if ((frame = CAM_SERVICE_frame_acquire(*seq, CAM_HISTORY_FRAME_WAIT_MS / portTICK_PERIOD_MS)) == NULL)
+  {
+    return;
+  }
+
+  frame_seq = frame->seq;
+  timestamp = frame->timestamp;
+  jpeg = CAM_SERVICE_frame_to_jpeg(frame);
+  CAM_SERVICE_frame_release(frame);
+
+  if (jpeg)
+  {
+    CAM_HISTORY_record(jpeg, seconds);
+  }
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  if (!_capture_first)
+  {
+    _capture_first = timestamp;
+  }
+  else if (frame_seq > *seq + 1U)
+  {
+    _stats.capture_missed += frame_seq - *seq - 1U;
+  }
+  _capture_last = timestamp;
+  _stats.capture_frames += (NULL != jpeg);
+
+  if (0 == --_capture_frames)
+  {
+    _stats.capture_fps_tenths = (_capture_last > _capture_first) ?
+      (uint32_t) ((_stats.capture_frames - 1U) * 10000000LL / (_capture_last - _capture_first)) : 0;
+    _drain_started = esp_timer_get_time();
+
+    ESP_LOGI(LOG_TAG, "Burst capture of %u frames at %u.%u fps, %u frames missed\n", _stats.capture_frames,
+             _stats.capture_fps_tenths / 10U, _stats.capture_fps_tenths % 10U, _stats.capture_missed);
+
+    xEventGroupSetBits(_history_events, CAM_HISTORY_BURST_BIT);
+  }
+  xSemaphoreGive(_history_mutex);
+
+  *seq = frame_seq;
+  CAM_SERVICE_frame_release(jpeg);
+}
+
+static void CAM_HISTORY_record_runner(void *arg)
+{
+  cam_frame_t *frame = NULL;
+  cam_frame_t *jpeg = NULL;
+  uint64_t seconds = 0;
+  uint64_t fps = 0;
+  uint32_t seq = 0;
+  int64_t start = 0;
+  int64_t period = 0;
+
+  (void) arg;
+
+  _record_active = 1;
+
+  while (_record_running)
+  {
+    if (_capture_frames)
+    {
+      CAM_HISTORY_capture_frame(&seq, seconds);
+      continue;
+    }
+
+    start = esp_timer_get_time();
+
+    seconds = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_history_seconds, CAM_HISTORY_DEFAULT_SECONDS);
+    fps = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_history_fps, CAM_HISTORY_DEFAULT_FPS);
+    fps = (fps < 1U) ? 1U : ((fps > CAM_HISTORY_MAX_FPS) ? CAM_HISTORY_MAX_FPS : fps);
+    period = 1000000LL / fps;
+
+    if ((frame = CAM_SERVICE_frame_acquire(seq, CAM_HISTORY_FRAME_WAIT_MS / portTICK_PERIOD_MS)) == NULL)
+    {
+      continue;
+    }
+
+    seq = frame->seq;
+    jpeg = CAM_SERVICE_frame_to_jpeg(frame);
+    CAM_SERVICE_frame_release(frame);
+
+    if (jpeg)
+    {
+      CAM_HISTORY_record(jpeg, seconds);
+      CAM_SERVICE_frame_release(jpeg);
+    }
+
+    if (esp_timer_get_time() - start < period)
+    {
+      vTaskDelay((period - (esp_timer_get_time() - start)) / 1000LL / portTICK_PERIOD_MS);
+    }
+  }
+
+  _record_active = 0;
+}
+
+// The upload of a burst frame completed, its record may be evicted again
+static void CAM_HISTORY_drain_released(cam_frame_t *frame)
+{
+  uint8_t pending = 0;
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < _count; ++i)
+  {
+    if (CAM_HISTORY_RECORD(i)->seq == frame->seq)
+    {
+      CAM_HISTORY_RECORD(i)->in_flight = 0;
+    }
+    pending |= CAM_HISTORY_RECORD(i)->burst | CAM_HISTORY_RECORD(i)->in_flight;
+  }
+
+  if (_drain_started && !pending)
+  {
+    _stats.drain_ms = (esp_timer_get_time() - _drain_started) / 1000LL;
+    _drain_started = 0;
+    ESP_LOGI(LOG_TAG, "Burst capture drained in %u ms\n", _stats.drain_ms);
+  }
+  xSemaphoreGive(_history_mutex);
+
+  xEventGroupSetBits(_history_events, CAM_HISTORY_RELEASED_BIT);
+}
+
+// Must be called with the history mutex held. Nothing is uploaded while a
+// burst capture runs, so the capture has the CPU and PSRAM to itself.
+static cam_history_record_t* CAM_HISTORY_next_burst_record()
+{
+  if (_capture_frames)
+  {
+    return NULL;
+  }
+
+  for (uint8_t i = 0; i < _count; ++i)
+  {
+    if (CAM_HISTORY_RECORD(i)->burst)
+    {
+      return CAM_HISTORY_RECORD(i);
+    }
+  }
+  return NULL;
+}
+
+static void CAM_HISTORY_drain_runner(void *arg)
+{
+  cam_history_record_t *record = NULL;
+  image_info_t image;
+
+  (void) arg;
+
+  _drain_active = 1;
+
+  while (_drain_running)
+  {
+    // Wait for the previous upload to let go of the frame handle
+    if (_drain_frame.refs)
+    {
+      xEventGroupWaitBits(_history_events, CAM_HISTORY_RELEASED_BIT, pdTRUE, pdFALSE,
+                          CAM_HISTORY_DRAIN_WAIT_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    xSemaphoreTake(_history_mutex, portMAX_DELAY);
+    if ((record = CAM_HISTORY_next_burst_record()) != NULL)
+    {
+      record->burst = 0;
+      record->in_flight = 1;
+
+      memset(&_drain_frame, 0, sizeof(cam_frame_t));
+      _drain_frame.buf = &_arena[record->offset];
+      _drain_frame.len = record->len;
+      _drain_frame.width = record->width;
+      _drain_frame.height = record->height;
+      _drain_frame.format = PIXFORMAT_JPEG;
+      _drain_frame.seq = record->seq;
+      _drain_frame.timestamp = record->timestamp;
+      _drain_frame.quality = record->quality;
+      _drain_frame.free_fn = CAM_HISTORY_drain_released;
+      _drain_frame.refs = 1;
+    }
+    xSemaphoreGive(_history_mutex);
+
+    if (!record)
+    {
+      xEventGroupWaitBits(_history_events, CAM_HISTORY_BURST_BIT, pdTRUE, pdFALSE,
+                          CAM_HISTORY_DRAIN_WAIT_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    memset(&image, 0, sizeof(image_info_t));
+    image.buf = _drain_frame.buf;
+    image.len = _drain_frame.len;
+    image.width = _drain_frame.width;
+    image.height = _drain_frame.height;
+    image.format = (uint8_t) PIXFORMAT_JPEG;
+    image.frame = &_drain_frame;
+
+    if (SC_send_cmd(sc_service_aws, AWS_SERVICE_CMD_MQTT_PUBLISH_IMAGE, &image) == EXIT_SUCCESS)
+    {
+      _stats.burst_frames++;
+    }
+    else
+    {
+      ESP_LOGW(LOG_TAG, "Burst frame %u could not be uploaded\n", _drain_frame.seq);
+    }
+
+    // The AWS service did not take over the reference
+    if (image.frame)
+    {
+      CAM_SERVICE_frame_release(image.frame);
+    }
+  }
+
+  _drain_active = 0;
+}
+
+int CAM_HISTORY_init()
+{
+  if (_record_running)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (!_arena && (_arena = heap_caps_malloc(CAM_HISTORY_ARENA_SIZE, MALLOC_CAP_SPIRAM)) == NULL)
+  {
+    ESP_LOGI(LOG_TAG, "No PSRAM for the pre-event history, history disabled\n");
+    return EXIT_SUCCESS;
+  }
+
+  if (!_history_mutex)
+  {
+    _history_mutex = xSemaphoreCreateMutex();
+    _history_events = xEventGroupCreate();
+  }
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  // Burst frames left from before a restart are dropped, a record still
+  // being uploaded keeps its place until the upload completes
+  for (uint8_t i = 0; i < _count; ++i)
+  {
+    CAM_HISTORY_RECORD(i)->burst = 0;
+  }
+  while (_count)
+  {
+    if (CAM_HISTORY_evict_oldest() != EXIT_SUCCESS)
+    {
+      break;
+    }
+  }
+  _post_frames = 0;
+  _capture_frames = 0;
+  _capture_first = 0;
+  _drain_started = 0;
+  memset(&_stats, 0, sizeof(_stats));
+  _stats.capacity = CAM_HISTORY_ARENA_SIZE;
+  for (uint8_t i = 0; i < _count; ++i)
+  {
+    _stats.bytes += CAM_HISTORY_RECORD(i)->len;
+  }
+  xSemaphoreGive(_history_mutex);
+
+  _record_running = 1;
+  _drain_running = 1;
+
+  if (!Iot_CreateDetachedThread(CAM_HISTORY_record_runner,
+                                NULL,
+                                CAM_HISTORY_RECORD_PRIORITY,
+                                CAM_HISTORY_RECORD_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create history record task\n");
+    _record_running = 0;
+    _drain_running = 0;
+    return EXIT_FAILURE;
+  }
+
+  if (!Iot_CreateDetachedThread(CAM_HISTORY_drain_runner,
+                                NULL,
+                                CAM_HISTORY_DRAIN_PRIORITY,
+                                CAM_HISTORY_DRAIN_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create history drain task\n");
+    CAM_HISTORY_deinit();
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_HISTORY_deinit()
+{
+  _record_running = 0;
+  _drain_running = 0;
+
+  while (_record_active || _drain_active)
+  {
+    vTaskDelay(CAM_HISTORY_STOP_POLL_MS / portTICK_PERIOD_MS);
+  }
+}
+
+int CAM_HISTORY_trigger()
+{
+  if (!_record_running)
+  {
+    return EXIT_FAILURE;
+  }
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < _count; ++i)
+  {
+    if (!CAM_HISTORY_RECORD(i)->in_flight)
+    {
+      CAM_HISTORY_RECORD(i)->burst = 1;
+    }
+  }
+  _post_frames = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_burst_post_frames, CAM_HISTORY_DEFAULT_POST_FRAMES);
+  _stats.bursts++;
+  xSemaphoreGive(_history_mutex);
+
+  ESP_LOGI(LOG_TAG, "Burst of %u recorded and %u upcoming frames\n", _count, _post_frames);
+
+  xEventGroupSetBits(_history_events, CAM_HISTORY_BURST_BIT);
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_HISTORY_capture(uint32_t frames)
+{
+  if (!_record_running)
+  {
+    return EXIT_FAILURE;
+  }
+
+  frames = frames ? frames : CAM_HISTORY_DEFAULT_CAPTURE_FRAMES;
+  frames = (frames > CAM_HISTORY_MAX_FRAMES) ? CAM_HISTORY_MAX_FRAMES : frames;
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  if (_capture_frames)
+  {
+    xSemaphoreGive(_history_mutex);
+    ESP_LOGI(LOG_TAG, "Burst capture already running\n");
+    return EXIT_FAILURE;
+  }
+  _capture_frames = frames;
+  _capture_first = 0;
+  _capture_last = 0;
+  _stats.captures++;
+  _stats.capture_frames = 0;
+  _stats.capture_missed = 0;
+  xSemaphoreGive(_history_mutex);
+
+  ESP_LOGI(LOG_TAG, "Burst capture of %u frames\n", frames);
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_HISTORY_get_stats(cam_history_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  if (!_history_mutex)
+  {
+    memset(stats, 0, sizeof(cam_history_stats_t));
+    return;
+  }
+
+  xSemaphoreTake(_history_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_history_stats_t));
+  stats->frames = _count;
+  xSemaphoreGive(_history_mutex);
+}
@@ -0,0 +1,1371 @@
+/*
+* @file camera_jpeg.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_jpeg.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "esp_log.h"
+
+#define LOG_TAG                   "CAMERA JPEG"
+
+// Codes up to this length are decoded with a single table lookup, longer
+// ones, which are rare, by walking the canonical code lengths
+#define CAM_JPEG_LOOKUP_BITS      (9U)
+#define CAM_JPEG_MAX_CODE_LEN     (16U)
+#define CAM_JPEG_BLOCK_COEFFS     (64U)
+#define CAM_JPEG_BLOCK_SIDE       (8U)
+// Skip table advance for an end of block, moves past the last coefficient
+#define CAM_JPEG_SKIP_EOB         (CAM_JPEG_BLOCK_COEFFS)
+// Largest DC difference category of 8-bit samples
+#define CAM_JPEG_MAX_DC_SIZE      (11)
+// The reader looks ahead by up to a word, reading further past the end of the
+// data means the scan was cut short
+#define CAM_JPEG_MAX_PADDING      (4U)
+
+// Fixed point precision of the scaled inverse DCT basis
+#define CAM_JPEG_BASIS_BITS       (10U)
+// Dequantized coefficients of 8-bit samples stay well within this, clamping
+// keeps corrupt data from overflowing the scaled inverse DCT
+#define CAM_JPEG_MAX_COEFF        (4095)
+
+#define CAM_JPEG_MARKER_SOF0      (0xC0)
+#define CAM_JPEG_MARKER_SOF1      (0xC1)
+#define CAM_JPEG_MARKER_DHT       (0xC4)
+#define CAM_JPEG_MARKER_SOI       (0xD8)
+#define CAM_JPEG_MARKER_EOI       (0xD9)
+#define CAM_JPEG_MARKER_SOS       (0xDA)
+#define CAM_JPEG_MARKER_DQT       (0xDB)
+#define CAM_JPEG_MARKER_DRI       (0xDD)
+
+#define CAM_JPEG_IS_RST(m)        ((m) >= 0xD0 && (m) <= 0xD7)
+// Every SOFn except the baseline and extended sequential Huffman ones
+#define CAM_JPEG_IS_UNSUPPORTED_SOF(m)  ((m) >= 0xC2 && (m) <= 0xCF \
+                                        && (m) != CAM_JPEG_MARKER_DHT && (m) != 0xC8 && (m) != 0xCC)
+
+/*
+* @brief Huffman table. The code lengths and symbols it was built from are
+* kept, consecutive frames from the sensor carry the same tables and are not
+* rebuilt.
+*/
+typedef struct cam_jpeg_huffman {
+  uint16_t lookup[1U << CAM_JPEG_LOOKUP_BITS];  // (length << 8) | symbol, 0 for longer codes
+  uint16_t skip[1U << CAM_JPEG_LOOKUP_BITS];    // AC only, (length with extra bits << 8) | coefficients advanced
+  int32_t maxcode[CAM_JPEG_MAX_CODE_LEN + 1];   // Largest code of each length, -1 if none
+  int32_t valoffset[CAM_JPEG_MAX_CODE_LEN + 1]; // Offset from a code to its symbol index
+  uint8_t counts[CAM_JPEG_MAX_CODE_LEN];
+  uint8_t symbols[256];
+  uint16_t codes[256];                          // Code of each symbol, for writing
+  uint8_t code_lens[256];                       // Length of the code of each symbol, 0 if not in the table
+  uint16_t total;
+  uint8_t defined;
+} cam_jpeg_huffman_t;
+
+/*
+* @brief Reads the entropy coded data. Bits are kept MSB aligned, stuffed
+* zero bytes are dropped and the reader stops in front of any marker, padding
+* with zeros from there.
+*/
+typedef struct cam_jpeg_bits {
+  const uint8_t *p;
+  const uint8_t *end;
+  uint32_t bits;
+  int32_t count;
+  uint8_t marker;
+  uint32_t padded;    // Zero bytes fed in past the end of the data
+} cam_jpeg_bits_t;
+
+/*
+* @brief Writes entropy coded data, stuffing a zero byte after every 0xFF.
+* Once the output is full it stays full and only records that it overflowed.
+*/
+typedef struct cam_jpeg_writer {
+  uint8_t *p;
+  uint8_t *end;
+  uint32_t bits;
+  int32_t count;
+  uint8_t overflow;
+} cam_jpeg_writer_t;
+
+static cam_jpeg_huffman_t _dc_tables[4];
+static cam_jpeg_huffman_t _ac_tables[4];
+
+// Position in the block of each coefficient in zigzag order
+static const uint8_t _zigzag[CAM_JPEG_BLOCK_COEFFS] = {
+   0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Inverse DCT basis of each scaled block size, c(u) * cos((2x + 1) * u * pi / 2n),
+// and the last coefficient in zigzag order a block of that size needs
+static int32_t _basis[CAM_JPEG_MAX_SCALED_SIZE + 1][CAM_JPEG_MAX_SCALED_SIZE][CAM_JPEG_MAX_SCALED_SIZE];
+static uint8_t _last_coeff[CAM_JPEG_MAX_SCALED_SIZE + 1];
+
+static SemaphoreHandle_t _jpeg_mutex = NULL;
+
+static inline uint16_t CAM_JPEG_be16(const uint8_t *p)
+{
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static int CAM_JPEG_build_huffman(cam_jpeg_huffman_t *table, const uint8_t *counts, const uint8_t *symbols, uint16_t total)
+{
+  uint32_t code = 0;
+  uint16_t k = 0;
+  uint32_t fill = 0;
+  uint8_t size = 0;
+  uint8_t advance = 0;
+
+  // Same table as last time, nothing to do
+  if (table->defined && table->total == total
+    && memcmp(table->counts, counts, CAM_JPEG_MAX_CODE_LEN) == 0
+    && memcmp(table->symbols, symbols, total) == 0)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  table->defined = 0;
+  memset(table->lookup, 0, sizeof(table->lookup));
+  memset(table->skip, 0, sizeof(table->skip));
+  memset(table->code_lens, 0, sizeof(table->code_lens));
+  memcpy(table->counts, counts, CAM_JPEG_MAX_CODE_LEN);
+  memcpy(table->symbols, symbols, total);
+  table->total = total;
+
+  for (uint8_t len = 1; len <= CAM_JPEG_MAX_CODE_LEN; ++len)
+  {
+    // More codes than fit the length would run past the lookup tables
+    if (code + counts[len - 1] > (1U << len))
+    {
+      return EXIT_FAILURE;
+    }
+    table->valoffset[len] = (int32_t) k - (int32_t) code;
+
+    for (uint8_t i = 0; i < counts[len - 1]; ++i, ++k, ++code)
+    {
+      table->codes[symbols[k]] = (uint16_t) code;
+      table->code_lens[symbols[k]] = len;
+
+      if (len <= CAM_JPEG_LOOKUP_BITS)
+      {
+        // Every lookup index starting with this code resolves to it
+        fill = 1U << (CAM_JPEG_LOOKUP_BITS - len);
+        for (uint32_t j = 0; j < fill; ++j)
+        {
+          table->lookup[(code << (CAM_JPEG_LOOKUP_BITS - len)) + j] = (uint16_t) ((len << 8) | symbols[k]);
+        }
+
+        // As an AC table the code and its extra bits can often be skipped in
+        // one step, the value of the coefficient is never needed
+        size = symbols[k] & 0x0F;
+        advance = size ? (symbols[k] >> 4) + 1U : ((0xF0 == symbols[k]) ? 16U : CAM_JPEG_SKIP_EOB);
+        if (len + size <= CAM_JPEG_LOOKUP_BITS)
+        {
+          for (uint32_t j = 0; j < fill; ++j)
+          {
+            table->skip[(code << (CAM_JPEG_LOOKUP_BITS - len)) + j] = (uint16_t) (((len + size) << 8) | advance);
+          }
+        }
+      }
+    }
+
+    table->maxcode[len] = counts[len - 1] ? (int32_t) code - 1 : -1;
+    code <<= 1;
+  }
+
+  table->defined = 1;
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_JPEG_parse_dht(const uint8_t *seg, size_t len)
+{
+  cam_jpeg_huffman_t *table = NULL;
+  uint16_t total = 0;
+
+  while (len >= 1U + CAM_JPEG_MAX_CODE_LEN)
+  {
+    if ((seg[0] >> 4) > 1 || (seg[0] & 0x0F) > 3)
+    {
+      return EXIT_FAILURE;
+    }
+    table = (seg[0] >> 4) ? &_ac_tables[seg[0] & 0x03] : &_dc_tables[seg[0] & 0x03];
+
+    total = 0;
+    for (uint8_t i = 0; i < CAM_JPEG_MAX_CODE_LEN; ++i)
+    {
+      total += seg[1 + i];
+    }
+
+    if (total > 256U || len < 1U + CAM_JPEG_MAX_CODE_LEN + total)
+    {
+      return EXIT_FAILURE;
+    }
+
+    // DC symbols are the size of the difference that follows
+    for (uint16_t i = 0; !(seg[0] >> 4) && i < total; ++i)
+    {
+      if (seg[1 + CAM_JPEG_MAX_CODE_LEN + i] > CAM_JPEG_MAX_DC_SIZE)
+      {
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (CAM_JPEG_build_huffman(table, &seg[1], &seg[1 + CAM_JPEG_MAX_CODE_LEN], total) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+
+    seg += 1U + CAM_JPEG_MAX_CODE_LEN + total;
+    len -= 1U + CAM_JPEG_MAX_CODE_LEN + total;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_JPEG_parse_dqt(const uint8_t *seg, size_t len, cam_jpeg_info_t *info)
+{
+  uint8_t precision = 0;
+
+  while (len >= 1U + CAM_JPEG_BLOCK_COEFFS)
+  {
+    precision = seg[0] >> 4;
+    if ((seg[0] & 0x0F) > 3 || len < 1U + CAM_JPEG_BLOCK_COEFFS * (precision + 1U))
+    {
+      return EXIT_FAILURE;
+    }
+
+    info->dc_quant[seg[0] & 0x03] = precision ? CAM_JPEG_be16(&seg[1]) : seg[1];
+    info->quant[seg[0] & 0x03] = precision ? NULL : &seg[1];
+
+    seg += 1U + CAM_JPEG_BLOCK_COEFFS * (precision + 1U);
+    len -= 1U + CAM_JPEG_BLOCK_COEFFS * (precision + 1U);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_JPEG_parse_sof(const uint8_t *seg, size_t len, cam_jpeg_info_t *info)
+{
+  if (len < 6 || seg[0] != 8)
+  {
+    return EXIT_FAILURE;
+  }
+
+  info->height = CAM_JPEG_be16(&seg[1]);
+  info->width = CAM_JPEG_be16(&seg[3]);
+  info->components = seg[5];
+  info->h_max = 1;
+  info->v_max = 1;
+
+  // A height of zero would be defined by a DNL marker after the scan
+  if (0 == info->width || 0 == info->height
+    || 0 == info->components || CAM_JPEG_MAX_COMPONENTS < info->components
+    || len < 6U + 3U * info->components)
+  {
+    return EXIT_FAILURE;
+  }
+
+  for (uint8_t i = 0; i < info->components; ++i)
+  {
+    info->comp[i].id = seg[6 + 3 * i];
+    info->comp[i].h = seg[7 + 3 * i] >> 4;
+    info->comp[i].v = seg[7 + 3 * i] & 0x0F;
+    info->comp[i].tq = seg[8 + 3 * i] & 0x03;
+
+    if (info->comp[i].h < 1 || info->comp[i].h > 4 || info->comp[i].v < 1 || info->comp[i].v > 4)
+    {
+      return EXIT_FAILURE;
+    }
+    info->h_max = (info->comp[i].h > info->h_max) ? info->comp[i].h : info->h_max;
+    info->v_max = (info->comp[i].v > info->v_max) ? info->comp[i].v : info->v_max;
+  }
+
+  // A single component scan is not interleaved, every block is an MCU
+  if (1 == info->components)
+  {
+    info->comp[0].h = 1;
+    info->comp[0].v = 1;
+    info->h_max = 1;
+    info->v_max = 1;
+  }
+
+  info->mcus_x = (info->width + 8U * info->h_max - 1U) / (8U * info->h_max);
+  info->mcus_y = (info->height + 8U * info->v_max - 1U) / (8U * info->v_max);
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_JPEG_parse_sos(const uint8_t *seg, size_t len, cam_jpeg_info_t *info)
+{
+  uint8_t found = 0;
+
+  // Only a single interleaved scan over every component is supported
+  if (len < 1 || seg[0] != info->components || len < 4U + 2U * info->components)
+  {
+    return EXIT_FAILURE;
+  }
+
+  for (uint8_t i = 0; i < info->components; ++i)
+  {
+    found = 0;
+    for (uint8_t c = 0; c < info->components; ++c)
+    {
+      if (info->comp[c].id == seg[1 + 2 * i])
+      {
+        info->comp[c].td = (seg[2 + 2 * i] >> 4) & 0x03;
+        info->comp[c].ta = seg[2 + 2 * i] & 0x03;
+        found = 1;
+      }
+    }
+    if (!found)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Walks the marker segments up to the scan. Huffman tables are only built
+// when requested, which requires the scanner mutex to be held.
+static int CAM_JPEG_parse_headers(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, uint8_t build_tables)
+{
+  size_t pos = 2;
+  size_t seg_len = 0;
+  uint8_t marker = 0;
+  uint8_t has_frame = 0;
+
+  if (NULL == buf || NULL == info || len < 4
+    || buf[0] != 0xFF || buf[1] != CAM_JPEG_MARKER_SOI)
+  {
+    return EXIT_FAILURE;
+  }
+
+  memset(info, 0, sizeof(cam_jpeg_info_t));
+
+  while (pos + 1 < len)
+  {
+    if (buf[pos] != 0xFF)
+    {
+      return EXIT_FAILURE;
+    }
+    // Any number of fill bytes may precede a marker
+    while (pos < len && 0xFF == buf[pos])
+    {
+      pos++;
+    }
+    if (pos >= len)
+    {
+      return EXIT_FAILURE;
+    }
+
+    marker = buf[pos++];
+    if (CAM_JPEG_IS_RST(marker) || 0x01 == marker)
+    {
+      continue;
+    }
+    if (CAM_JPEG_MARKER_EOI == marker || pos + 2 > len)
+    {
+      return EXIT_FAILURE;
+    }
+
+    seg_len = CAM_JPEG_be16(&buf[pos]);
+    if (seg_len < 2 || pos + seg_len > len)
+    {
+      return EXIT_FAILURE;
+    }
+
+    switch (marker)
+    {
+      case CAM_JPEG_MARKER_SOF0:
+      case CAM_JPEG_MARKER_SOF1:
+        if (CAM_JPEG_parse_sof(&buf[pos + 2], seg_len - 2, info) != EXIT_SUCCESS)
+        {
+          return EXIT_FAILURE;
+        }
+        info->sof_offset = pos;
+        has_frame = 1;
+        break;
+      case CAM_JPEG_MARKER_DHT:
+        if (build_tables && CAM_JPEG_parse_dht(&buf[pos + 2], seg_len - 2) != EXIT_SUCCESS)
+        {
+          return EXIT_FAILURE;
+        }
+        break;
+      case CAM_JPEG_MARKER_DQT:
+        if (CAM_JPEG_parse_dqt(&buf[pos + 2], seg_len - 2, info) != EXIT_SUCCESS)
+        {
+          return EXIT_FAILURE;
+        }
+        break;
+      case CAM_JPEG_MARKER_DRI:
+        if (seg_len < 4)
+        {
+          return EXIT_FAILURE;
+        }
+        info->restart_interval = CAM_JPEG_be16(&buf[pos + 2]);
+        info->dri_offset = pos - 2;
+        break;
+      case CAM_JPEG_MARKER_SOS:
+        if (!has_frame || CAM_JPEG_parse_sos(&buf[pos + 2], seg_len - 2, info) != EXIT_SUCCESS)
+        {
+          return EXIT_FAILURE;
+        }
+        info->header_len = pos + seg_len;
+        return EXIT_SUCCESS;
+      default:
+        if (CAM_JPEG_IS_UNSUPPORTED_SOF(marker))
+        {
+          // Progressive, lossless and arithmetic coded frames
+          return EXIT_FAILURE;
+        }
+        break;
+    }
+
+    pos += seg_len;
+  }
+
+  return EXIT_FAILURE;
+}
+
+static inline void CAM_JPEG_fill(cam_jpeg_bits_t *r)
+{
+  uint32_t byte = 0;
+
+  while (r->count <= 24)
+  {
+    byte = 0;
+    if (!r->marker && r->p >= r->end)
+    {
+      r->padded++;
+    }
+    else if (!r->marker)
+    {
+      byte = *r->p;
+      if (0xFF != byte)
+      {
+        r->p++;
+      }
+      else if (r->p + 1 < r->end && 0x00 == r->p[1])
+      {
+        r->p += 2;
+      }
+      else
+      {
+        // Leave the marker for the restart handling
+        r->marker = 1;
+        byte = 0;
+      }
+    }
+    r->bits |= byte << (24 - r->count);
+    r->count += 8;
+  }
+}
+
+static inline void CAM_JPEG_consume(cam_jpeg_bits_t *r, uint8_t n)
+{
+  r->bits <<= n;
+  r->count -= n;
+}
+
+static inline int CAM_JPEG_decode(cam_jpeg_bits_t *r, const cam_jpeg_huffman_t *table)
+{
+  uint32_t entry = 0;
+  uint32_t code = 0;
+
+  CAM_JPEG_fill(r);
+
+  entry = table->lookup[r->bits >> (32 - CAM_JPEG_LOOKUP_BITS)];
+  if (entry)
+  {
+    CAM_JPEG_consume(r, entry >> 8);
+    return entry & 0xFF;
+  }
+
+  for (uint8_t len = CAM_JPEG_LOOKUP_BITS + 1; len <= CAM_JPEG_MAX_CODE_LEN; ++len)
+  {
+    code = r->bits >> (32 - len);
+    if ((int32_t) code <= table->maxcode[len])
+    {
+      CAM_JPEG_consume(r, len);
+      return table->symbols[(int32_t) code + table->valoffset[len]];
+    }
+  }
+
+  return -1;
+}
+
+static inline int32_t CAM_JPEG_receive_extend(cam_jpeg_bits_t *r, uint8_t size)
+{
+  int32_t value = 0;
+
+  if (!size)
+  {
+    return 0;
+  }
+
+  CAM_JPEG_fill(r);
+  value = r->bits >> (32 - size);
+  CAM_JPEG_consume(r, size);
+
+  if (value < (1 << (size - 1)))
+  {
+    value -= (1 << size) - 1;
+  }
+  return value;
+}
+
+static inline uint32_t CAM_JPEG_receive(cam_jpeg_bits_t *r, uint8_t size)
+{
+  uint32_t value = 0;
+
+  if (!size)
+  {
+    return 0;
+  }
+
+  CAM_JPEG_fill(r);
+  value = r->bits >> (32 - size);
+  CAM_JPEG_consume(r, size);
+
+  return value;
+}
+
+static inline void CAM_JPEG_put(cam_jpeg_writer_t *w, uint32_t value, uint8_t n)
+{
+  uint8_t byte = 0;
+
+  if (!n)
+  {
+    return;
+  }
+
+  w->bits |= (value & ((1U << n) - 1U)) << (32 - w->count - n);
+  w->count += n;
+
+  while (w->count >= 8)
+  {
+    byte = w->bits >> 24;
+    if (w->p + ((0xFF == byte) ? 2 : 1) > w->end)
+    {
+      w->overflow = 1;
+      w->count = 0;
+      w->bits = 0;
+      return;
+    }
+    *w->p++ = byte;
+    if (0xFF == byte)
+    {
+      *w->p++ = 0x00;
+    }
+    w->bits <<= 8;
+    w->count -= 8;
+  }
+}
+
+// Pads the last byte with one bits
+static inline void CAM_JPEG_flush(cam_jpeg_writer_t *w)
+{
+  if (w->count)
+  {
+    CAM_JPEG_put(w, 0x7F, 8 - w->count);
+  }
+}
+
+static inline int CAM_JPEG_put_symbol(cam_jpeg_writer_t *w, const cam_jpeg_huffman_t *table, uint8_t symbol)
+{
+  if (!table->code_lens[symbol])
+  {
+    return EXIT_FAILURE;
+  }
+  CAM_JPEG_put(w, table->codes[symbol], table->code_lens[symbol]);
+  return EXIT_SUCCESS;
+}
+
+// Decodes and throws away the AC coefficients of a block from the k-th on
+static inline int CAM_JPEG_skip_ac(cam_jpeg_bits_t *r, const cam_jpeg_huffman_t *table, uint8_t k)
+{
+  uint32_t entry = 0;
+  int rs = 0;
+
+  while (k < CAM_JPEG_BLOCK_COEFFS)
+  {
+    CAM_JPEG_fill(r);
+
+    entry = table->skip[r->bits >> (32 - CAM_JPEG_LOOKUP_BITS)];
+    if (entry)
+    {
+      CAM_JPEG_consume(r, entry >> 8);
+      k += entry & 0xFF;
+      continue;
+    }
+
+    if ((rs = CAM_JPEG_decode(r, table)) < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+    if (rs & 0x0F)
+    {
+      CAM_JPEG_fill(r);
+      CAM_JPEG_consume(r, rs & 0x0F);
+      k += (rs >> 4) + 1;
+    }
+    else if (0xF0 == rs)
+    {
+      // Run of sixteen zeros
+      k += 16;
+    }
+    else
+    {
+      // End of block
+      break;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static inline int32_t CAM_JPEG_clamp_coeff(int32_t value)
+{
+  return (value < -CAM_JPEG_MAX_COEFF) ? -CAM_JPEG_MAX_COEFF : ((value > CAM_JPEG_MAX_COEFF) ? CAM_JPEG_MAX_COEFF : value);
+}
+
+// Decodes the AC coefficients of a block up to the last-th in zigzag order
+// and stores them dequantized at their block position. Returns the index of
+// the next coefficient, past the end of the block if it ended, or -1.
+static inline int CAM_JPEG_decode_ac(cam_jpeg_bits_t *r, const cam_jpeg_huffman_t *table, const uint8_t *quant,
+                                     uint8_t last, int32_t *coef)
+{
+  int rs = 0;
+  uint8_t k = 1;
+  int32_t value = 0;
+
+  while (k <= last)
+  {
+    if ((rs = CAM_JPEG_decode(r, table)) < 0)
+    {
+      return -1;
+    }
+
+    if (rs & 0x0F)
+    {
+      k += rs >> 4;
+      value = CAM_JPEG_receive_extend(r, rs & 0x0F);
+      if (k <= last)
+      {
+        coef[_zigzag[k]] = CAM_JPEG_clamp_coeff(value * quant[k]);
+      }
+      k++;
+    }
+    else if (0xF0 == rs)
+    {
+      k += 16;
+    }
+    else
+    {
+      return CAM_JPEG_BLOCK_COEFFS;
+    }
+  }
+
+  return k;
+}
+
+// Inverse DCT of the size by size low frequency coefficients of a block. Up
+// to the level shift this is the 8x8 inverse DCT evaluated at the centers of
+// size by size groups of pixels, so every output pixel is close to the mean
+// of the pixels it stands for.
+static void CAM_JPEG_idct_scaled(const int32_t *coef, uint8_t size, uint8_t *pixels)
+{
+  int32_t rows[CAM_JPEG_MAX_SCALED_SIZE][CAM_JPEG_MAX_SCALED_SIZE];
+  int32_t sum = 0;
+
+  for (uint8_t v = 0; v < size; ++v)
+  {
+    for (uint8_t x = 0; x < size; ++x)
+    {
+      sum = 0;
+      for (uint8_t u = 0; u < size; ++u)
+      {
+        sum += coef[v * CAM_JPEG_BLOCK_SIDE + u] * _basis[size][x][u];
+      }
+      rows[v][x] = (sum + (1 << (CAM_JPEG_BASIS_BITS - 1))) >> CAM_JPEG_BASIS_BITS;
+    }
+  }
+
+  for (uint8_t y = 0; y < size; ++y)
+  {
+    for (uint8_t x = 0; x < size; ++x)
+    {
+      sum = 0;
+      for (uint8_t v = 0; v < size; ++v)
+      {
+        sum += rows[v][x] * _basis[size][y][v];
+      }
+      // Divided by four for the 2D normalization, then level shifted
+      sum = ((sum + (1 << (CAM_JPEG_BASIS_BITS + 1))) >> (CAM_JPEG_BASIS_BITS + 2)) + 128;
+      pixels[y * size + x] = (sum < 0) ? 0 : ((sum > 255) ? 255 : sum);
+    }
+  }
+}
+
+// Drops the remaining bits and moves past the next restart marker
+static int CAM_JPEG_restart(cam_jpeg_bits_t *r)
+{
+  r->bits = 0;
+  r->count = 0;
+  r->marker = 0;
+
+  while (r->p + 1 < r->end && !(0xFF == r->p[0] && CAM_JPEG_IS_RST(r->p[1])))
+  {
+    r->p++;
+  }
+  if (r->p + 1 >= r->end)
+  {
+    return EXIT_FAILURE;
+  }
+  r->p += 2;
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_JPEG_init()
+{
+  if (!_jpeg_mutex && (_jpeg_mutex = xSemaphoreCreateMutex()) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  for (uint8_t size = 1; size <= CAM_JPEG_MAX_SCALED_SIZE; size <<= 1)
+  {
+    for (uint8_t x = 0; x < size; ++x)
+    {
+      for (uint8_t u = 0; u < size; ++u)
+      {
+        _basis[size][x][u] = (int32_t) lroundf((1U << CAM_JPEG_BASIS_BITS) * (u ? 1.0f : (float) M_SQRT1_2)
+                                               * cosf((2U * x + 1U) * u * (float) M_PI / (2U * size)));
+      }
+    }
+
+    for (uint8_t k = 0; k < CAM_JPEG_BLOCK_COEFFS; ++k)
+    {
+      if (_zigzag[k] / CAM_JPEG_BLOCK_SIDE < size && _zigzag[k] % CAM_JPEG_BLOCK_SIDE < size)
+      {
+        _last_coeff[size] = k;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_JPEG_parse(const uint8_t *buf, size_t len, cam_jpeg_info_t *info)
+{
+  return CAM_JPEG_parse_headers(buf, len, info, 0);
+}
+
+// Must be called with the scanner mutex held. With a size of 1 only the DC
+// coefficients are kept and reported through dc_cb if given, otherwise every
+// block is reported scaled through block_cb.
+static int CAM_JPEG_scan_blocks(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, uint8_t size,
+                                cam_jpeg_dc_cb dc_cb, cam_jpeg_block_cb block_cb, void *arg)
+{
+  cam_jpeg_bits_t reader;
+  int32_t pred[CAM_JPEG_MAX_COMPONENTS] = {0};
+  int32_t coef[CAM_JPEG_BLOCK_COEFFS];
+  uint8_t pixels[CAM_JPEG_MAX_SCALED_SIZE * CAM_JPEG_MAX_SCALED_SIZE];
+  const cam_jpeg_huffman_t *dc = NULL;
+  const cam_jpeg_huffman_t *ac = NULL;
+  const uint8_t *quant = NULL;
+  uint16_t restarts_left = info->restart_interval;
+  uint16_t bx = 0;
+  uint16_t by = 0;
+  int32_t level = 0;
+  int size_dc = 0;
+  int k = 0;
+
+  for (uint8_t c = 0; c < info->components; ++c)
+  {
+    if (!_dc_tables[info->comp[c].td].defined || !_ac_tables[info->comp[c].ta].defined
+      || (size > 1 && NULL == info->quant[info->comp[c].tq]))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  memset(&reader, 0, sizeof(reader));
+  reader.p = buf + info->header_len;
+  reader.end = buf + len;
+
+  for (uint16_t my = 0; my < info->mcus_y; ++my)
+  {
+    for (uint16_t mx = 0; mx < info->mcus_x; ++mx)
+    {
+      if (info->restart_interval)
+      {
+        if (0 == restarts_left)
+        {
+          if (CAM_JPEG_restart(&reader) != EXIT_SUCCESS)
+          {
+            return EXIT_FAILURE;
+          }
+          memset(pred, 0, sizeof(pred));
+          restarts_left = info->restart_interval;
+        }
+        restarts_left--;
+      }
+
+      for (uint8_t c = 0; c < info->components; ++c)
+      {
+        dc = &_dc_tables[info->comp[c].td];
+        ac = &_ac_tables[info->comp[c].ta];
+        quant = info->quant[info->comp[c].tq];
+
+        for (uint8_t v = 0; v < info->comp[c].v; ++v)
+        {
+          for (uint8_t h = 0; h < info->comp[c].h; ++h)
+          {
+            if ((size_dc = CAM_JPEG_decode(&reader, dc)) < 0 || size_dc > CAM_JPEG_MAX_DC_SIZE)
+            {
+              ESP_LOGW(LOG_TAG, "Invalid DC code at offset %u\n", (uint32_t) (reader.p - buf));
+              return EXIT_FAILURE;
+            }
+            pred[c] += CAM_JPEG_receive_extend(&reader, size_dc);
+
+            bx = mx * info->comp[c].h + h;
+            by = my * info->comp[c].v + v;
+
+            if (1 == size)
+            {
+              k = 1;
+            }
+            else
+            {
+              for (uint8_t i = 0; i < size; ++i)
+              {
+                memset(&coef[i * CAM_JPEG_BLOCK_SIDE], 0, size * sizeof(int32_t));
+              }
+              coef[0] = CAM_JPEG_clamp_coeff(pred[c] * quant[0]);
+              k = CAM_JPEG_decode_ac(&reader, ac, quant, _last_coeff[size], coef);
+            }
+
+            if (k < 0 || CAM_JPEG_skip_ac(&reader, ac, k) != EXIT_SUCCESS)
+            {
+              ESP_LOGW(LOG_TAG, "Invalid AC code at offset %u\n", (uint32_t) (reader.p - buf));
+              return EXIT_FAILURE;
+            }
+
+            if (size > 1)
+            {
+              CAM_JPEG_idct_scaled(coef, size, pixels);
+              block_cb(arg, c, bx, by, pixels, size);
+              continue;
+            }
+
+            // The DC coefficient is eight times the block mean, level shifted
+            level = pred[c] * info->dc_quant[info->comp[c].tq] / 8 + 128;
+            level = (level < 0) ? 0 : ((level > 255) ? 255 : level);
+
+            if (dc_cb)
+            {
+              dc_cb(arg, c, bx, by, (uint8_t) level);
+            }
+            else
+            {
+              pixels[0] = (uint8_t) level;
+              block_cb(arg, c, bx, by, pixels, 1);
+            }
+          }
+        }
+      }
+    }
+
+    if (reader.padded > CAM_JPEG_MAX_PADDING)
+    {
+      ESP_LOGW(LOG_TAG, "Scan ends early in MCU row %u\n", my);
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_JPEG_scan_dc(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, cam_jpeg_dc_cb cb, void *arg)
+{
+  cam_jpeg_info_t local;
+  int res = EXIT_FAILURE;
+
+  if (NULL == _jpeg_mutex || NULL == cb)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (NULL == info)
+  {
+    info = &local;
+  }
+
+  xSemaphoreTake(_jpeg_mutex, portMAX_DELAY);
+
+  if (CAM_JPEG_parse_headers(buf, len, info, 1) == EXIT_SUCCESS)
+  {
+    res = CAM_JPEG_scan_blocks(buf, len, info, 1, cb, NULL, arg);
+  }
+
+  xSemaphoreGive(_jpeg_mutex);
+
+  return res;
+}
+
+int CAM_JPEG_scan_scaled(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, uint8_t size, cam_jpeg_block_cb cb, void *arg)
+{
+  cam_jpeg_info_t local;
+  int res = EXIT_FAILURE;
+
+  if (NULL == _jpeg_mutex || NULL == cb
+    || !size || size > CAM_JPEG_MAX_SCALED_SIZE || (size & (size - 1)))
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (NULL == info)
+  {
+    info = &local;
+  }
+
+  xSemaphoreTake(_jpeg_mutex, portMAX_DELAY);
+
+  if (CAM_JPEG_parse_headers(buf, len, info, 1) == EXIT_SUCCESS)
+  {
+    res = CAM_JPEG_scan_blocks(buf, len, info, size, NULL, cb, arg);
+  }
+
+  xSemaphoreGive(_jpeg_mutex);
+
+  return res;
+}
+
+// Copies the AC coefficients of a block from the reader to the writer, code
+// by code and with their extra bits untouched
+static int CAM_JPEG_copy_ac(cam_jpeg_bits_t *r, cam_jpeg_writer_t *w, const cam_jpeg_huffman_t *table)
+{
+  int rs = 0;
+  uint8_t k = 1;
+
+  while (k < CAM_JPEG_BLOCK_COEFFS)
+  {
+    if ((rs = CAM_JPEG_decode(r, table)) < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+    CAM_JPEG_put(w, table->codes[rs], table->code_lens[rs]);
+    CAM_JPEG_put(w, CAM_JPEG_receive(r, rs & 0x0F), rs & 0x0F);
+
+    if (!(rs & 0x0F) && 0xF0 != rs)
+    {
+      // End of block
+      break;
+    }
+    k += (rs & 0x0F) ? (rs >> 4) + 1 : 16;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Codes the DC difference with its extra bits
+static int CAM_JPEG_put_dc(cam_jpeg_writer_t *w, const cam_jpeg_huffman_t *table, int32_t diff)
+{
+  uint8_t bits = 0;
+
+  while ((diff < 0 ? -diff : diff) >> bits)
+  {
+    bits++;
+  }
+
+  if (bits > CAM_JPEG_MAX_DC_SIZE || CAM_JPEG_put_symbol(w, table, bits) != EXIT_SUCCESS)
+  {
+    ESP_LOGW(LOG_TAG, "DC difference of %d can not be coded\n", diff);
+    return EXIT_FAILURE;
+  }
+  CAM_JPEG_put(w, (diff < 0) ? diff + (1 << bits) - 1 : diff, bits);
+
+  return EXIT_SUCCESS;
+}
+
+// Copies the headers as they are, without the restart interval, and returns
+// their length. The offset of the frame header in the copy is set in sof_offset.
+static size_t CAM_JPEG_copy_headers(const uint8_t *buf, const cam_jpeg_info_t *info, uint8_t *out, size_t *sof_offset)
+{
+  *sof_offset = info->sof_offset - ((info->dri_offset && info->dri_offset < info->sof_offset) ? 6U : 0U);
+
+  if (info->dri_offset)
+  {
+    memcpy(out, buf, info->dri_offset);
+    memcpy(out + info->dri_offset, buf + info->dri_offset + 6U, info->header_len - info->dri_offset - 6U);
+    return info->header_len - 6U;
+  }
+
+  memcpy(out, buf, info->header_len);
+  return info->header_len;
+}
+
+// Must be called with the scanner mutex held
+static int CAM_JPEG_crop_blocks(const uint8_t *buf, size_t len, const cam_jpeg_info_t *info,
+                                uint16_t mx0, uint16_t my0, uint16_t mw, uint16_t mh, cam_jpeg_writer_t *w)
+{
+  cam_jpeg_bits_t reader;
+  int32_t pred[CAM_JPEG_MAX_COMPONENTS] = {0};
+  int32_t out_pred[CAM_JPEG_MAX_COMPONENTS] = {0};
+  const cam_jpeg_huffman_t *dc = NULL;
+  const cam_jpeg_huffman_t *ac = NULL;
+  uint16_t restarts_left = info->restart_interval;
+  uint8_t inside = 0;
+  int size = 0;
+
+  for (uint8_t c = 0; c < info->components; ++c)
+  {
+    if (!_dc_tables[info->comp[c].td].defined || !_ac_tables[info->comp[c].ta].defined)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  memset(&reader, 0, sizeof(reader));
+  reader.p = buf + info->header_len;
+  reader.end = buf + len;
+
+  // Nothing below the rectangle is needed
+  for (uint16_t my = 0; my < my0 + mh; ++my)
+  {
+    for (uint16_t mx = 0; mx < info->mcus_x; ++mx)
+    {
+      if (info->restart_interval)
+      {
+        if (0 == restarts_left)
+        {
+          if (CAM_JPEG_restart(&reader) != EXIT_SUCCESS)
+          {
+            return EXIT_FAILURE;
+          }
+          memset(pred, 0, sizeof(pred));
+          restarts_left = info->restart_interval;
+        }
+        restarts_left--;
+      }
+
+      inside = my >= my0 && mx >= mx0 && mx < mx0 + mw;
+
+      for (uint8_t c = 0; c < info->components; ++c)
+      {
+        dc = &_dc_tables[info->comp[c].td];
+        ac = &_ac_tables[info->comp[c].ta];
+
+        for (uint8_t b = 0; b < info->comp[c].h * info->comp[c].v; ++b)
+        {
+          if ((size = CAM_JPEG_decode(&reader, dc)) < 0 || size > CAM_JPEG_MAX_DC_SIZE)
+          {
+            ESP_LOGW(LOG_TAG, "Invalid DC code at offset %u\n", (uint32_t) (reader.p - buf));
+            return EXIT_FAILURE;
+          }
+          pred[c] += CAM_JPEG_receive_extend(&reader, size);
+
+          if (!inside)
+          {
+            if (CAM_JPEG_skip_ac(&reader, ac, 1) != EXIT_SUCCESS)
+            {
+              ESP_LOGW(LOG_TAG, "Invalid AC code at offset %u\n", (uint32_t) (reader.p - buf));
+              return EXIT_FAILURE;
+            }
+            continue;
+          }
+
+          // The DC difference is taken to the previous block of the output
+          if (CAM_JPEG_put_dc(w, dc, pred[c] - out_pred[c]) != EXIT_SUCCESS)
+          {
+            return EXIT_FAILURE;
+          }
+          out_pred[c] = pred[c];
+
+          if (CAM_JPEG_copy_ac(&reader, w, ac) != EXIT_SUCCESS)
+          {
+            ESP_LOGW(LOG_TAG, "Invalid AC code at offset %u\n", (uint32_t) (reader.p - buf));
+            return EXIT_FAILURE;
+          }
+        }
+      }
+    }
+
+    if (reader.padded > CAM_JPEG_MAX_PADDING)
+    {
+      ESP_LOGW(LOG_TAG, "Scan ends early in MCU row %u\n", my);
+      return EXIT_FAILURE;
+    }
+  }
+
+  CAM_JPEG_flush(w);
+
+  return w->overflow ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int CAM_JPEG_crop(const uint8_t *buf, size_t len, uint16_t mx, uint16_t my, uint16_t mw, uint16_t mh,
+                  uint8_t *out, size_t out_size, size_t *out_len)
+{
+  cam_jpeg_info_t info;
+  cam_jpeg_writer_t writer;
+  size_t header_len = 0;
+  size_t sof_offset = 0;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  int res = EXIT_FAILURE;
+
+  if (NULL == _jpeg_mutex || NULL == out || NULL == out_len || !mw || !mh)
+  {
+    return EXIT_FAILURE;
+  }
+
+  xSemaphoreTake(_jpeg_mutex, portMAX_DELAY);
+
+  if (CAM_JPEG_parse_headers(buf, len, &info, 1) != EXIT_SUCCESS
+    || mx + mw > info.mcus_x || my + mh > info.mcus_y
+    || out_size < info.header_len + 2U
+    || (info.dri_offset && CAM_JPEG_be16(&buf[info.dri_offset + 2U]) != 4U))
+  {
+    xSemaphoreGive(_jpeg_mutex);
+    return EXIT_FAILURE;
+  }
+
+  header_len = CAM_JPEG_copy_headers(buf, &info, out, &sof_offset);
+
+  // A rectangle reaching the right or bottom edge keeps the partial MCUs there
+  width = (mx + mw == info.mcus_x) ? info.width - mx * 8U * info.h_max : mw * 8U * info.h_max;
+  height = (my + mh == info.mcus_y) ? info.height - my * 8U * info.v_max : mh * 8U * info.v_max;
+  out[sof_offset + 3] = height >> 8;
+  out[sof_offset + 4] = height & 0xFF;
+  out[sof_offset + 5] = width >> 8;
+  out[sof_offset + 6] = width & 0xFF;
+
+  memset(&writer, 0, sizeof(writer));
+  writer.p = out + header_len;
+  writer.end = out + out_size - 2U;
+
+  res = CAM_JPEG_crop_blocks(buf, len, &info, mx, my, mw, mh, &writer);
+
+  xSemaphoreGive(_jpeg_mutex);
+
+  if (EXIT_SUCCESS != res)
+  {
+    return EXIT_FAILURE;
+  }
+
+  *writer.p++ = 0xFF;
+  *writer.p++ = CAM_JPEG_MARKER_EOI;
+  *out_len = writer.p - out;
+
+  return EXIT_SUCCESS;
+}
+
+// Must be called with the scanner mutex held. The rectangles are in MCUs.
+static int CAM_JPEG_mask_blocks(const uint8_t *buf, size_t len, const cam_jpeg_info_t *info,
+                                const cam_jpeg_rect_t *rects, uint8_t count, cam_jpeg_writer_t *w)
+{
+  cam_jpeg_bits_t reader;
+  int32_t pred[CAM_JPEG_MAX_COMPONENTS] = {0};
+  int32_t out_pred[CAM_JPEG_MAX_COMPONENTS] = {0};
+  int32_t black[CAM_JPEG_MAX_COMPONENTS] = {0};
+  const cam_jpeg_huffman_t *dc = NULL;
+  const cam_jpeg_huffman_t *ac = NULL;
+  uint16_t restarts_left = info->restart_interval;
+  uint16_t dc_quant = 0;
+  int32_t value = 0;
+  uint8_t masked = 0;
+  int size = 0;
+
+  for (uint8_t c = 0; c < info->components; ++c)
+  {
+    if (!_dc_tables[info->comp[c].td].defined || !_ac_tables[info->comp[c].ta].defined
+      || !_ac_tables[info->comp[c].ta].code_lens[0x00])
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // A block with only a DC coefficient is flat. Black is a luma mean of 0,
+  // i.e. -1024 before quantization, with neutral chroma.
+  dc_quant = info->dc_quant[info->comp[0].tq];
+  if (!dc_quant)
+  {
+    return EXIT_FAILURE;
+  }
+  black[0] = -((1024 + dc_quant / 2) / dc_quant);
+
+  memset(&reader, 0, sizeof(reader));
+  reader.p = buf + info->header_len;
+  reader.end = buf + len;
+
+  for (uint16_t my = 0; my < info->mcus_y; ++my)
+  {
+    for (uint16_t mx = 0; mx < info->mcus_x; ++mx)
+    {
+      if (info->restart_interval)
+      {
+        if (0 == restarts_left)
+        {
+          if (CAM_JPEG_restart(&reader) != EXIT_SUCCESS)
+          {
+            return EXIT_FAILURE;
+          }
+          memset(pred, 0, sizeof(pred));
+          restarts_left = info->restart_interval;
+        }
+        restarts_left--;
+      }
+
+      masked = 0;
+      for (uint8_t i = 0; !masked && i < count; ++i)
+      {
+        masked = mx >= rects[i].x && mx < rects[i].x + rects[i].width
+          && my >= rects[i].y && my < rects[i].y + rects[i].height;
+      }
+
+      for (uint8_t c = 0; c < info->components; ++c)
+      {
+        dc = &_dc_tables[info->comp[c].td];
+        ac = &_ac_tables[info->comp[c].ta];
+
+        for (uint8_t b = 0; b < info->comp[c].h * info->comp[c].v; ++b)
+        {
+          if ((size = CAM_JPEG_decode(&reader, dc)) < 0 || size > CAM_JPEG_MAX_DC_SIZE)
+          {
+            ESP_LOGW(LOG_TAG, "Invalid DC code at offset %u\n", (uint32_t) (reader.p - buf));
+            return EXIT_FAILURE;
+          }
+          pred[c] += CAM_JPEG_receive_extend(&reader, size);
+
+          value = masked ? black[c] : pred[c];
+          if (CAM_JPEG_put_dc(w, dc, value - out_pred[c]) != EXIT_SUCCESS)
+          {
+            return EXIT_FAILURE;
+          }
+          out_pred[c] = value;
+
+          if (masked)
+          {
+            if (CAM_JPEG_skip_ac(&reader, ac, 1) != EXIT_SUCCESS)
+            {
+              ESP_LOGW(LOG_TAG, "Invalid AC code at offset %u\n", (uint32_t) (reader.p - buf));
+              return EXIT_FAILURE;
+            }
+            CAM_JPEG_put_symbol(w, ac, 0x00);
+          }
+          else if (CAM_JPEG_copy_ac(&reader, w, ac) != EXIT_SUCCESS)
+          {
+            ESP_LOGW(LOG_TAG, "Invalid AC code at offset %u\n", (uint32_t) (reader.p - buf));
+            return EXIT_FAILURE;
+          }
+        }
+      }
+    }
+
+    if (reader.padded > CAM_JPEG_MAX_PADDING)
+    {
+      ESP_LOGW(LOG_TAG, "Scan ends early in MCU row %u\n", my);
+      return EXIT_FAILURE;
+    }
+  }
+
+  CAM_JPEG_flush(w);
+
+  return w->overflow ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int CAM_JPEG_mask(const uint8_t *buf, size_t len, const cam_jpeg_rect_t *rects, uint8_t count,
+                  uint8_t *out, size_t out_size, size_t *out_len)
+{
+  cam_jpeg_rect_t mcus[CAM_JPEG_MAX_RECTS];
+  cam_jpeg_info_t info;
+  cam_jpeg_writer_t writer;
+  size_t header_len = 0;
+  size_t sof_offset = 0;
+  uint16_t mcu_width = 0;
+  uint16_t mcu_height = 0;
+  int res = EXIT_FAILURE;
+
+  if (NULL == _jpeg_mutex || NULL == out || NULL == out_len || (count && NULL == rects) || count > CAM_JPEG_MAX_RECTS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  xSemaphoreTake(_jpeg_mutex, portMAX_DELAY);
+
+  if (CAM_JPEG_parse_headers(buf, len, &info, 1) != EXIT_SUCCESS
+    || out_size < info.header_len + 2U
+    || (info.dri_offset && CAM_JPEG_be16(&buf[info.dri_offset + 2U]) != 4U))
+  {
+    xSemaphoreGive(_jpeg_mutex);
+    return EXIT_FAILURE;
+  }
+
+  // Widened outwards to whole MCUs
+  mcu_width = 8U * info.h_max;
+  mcu_height = 8U * info.v_max;
+  for (uint8_t i = 0; i < count; ++i)
+  {
+    mcus[i].x = rects[i].x / mcu_width;
+    mcus[i].y = rects[i].y / mcu_height;
+    mcus[i].width = (rects[i].x + rects[i].width + mcu_width - 1U) / mcu_width - mcus[i].x;
+    mcus[i].height = (rects[i].y + rects[i].height + mcu_height - 1U) / mcu_height - mcus[i].y;
+  }
+
+  header_len = CAM_JPEG_copy_headers(buf, &info, out, &sof_offset);
+
+  memset(&writer, 0, sizeof(writer));
+  writer.p = out + header_len;
+  writer.end = out + out_size - 2U;
+
+  res = CAM_JPEG_mask_blocks(buf, len, &info, mcus, count, &writer);
+
+  xSemaphoreGive(_jpeg_mutex);
+
+  if (EXIT_SUCCESS != res)
+  {
+    return EXIT_FAILURE;
+  }
+
+  *writer.p++ = 0xFF;
+  *writer.p++ = CAM_JPEG_MARKER_EOI;
+  *out_len = writer.p - out;
+
+  return EXIT_SUCCESS;
+}
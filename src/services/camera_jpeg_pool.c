@@ -0,0 +1,285 @@
+/*
+* @file camera_jpeg_pool.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_jpeg_pool.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "esp_camera.h"
+#include "img_converters.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define LOG_TAG                     "CAMERA JPEG POOL"
+
+// One buffer for the stream, the still image cache, and two for consumers
+// converting at the same time, i.e. history, RTSP and uploads
+#define CAM_JPOOL_BUFFERS_PSRAM     (4U)
+#define CAM_JPOOL_BUFFERS_DRAM      (2U)
+#define CAM_JPOOL_MAX_BUFFERS       (CAM_JPOOL_BUFFERS_PSRAM)
+
+// Output is budgeted at 4 bits per pixel, well above what quality 80 takes
+#define CAM_JPOOL_BUFFER_SIZE(w, h) ((size_t) (w) * (h) / 2U)
+
+#define CAM_JPOOL_HEAP_CAPS         (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+
+typedef struct cam_jpool_writer {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+} cam_jpool_writer_t;
+
+static uint8_t *_buffers[CAM_JPOOL_MAX_BUFFERS];
+static cam_frame_t _frames[CAM_JPOOL_MAX_BUFFERS];
+static uint8_t _in_use[CAM_JPOOL_MAX_BUFFERS];
+static uint8_t _buffer_count = 0;
+static size_t _buffer_size = 0;
+
+static cam_jpool_stats_t _stats;
+static SemaphoreHandle_t _pool_mutex;
+
+// Must be called with the pool mutex held and no buffer in use. Replaces the
+// buffers with ones sized for the frame, in PSRAM when there is some.
+static void CAM_JPOOL_allocate(uint16_t width, uint16_t height)
+{
+  uint32_t caps = MALLOC_CAP_SPIRAM;
+  uint8_t count = CAM_JPOOL_BUFFERS_PSRAM;
+
+  for (uint8_t i = 0; i < _buffer_count; ++i)
+  {
+    free(_buffers[i]);
+    _buffers[i] = NULL;
+  }
+
+  _buffer_size = CAM_JPOOL_BUFFER_SIZE(width, height);
+
+  if (!heap_caps_get_free_size(MALLOC_CAP_SPIRAM))
+  {
+    caps = CAM_JPOOL_HEAP_CAPS;
+    count = CAM_JPOOL_BUFFERS_DRAM;
+  }
+
+  for (_buffer_count = 0; _buffer_count < count; ++_buffer_count)
+  {
+    if ((_buffers[_buffer_count] = heap_caps_malloc(_buffer_size, caps)) == NULL)
+    {
+      break;
+    }
+  }
+
+  ESP_LOGI(LOG_TAG, "JPEG pool of %u buffers of %u bytes in %s\n", _buffer_count, (uint32_t) _buffer_size,
+           (MALLOC_CAP_SPIRAM == caps) ? "PSRAM" : "DRAM");
+
+  _stats.buffers = _buffer_count;
+  _stats.buffer_size = _buffer_size;
+}
+
+static void CAM_JPOOL_free_pooled(cam_frame_t *frame)
+{
+  xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+  _in_use[frame - _frames] = 0;
+  _stats.in_use--;
+  xSemaphoreGive(_pool_mutex);
+}
+
+static void CAM_JPOOL_free_allocated(cam_frame_t *frame)
+{
+  free(frame->buf);
+  free(frame);
+}
+
+static size_t CAM_JPOOL_write(void *arg, size_t index, const void *data, size_t len)
+{
+  cam_jpool_writer_t *writer = (cam_jpool_writer_t*) arg;
+
+  // Returning short stops the encoder
+  if (index + len > writer->size)
+  {
+    return 0;
+  }
+
+  memcpy(writer->buf + index, data, len);
+  writer->len = index + len;
+
+  return len;
+}
+
+// Must be called with the pool mutex held
+static void CAM_JPOOL_sample_heap()
+{
+  size_t free_size = heap_caps_get_free_size(CAM_JPOOL_HEAP_CAPS);
+  size_t largest = heap_caps_get_largest_free_block(CAM_JPOOL_HEAP_CAPS);
+
+  _stats.fragmentation = free_size ? 100U - (uint8_t) (100ULL * largest / free_size) : 0;
+  if (_stats.fragmentation > _stats.max_fragmentation)
+  {
+    _stats.max_fragmentation = _stats.fragmentation;
+  }
+}
+
+// Encodes into a pool buffer, returns NULL if none is free or the frame does
+// not fit it
+static cam_frame_t* CAM_JPOOL_encode_pooled(cam_frame_t *frame, uint8_t quality)
+{
+  cam_jpool_writer_t writer;
+  cam_frame_t *jpeg = NULL;
+  int slot = -1;
+
+  xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+
+  // The buffers grow with the largest frame seen, e.g. a still after the
+  // preview. Until none of them is handed out a larger frame is not pooled.
+  if (CAM_JPOOL_BUFFER_SIZE(frame->width, frame->height) > _buffer_size)
+  {
+    if (_stats.in_use)
+    {
+      xSemaphoreGive(_pool_mutex);
+      return NULL;
+    }
+    CAM_JPOOL_allocate(frame->width, frame->height);
+  }
+
+  for (uint8_t i = 0; i < _buffer_count; ++i)
+  {
+    if (!_in_use[i])
+    {
+      slot = i;
+      _in_use[i] = 1;
+      _stats.in_use++;
+      if (_stats.in_use > _stats.max_in_use)
+      {
+        _stats.max_in_use = _stats.in_use;
+      }
+      break;
+    }
+  }
+
+  xSemaphoreGive(_pool_mutex);
+
+  if (slot < 0)
+  {
+    return NULL;
+  }
+
+  writer.buf = _buffers[slot];
+  writer.size = _buffer_size;
+  writer.len = 0;
+
+  if (!frame2jpg_cb(frame->fb, quality, CAM_JPOOL_write, &writer))
+  {
+    xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+    _stats.overflows++;
+    xSemaphoreGive(_pool_mutex);
+
+    CAM_JPOOL_free_pooled(&_frames[slot]);
+    return NULL;
+  }
+
+  jpeg = &_frames[slot];
+  memset(jpeg, 0, sizeof(cam_frame_t));
+  jpeg->buf = writer.buf;
+  jpeg->len = writer.len;
+  jpeg->free_fn = CAM_JPOOL_free_pooled;
+
+  return jpeg;
+}
+
+int CAM_JPOOL_init()
+{
+  if (!_pool_mutex && (_pool_mutex = xSemaphoreCreateMutex()) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+cam_frame_t* CAM_JPOOL_encode(cam_frame_t *frame, uint8_t quality)
+{
+  cam_frame_t *jpeg = NULL;
+  uint8_t pooled = 0;
+
+  if (NULL == _pool_mutex || NULL == frame)
+  {
+    return NULL;
+  }
+
+  if ((jpeg = CAM_JPOOL_encode_pooled(frame, quality)) != NULL)
+  {
+    pooled = 1;
+  }
+  else
+  {
+    if ((jpeg = calloc(1, sizeof(cam_frame_t))) == NULL)
+    {
+      return NULL;
+    }
+
+    if (!frame2jpg(frame->fb, quality, &jpeg->buf, &jpeg->len))
+    {
+      ESP_LOGI(LOG_TAG, "JPEG compression failed\n");
+      free(jpeg);
+      return NULL;
+    }
+    jpeg->free_fn = CAM_JPOOL_free_allocated;
+  }
+
+  jpeg->width = frame->width;
+  jpeg->height = frame->height;
+  jpeg->format = PIXFORMAT_JPEG;
+  jpeg->seq = frame->seq;
+  jpeg->timestamp = frame->timestamp;
+  jpeg->captured = frame->captured;
+  jpeg->wall_time = frame->wall_time;
+  jpeg->encoded = esp_timer_get_time();
+  jpeg->quality = -1;
+  jpeg->refs = 1;
+
+  xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+  _stats.encodes++;
+  _stats.pooled += pooled;
+  _stats.fallbacks += !pooled;
+  CAM_JPOOL_sample_heap();
+  xSemaphoreGive(_pool_mutex);
+
+  return jpeg;
+}
+
+void CAM_JPOOL_get_stats(cam_jpool_stats_t *stats)
+{
+  if (NULL == _pool_mutex || NULL == stats)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_pool_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_jpool_stats_t));
+  xSemaphoreGive(_pool_mutex);
+}
@@ -0,0 +1,227 @@
+/*
+* @file camera_latency.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_latency.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#define CAM_LAT_OPEN_BUCKET         (CAM_LAT_BUCKETS - 1U)
+
+static const uint32_t _bounds_ms[CAM_LAT_OPEN_BUCKET] = CAM_LAT_BUCKET_BOUNDS_MS;
+
+static const char *_consumer_names[cam_lat_consumer_count] = {
+  "stream",
+  "upload"
+};
+
+static const char *_stage_names[cam_lat_stage_count] = {
+  "capture",
+  "encode",
+  "queue",
+  "send",
+  "total"
+};
+
+static cam_lat_histogram_t _histograms[cam_lat_consumer_count][cam_lat_stage_count];
+static SemaphoreHandle_t _lat_mutex;
+
+static uint8_t _initialized = 0;
+
+// Must be called with the latency mutex held
+static void CAM_LAT_add(cam_lat_histogram_t *histogram, int64_t from, int64_t to)
+{
+  uint32_t us = 0;
+  uint8_t bucket = 0;
+
+  // A missing or out of order timestamp leaves the stage out
+  if (!from || to < from)
+  {
+    return;
+  }
+
+  us = (uint32_t) (to - from);
+  while (bucket < CAM_LAT_OPEN_BUCKET && us > _bounds_ms[bucket] * 1000U)
+  {
+    bucket++;
+  }
+
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  if (us > histogram->max_us)
+  {
+    histogram->max_us = us;
+  }
+}
+
+// Appends to the report for as long as it fits, used runs past len once not
+static void CAM_LAT_append(char *buf, size_t len, size_t *used, const char *format, ...)
+{
+  va_list args;
+
+  if (*used >= len)
+  {
+    return;
+  }
+
+  va_start(args, format);
+  *used += vsnprintf(&buf[*used], len - *used, format, args);
+  va_end(args);
+}
+
+int CAM_LAT_init()
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if ((_lat_mutex = xSemaphoreCreateMutex()) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  memset(_histograms, 0, sizeof(_histograms));
+  _initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_LAT_record(cam_lat_consumer_t consumer, const cam_frame_t *frame, int64_t first_sent, int64_t last_sent)
+{
+  cam_lat_histogram_t *histograms = NULL;
+
+  if (!_initialized || NULL == frame || consumer >= cam_lat_consumer_count)
+  {
+    return;
+  }
+
+  histograms = _histograms[consumer];
+
+  xSemaphoreTake(_lat_mutex, portMAX_DELAY);
+  CAM_LAT_add(&histograms[cam_lat_capture], frame->captured, frame->timestamp);
+  CAM_LAT_add(&histograms[cam_lat_encode], frame->timestamp, frame->encoded);
+  CAM_LAT_add(&histograms[cam_lat_queue], frame->encoded, first_sent);
+  CAM_LAT_add(&histograms[cam_lat_send], first_sent, last_sent);
+  CAM_LAT_add(&histograms[cam_lat_total], frame->captured, last_sent);
+  xSemaphoreGive(_lat_mutex);
+}
+
+void CAM_LAT_get(cam_lat_consumer_t consumer, cam_lat_stage_t stage, cam_lat_histogram_t *histogram)
+{
+  if (!_initialized || NULL == histogram || consumer >= cam_lat_consumer_count || stage >= cam_lat_stage_count)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_lat_mutex, portMAX_DELAY);
+  memcpy(histogram, &_histograms[consumer][stage], sizeof(cam_lat_histogram_t));
+  xSemaphoreGive(_lat_mutex);
+}
+
+uint32_t CAM_LAT_percentile_ms(cam_lat_consumer_t consumer, cam_lat_stage_t stage, uint8_t percent)
+{
+  cam_lat_histogram_t histogram = {0};
+  uint32_t rank = 0;
+  uint32_t seen = 0;
+
+  CAM_LAT_get(consumer, stage, &histogram);
+  if (!histogram.count)
+  {
+    return 0;
+  }
+
+  // Rank of the percentile, rounded up so that p100 is the last sample
+  rank = ((uint64_t) histogram.count * percent + 99U) / 100U;
+
+  for (uint8_t bucket = 0; bucket < CAM_LAT_OPEN_BUCKET; ++bucket)
+  {
+    seen += histogram.buckets[bucket];
+    if (seen >= rank)
+    {
+      return _bounds_ms[bucket];
+    }
+  }
+  return histogram.max_us / 1000U;
+}
+
+size_t CAM_LAT_report(char *buf, size_t len)
+{
+  cam_lat_histogram_t *histogram = NULL;
+  size_t used = 0;
+
+  if (!_initialized || NULL == buf || 0 == len)
+  {
+    return 0;
+  }
+
+  CAM_LAT_append(buf, len, &used, "{\"bucket ms\":[");
+  for (uint8_t bucket = 0; bucket < CAM_LAT_OPEN_BUCKET; ++bucket)
+  {
+    CAM_LAT_append(buf, len, &used, "%s%u", bucket ? "," : "", _bounds_ms[bucket]);
+  }
+  CAM_LAT_append(buf, len, &used, "]");
+
+  xSemaphoreTake(_lat_mutex, portMAX_DELAY);
+  for (uint8_t consumer = 0; consumer < cam_lat_consumer_count; ++consumer)
+  {
+    CAM_LAT_append(buf, len, &used, ",\"%s\":{", _consumer_names[consumer]);
+    for (uint8_t stage = 0; stage < cam_lat_stage_count; ++stage)
+    {
+      histogram = &_histograms[consumer][stage];
+      CAM_LAT_append(buf, len, &used, "%s\"%s\":{\"count\":%u,\"max us\":%u,\"buckets\":[", stage ? "," : "",
+                     _stage_names[stage], histogram->count, histogram->max_us);
+      for (uint8_t bucket = 0; bucket < CAM_LAT_BUCKETS; ++bucket)
+      {
+        CAM_LAT_append(buf, len, &used, "%s%u", bucket ? "," : "", histogram->buckets[bucket]);
+      }
+      CAM_LAT_append(buf, len, &used, "]}");
+    }
+    CAM_LAT_append(buf, len, &used, "}");
+  }
+  xSemaphoreGive(_lat_mutex);
+
+  CAM_LAT_append(buf, len, &used, "}");
+
+  // A truncated report is not valid JSON
+  return (used < len) ? used : 0;
+}
+
+void CAM_LAT_reset()
+{
+  if (!_initialized)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_lat_mutex, portMAX_DELAY);
+  memset(_histograms, 0, sizeof(_histograms));
+  xSemaphoreGive(_lat_mutex);
+}
@@ -0,0 +1,175 @@
+/*
+* @file camera_luma.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_luma.h"
+
+#include <string.h>
+
+#include "camera_jpeg.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                 "CAMERA LUMA"
+
+// ITU-R BT.601 weights scaled by 256, for raw RGB frames
+#define CAM_LUMA(r, g, b)       ((uint8_t) ((77U * (r) + 150U * (g) + 29U * (b)) >> 8))
+
+typedef struct cam_luma_scan {
+  cam_luma_t *luma;
+  uint16_t blocks_x;    // Luma blocks covering the image, padding blocks excluded
+  uint16_t blocks_y;
+} cam_luma_scan_t;
+
+static cam_luma_stats_t _stats;
+
+// Receives the mean of every block, i.e. one pixel of the 1/8 scale image
+static void CAM_LUMA_dc_block(void *arg, uint8_t component, uint16_t bx, uint16_t by, uint8_t value)
+{
+  cam_luma_scan_t *scan = (cam_luma_scan_t *) arg;
+  cam_luma_t *luma = scan->luma;
+
+  if (component || bx >= scan->blocks_x || by >= scan->blocks_y)
+  {
+    return;
+  }
+
+  luma->data[((uint32_t) by * luma->height / scan->blocks_y) * CAM_LUMA_MAX_WIDTH
+             + (uint32_t) bx * luma->width / scan->blocks_x] = value;
+}
+
+static int CAM_LUMA_from_jpeg(cam_frame_t *frame, cam_luma_t *luma)
+{
+  cam_luma_scan_t scan = {
+    .luma = luma,
+    .blocks_x = (frame->width + 7U) / 8U,
+    .blocks_y = (frame->height + 7U) / 8U
+  };
+  int64_t start = esp_timer_get_time();
+  uint32_t elapsed = 0;
+
+  if (CAM_JPEG_scan_dc(frame->buf, frame->len, NULL, CAM_LUMA_dc_block, &scan) != EXIT_SUCCESS)
+  {
+    _stats.failures++;
+    ESP_LOGW(LOG_TAG, "JPEG scan of frame %u failed\n", frame->seq);
+    return EXIT_FAILURE;
+  }
+
+  elapsed = (uint32_t) (esp_timer_get_time() - start);
+  _stats.scans++;
+  _stats.last_us = elapsed;
+  _stats.total_us += elapsed;
+  _stats.max_us = (elapsed > _stats.max_us) ? elapsed : _stats.max_us;
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_LUMA_from_raw(cam_frame_t *frame, cam_luma_t *luma)
+{
+  const uint8_t *src = NULL;
+  uint8_t *dst = NULL;
+  size_t sx = 0;
+  size_t sy = 0;
+  uint8_t r = 0;
+  uint8_t g = 0;
+  uint8_t b = 0;
+
+  for (uint16_t ly = 0; ly < luma->height; ++ly)
+  {
+    sy = (size_t) ly * frame->height / luma->height;
+    dst = &luma->data[ly * CAM_LUMA_MAX_WIDTH];
+
+    for (uint16_t lx = 0; lx < luma->width; ++lx)
+    {
+      sx = (size_t) lx * frame->width / luma->width;
+
+      switch (frame->format)
+      {
+        case PIXFORMAT_GRAYSCALE:
+          dst[lx] = frame->buf[sy * frame->width + sx];
+          break;
+        case PIXFORMAT_YUV422:
+          // YUYV, every even byte is luma
+          dst[lx] = frame->buf[(sy * frame->width + sx) * 2U];
+          break;
+        case PIXFORMAT_RGB565:
+          // The driver delivers the high byte first
+          src = &frame->buf[(sy * frame->width + sx) * 2U];
+          r = src[0] & 0xF8;
+          g = (uint8_t) ((src[0] << 5) | ((src[1] & 0xE0) >> 3));
+          b = (uint8_t) (src[1] << 3);
+          dst[lx] = CAM_LUMA(r, g, b);
+          break;
+        default:
+          return EXIT_FAILURE;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int CAM_LUMA_from_frame(cam_frame_t *frame, cam_luma_t *luma)
+{
+  uint16_t width = 0;
+  uint16_t height = 0;
+
+  if (NULL == frame || NULL == luma || NULL == frame->buf)
+  {
+    return EXIT_FAILURE;
+  }
+
+  width = frame->width / 8U;
+  height = frame->height / 8U;
+  width = (width > CAM_LUMA_MAX_WIDTH) ? CAM_LUMA_MAX_WIDTH : (width & ~7U);
+  height = (height > CAM_LUMA_MAX_HEIGHT) ? CAM_LUMA_MAX_HEIGHT : height;
+
+  if (0 == width || 0 == height)
+  {
+    return EXIT_FAILURE;
+  }
+
+  luma->width = width;
+  luma->height = height;
+  luma->seq = frame->seq;
+
+  if (PIXFORMAT_JPEG == frame->format)
+  {
+    return CAM_LUMA_from_jpeg(frame, luma);
+  }
+
+  return CAM_LUMA_from_raw(frame, luma);
+}
+
+void CAM_LUMA_get_stats(cam_luma_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_luma_stats_t));
+}
@@ -0,0 +1,189 @@
+/*
+* @file camera_meta.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_meta.h"
+
+#include "fsu_eye_aws_credentials.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#define LOG_TAG                   "CAMERA META"
+
+#define CAM_META_MARKER           (0xFFU)
+#define CAM_META_SOI              (0xD8U)
+#define CAM_META_APP0             (0xE0U)
+#define CAM_META_COM              (0xFEU)
+
+// Marker and length field in front of the comment
+#define CAM_META_COM_HEADER_LEN   (4U)
+#define CAM_META_TIME_LEN         (32U)
+
+// Capture time as UTC with milliseconds, fails for frames taken while the
+// clock was unset. The time is the one the ring stamped the frame with, a
+// clock step since then does not move it.
+static int CAM_META_format_time(const cam_frame_t *frame, char *text, size_t len)
+{
+  struct tm tm;
+  time_t seconds = (time_t) (frame->wall_time / 1000000LL);
+  size_t written = 0;
+
+  if (!frame->wall_time)
+  {
+    return EXIT_FAILURE;
+  }
+
+  gmtime_r(&seconds, &tm);
+
+  if ((written = strftime(text, len, "%Y-%m-%dT%H:%M:%S", &tm)) == 0)
+  {
+    return EXIT_FAILURE;
+  }
+  snprintf(&text[written], len - written, ".%03uZ", (uint32_t) (frame->wall_time % 1000000LL / 1000LL));
+
+  return EXIT_SUCCESS;
+}
+
+// Writes the comment text, returns its length or 0 if it did not fit
+static size_t CAM_META_text(const cam_frame_t *frame, char *text, size_t size)
+{
+  char captured[CAM_META_TIME_LEN];
+  int len = 0;
+  int added = 0;
+
+  len = snprintf(text, size, "{\"id\":\"%s\",\"seq\":\"%u\",\"uptime us\":\"%lld\",\"width\":\"%u\",\"height\":\"%u\"",
+                 FSU_EYE_AWS_IOT_THING_NAME, frame->seq, frame->captured ? frame->captured : frame->timestamp,
+                 (uint32_t) frame->width, (uint32_t) frame->height);
+
+  if (len > 0 && (size_t) len < size && CAM_META_format_time(frame, captured, sizeof(captured)) == EXIT_SUCCESS)
+  {
+    added = snprintf(&text[len], size - len, ",\"captured\":\"%s\"", captured);
+    len = (added < 0) ? added : len + added;
+  }
+
+  if (len > 0 && (size_t) len < size && frame->quality >= 0)
+  {
+    added = snprintf(&text[len], size - len, ",\"quality\":\"%d\"", frame->quality);
+    len = (added < 0) ? added : len + added;
+  }
+
+  if (len > 0 && (size_t) len < size)
+  {
+    added = snprintf(&text[len], size - len, "}");
+    len = (added < 0) ? added : len + added;
+  }
+
+  return (len > 0 && (size_t) len < size) ? (size_t) len : 0;
+}
+
+size_t CAM_META_prefix(const cam_frame_t *frame, uint8_t *prefix, size_t size, size_t *skip)
+{
+  size_t start = 2U;
+  size_t text_len = 0;
+
+  if (NULL == frame || NULL == prefix || NULL == skip || PIXFORMAT_JPEG != frame->format
+    || frame->len < 4U || CAM_META_MARKER != frame->buf[0] || CAM_META_SOI != frame->buf[1])
+  {
+    return 0;
+  }
+
+  // A JFIF header has to stay right after the start of image, the comment
+  // goes behind it
+  if (frame->len >= 6U && CAM_META_MARKER == frame->buf[2] && CAM_META_APP0 == frame->buf[3])
+  {
+    start = 4U + ((size_t) frame->buf[4] << 8 | frame->buf[5]);
+    start = (start + CAM_META_COM_HEADER_LEN < size && start < frame->len) ? start : 2U;
+  }
+
+  if (start + CAM_META_COM_HEADER_LEN >= size
+    || (text_len = CAM_META_text(frame, (char *) &prefix[start + CAM_META_COM_HEADER_LEN],
+                                 size - start - CAM_META_COM_HEADER_LEN)) == 0)
+  {
+    return 0;
+  }
+
+  memcpy(prefix, frame->buf, start);
+  prefix[start] = CAM_META_MARKER;
+  prefix[start + 1U] = CAM_META_COM;
+  // The segment length counts itself but not the marker
+  prefix[start + 2U] = (uint8_t) ((text_len + 2U) >> 8);
+  prefix[start + 3U] = (uint8_t) (text_len + 2U);
+
+  *skip = start;
+  return start + CAM_META_COM_HEADER_LEN + text_len;
+}
+
+static void CAM_META_free(cam_frame_t *frame)
+{
+  free(frame->buf);
+  free(frame);
+}
+
+cam_frame_t* CAM_META_embed(const cam_frame_t *frame)
+{
+  uint8_t prefix[CAM_META_PREFIX_SIZE];
+  cam_frame_t *embedded = NULL;
+  uint32_t caps = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  size_t prefix_len = 0;
+  size_t skip = 0;
+
+  if ((prefix_len = CAM_META_prefix(frame, prefix, sizeof(prefix), &skip)) == 0)
+  {
+    return NULL;
+  }
+
+  if ((embedded = calloc(1, sizeof(cam_frame_t))) == NULL
+    || (embedded->buf = heap_caps_malloc(prefix_len + frame->len - skip, caps)) == NULL)
+  {
+    ESP_LOGI(LOG_TAG, "No memory to add metadata to frame %u\n", frame->seq);
+    free(embedded);
+    return NULL;
+  }
+
+  memcpy(embedded->buf, prefix, prefix_len);
+  memcpy(&embedded->buf[prefix_len], &frame->buf[skip], frame->len - skip);
+
+  embedded->len = prefix_len + frame->len - skip;
+  embedded->width = frame->width;
+  embedded->height = frame->height;
+  embedded->format = frame->format;
+  embedded->seq = frame->seq;
+  embedded->timestamp = frame->timestamp;
+  embedded->captured = frame->captured;
+  embedded->wall_time = frame->wall_time;
+  embedded->encoded = frame->encoded;
+  embedded->quality = frame->quality;
+  embedded->free_fn = CAM_META_free;
+  embedded->refs = 1;
+
+  return embedded;
+}
@@ -0,0 +1,302 @@
+/*
+* @file camera_motion.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_motion.h"
+#include "camera_luma.h"
+#include "camera_service.h"
+#include "kvs_service.h"
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "platform/iot_threads.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                         "CAMERA MOTION"
+
+#define CAM_MOTION_TASK_PRIORITY        (tskIDLE_PRIORITY + 4U)
+#define CAM_MOTION_STACKSIZE            (0x2000U)
+#define CAM_MOTION_STOP_POLL_MS         (50U)
+
+// Time between two analysed frames
+#define CAM_MOTION_INTERVAL_MS          (250U)
+#define CAM_MOTION_FRAME_WAIT_MS        (1000U)
+#define CAM_MOTION_STATS_LOG_US         (60000000LL)
+
+// Blocks are CAM_MOTION_BLOCK_SIZE luma pixels square, i.e. 64x64 sensor pixels
+#define CAM_MOTION_BLOCK_SIZE           (8U)
+
+// Mean absolute difference per pixel for a block to count as changed, at the
+// highest and lowest sensitivity
+#define CAM_MOTION_PIXEL_THRESHOLD_MIN  (6U)
+#define CAM_MOTION_PIXEL_THRESHOLD_MAX  (40U)
+// Sensitivity steps per additional changed block required for motion
+#define CAM_MOTION_BLOCK_STEP           (20U)
+#define CAM_MOTION_DEFAULT_SENSITIVITY  (50U)
+
+#define CAM_MOTION_LANES                (0x00FF00FFU)
+#define CAM_MOTION_LANE_BIAS            (0x01000100U)
+#define CAM_MOTION_LANE_SIGN            (0x00010001U)
+
+// Reference and current plane, swapped after every comparison
+static cam_luma_t _planes[2];
+static cam_luma_t *_reference = &_planes[0];
+static cam_luma_t *_current = &_planes[1];
+static uint8_t _reference_valid = 0;
+
+static cam_motion_stats_t _stats;
+static int64_t _stats_logged_at = 0;
+static volatile uint8_t _event = 0;
+
+static portMUX_TYPE _event_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile uint8_t _motion_running = 0;
+static volatile uint8_t _motion_active = 0;
+
+/*
+* @brief Absolute difference of two pairs of bytes, each held in the low byte
+* of a 16-bit lane. Biasing every lane by 256 keeps the subtraction from
+* borrowing across lanes, and bit 8 of a lane then tells which operand was
+* larger.
+*/
+static inline uint32_t CAM_MOTION_absdiff_lanes(uint32_t a, uint32_t b)
+{
+  uint32_t d = (a + CAM_MOTION_LANE_BIAS) - b;
+  uint32_t ge = ((d >> 8) & CAM_MOTION_LANE_SIGN) * 0xFFU;
+  uint32_t low = d & CAM_MOTION_LANES;
+  uint32_t neg = (CAM_MOTION_LANE_BIAS - low) & CAM_MOTION_LANES;
+
+  return (low & ge) | (neg & ~ge);
+}
+
+// Sum of absolute differences of four pixels, left in two 16-bit lanes
+static inline uint32_t CAM_MOTION_sad4(uint32_t a, uint32_t b)
+{
+  return CAM_MOTION_absdiff_lanes(a & CAM_MOTION_LANES, b & CAM_MOTION_LANES)
+       + CAM_MOTION_absdiff_lanes((a >> 8) & CAM_MOTION_LANES, (b >> 8) & CAM_MOTION_LANES);
+}
+
+// Sum of absolute differences over one block, the lanes hold at most
+// 64 pixels * 255 and never overflow
+static uint32_t CAM_MOTION_block_sad(const cam_luma_t *a, const cam_luma_t *b, uint16_t bx, uint16_t by, uint16_t rows)
+{
+  const uint32_t *wa = NULL;
+  const uint32_t *wb = NULL;
+  uint32_t acc = 0;
+
+  for (uint16_t row = 0; row < rows; ++row)
+  {
+    wa = (const uint32_t *) &a->data[(by * CAM_MOTION_BLOCK_SIZE + row) * CAM_LUMA_MAX_WIDTH + bx * CAM_MOTION_BLOCK_SIZE];
+    wb = (const uint32_t *) &b->data[(by * CAM_MOTION_BLOCK_SIZE + row) * CAM_LUMA_MAX_WIDTH + bx * CAM_MOTION_BLOCK_SIZE];
+
+    acc += CAM_MOTION_sad4(wa[0], wb[0]);
+    acc += CAM_MOTION_sad4(wa[1], wb[1]);
+  }
+
+  return (acc & 0xFFFFU) + (acc >> 16);
+}
+
+// Counts the blocks whose mean absolute difference exceeds the threshold
+static uint16_t CAM_MOTION_changed_blocks(const cam_luma_t *a, const cam_luma_t *b, uint32_t threshold, uint16_t *blocks)
+{
+  uint16_t blocks_x = a->width / CAM_MOTION_BLOCK_SIZE;
+  uint16_t blocks_y = (a->height + CAM_MOTION_BLOCK_SIZE - 1U) / CAM_MOTION_BLOCK_SIZE;
+  uint16_t rows = 0;
+  uint16_t changed = 0;
+
+  for (uint16_t by = 0; by < blocks_y; ++by)
+  {
+    // The last block row may be cut short
+    rows = a->height - by * CAM_MOTION_BLOCK_SIZE;
+    rows = (rows > CAM_MOTION_BLOCK_SIZE) ? CAM_MOTION_BLOCK_SIZE : rows;
+
+    for (uint16_t bx = 0; bx < blocks_x; ++bx)
+    {
+      if (CAM_MOTION_block_sad(a, b, bx, by, rows) > threshold * rows * CAM_MOTION_BLOCK_SIZE)
+      {
+        changed++;
+      }
+    }
+  }
+
+  *blocks = blocks_x * blocks_y;
+  return changed;
+}
+
+static void CAM_MOTION_analyse()
+{
+  uint64_t sensitivity = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_motion_sensitivity, CAM_MOTION_DEFAULT_SENSITIVITY);
+  uint32_t threshold = 0;
+  uint16_t required = 0;
+  uint16_t changed = 0;
+  uint16_t blocks = 0;
+  cam_luma_t *swap = NULL;
+
+  sensitivity = (sensitivity > 100U) ? 100U : sensitivity;
+  threshold = CAM_MOTION_PIXEL_THRESHOLD_MIN
+            + (100U - sensitivity) * (CAM_MOTION_PIXEL_THRESHOLD_MAX - CAM_MOTION_PIXEL_THRESHOLD_MIN) / 100U;
+  required = 1U + (100U - sensitivity) / CAM_MOTION_BLOCK_STEP;
+
+  // A frame size change makes the planes incomparable, start over
+  if (_reference_valid
+    && _reference->width == _current->width
+    && _reference->height == _current->height)
+  {
+    changed = CAM_MOTION_changed_blocks(_reference, _current, threshold, &blocks);
+
+    _stats.analysed++;
+    _stats.changed_blocks = changed;
+    _stats.blocks = blocks;
+
+    if (changed >= required)
+    {
+      _stats.events++;
+
+      portENTER_CRITICAL(&_event_lock);
+      _event = 1;
+      portEXIT_CRITICAL(&_event_lock);
+    }
+  }
+
+  swap = _reference;
+  _reference = _current;
+  _current = swap;
+  _reference_valid = 1;
+}
+
+static void CAM_MOTION_log_stats()
+{
+  cam_luma_stats_t luma;
+  int64_t now = esp_timer_get_time();
+
+  if (now - _stats_logged_at < CAM_MOTION_STATS_LOG_US)
+  {
+    return;
+  }
+  _stats_logged_at = now;
+
+  CAM_LUMA_get_stats(&luma);
+  ESP_LOGI(LOG_TAG, "Motion: %u events in %u comparisons, last analysis %u us, JPEG scan avg %u us max %u us\n",
+           _stats.events, _stats.analysed, _stats.analysis_us,
+           luma.scans ? (uint32_t) (luma.total_us / luma.scans) : 0, luma.max_us);
+}
+
+static void CAM_MOTION_runner(void *arg)
+{
+  cam_frame_t *frame = NULL;
+  uint32_t seq = 0;
+  int64_t start = 0;
+  int res = EXIT_FAILURE;
+
+  (void) arg;
+
+  _motion_active = 1;
+
+  while (_motion_running)
+  {
+    if ((frame = CAM_SERVICE_frame_acquire(seq, CAM_MOTION_FRAME_WAIT_MS / portTICK_PERIOD_MS)) == NULL)
+    {
+      continue;
+    }
+
+    start = esp_timer_get_time();
+    seq = frame->seq;
+    res = CAM_LUMA_from_frame(frame, _current);
+    CAM_SERVICE_frame_release(frame);
+
+    if (res == EXIT_SUCCESS)
+    {
+      CAM_MOTION_analyse();
+      _stats.analysis_us = (uint32_t) (esp_timer_get_time() - start);
+    }
+
+    CAM_MOTION_log_stats();
+
+    vTaskDelay(CAM_MOTION_INTERVAL_MS / portTICK_PERIOD_MS);
+  }
+
+  _motion_active = 0;
+}
+
+int CAM_MOTION_init()
+{
+  if (_motion_running)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  memset(&_stats, 0, sizeof(_stats));
+  _reference_valid = 0;
+  _event = 0;
+  _motion_running = 1;
+
+  if (!Iot_CreateDetachedThread(CAM_MOTION_runner,
+                                NULL,
+                                CAM_MOTION_TASK_PRIORITY,
+                                CAM_MOTION_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create motion detection task\n");
+    _motion_running = 0;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_MOTION_deinit()
+{
+  _motion_running = 0;
+
+  while (_motion_active)
+  {
+    vTaskDelay(CAM_MOTION_STOP_POLL_MS / portTICK_PERIOD_MS);
+  }
+}
+
+uint8_t CAM_MOTION_take_event()
+{
+  uint8_t event = 0;
+
+  portENTER_CRITICAL(&_event_lock);
+  event = _event;
+  _event = 0;
+  portEXIT_CRITICAL(&_event_lock);
+
+  return event;
+}
+
+void CAM_MOTION_get_stats(cam_motion_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_motion_stats_t));
+}
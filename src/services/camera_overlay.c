@@ -0,0 +1,464 @@
+/*
+* @file camera_overlay.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_overlay.h"
+#include "camera_service.h"
+#include "camera_jpeg.h"
+#include "kvs_service.h"
+#include "system_controller.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#define LOG_TAG                       "CAMERA OVERLAY"
+
+// Settings are read from KVS at most this often, the producer calls in for every frame
+#define CAM_OVERLAY_POLL_US           (1000000LL)
+// Wall clock times before this are taken as the clock not being set yet
+#define CAM_OVERLAY_VALID_TIME        (1609459200LL)
+// Masked JPEG frames are written to a scratch buffer grown in these steps,
+// frames of similar size reuse it
+#define CAM_OVERLAY_SCRATCH_STEP      (16384U)
+
+#define CAM_OVERLAY_GLYPH_WIDTH       (5U)
+#define CAM_OVERLAY_GLYPH_HEIGHT      (7U)
+// Glyph plus one pixel of spacing, the text box has one more around it
+#define CAM_OVERLAY_CELL_WIDTH        (CAM_OVERLAY_GLYPH_WIDTH + 1U)
+#define CAM_OVERLAY_BOX_HEIGHT        (CAM_OVERLAY_GLYPH_HEIGHT + 2U)
+#define CAM_OVERLAY_MAX_CHARS         (20U)
+#define CAM_OVERLAY_MAX_SCALE         (4U)
+#define CAM_OVERLAY_MAX_BPP           (2U)
+#define CAM_OVERLAY_LINE_SIZE         ((CAM_OVERLAY_MAX_CHARS * CAM_OVERLAY_CELL_WIDTH + 1U) * CAM_OVERLAY_MAX_SCALE * CAM_OVERLAY_MAX_BPP)
+// Frame width per step of the text scale, a VGA frame gets twice the glyph size
+#define CAM_OVERLAY_SCALE_WIDTH       (640U)
+
+#define CAM_OVERLAY_GLYPH_DASH        (10U)
+#define CAM_OVERLAY_GLYPH_COLON       (11U)
+#define CAM_OVERLAY_GLYPH_BLANK       (12U)
+
+/*
+* @brief Masked region, in percent of the frame.
+*/
+typedef struct cam_overlay_mask {
+  uint32_t left;
+  uint32_t top;
+  uint32_t width;
+  uint32_t height;
+} cam_overlay_mask_t;
+
+// 5x7 glyphs for the digits, dash, colon and blank, one row per byte with the
+// leftmost pixel in bit 4
+static const uint8_t _glyphs[][CAM_OVERLAY_GLYPH_HEIGHT] = {
+  {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E},
+  {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+  {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F},
+  {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+  {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02},
+  {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+  {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E},
+  {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+  {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E},
+  {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C},
+  {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00},
+  {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00},
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+static cam_overlay_mask_t _masks[CAM_OVERLAY_MAX_MASKS];
+static char _masks_value[KVS_SERVICE_MAXIMUM_VALUE_SIZE];
+static uint8_t _mask_count = 0;
+static uint8_t _timestamp = 0;
+static uint8_t _loaded = 0;
+static int64_t _read_at = 0;
+
+// One rendered scanline of the text box, word aligned for the fills
+static uint32_t _line[(CAM_OVERLAY_LINE_SIZE + 3U) / 4U];
+
+static uint8_t *_scratch = NULL;
+static size_t _scratch_size = 0;
+
+static cam_overlay_stats_t _stats;
+
+// Parses "left,top,width,height" regions separated by semicolons, empty
+// regions are dropped
+static void CAM_OVERLAY_parse_masks(char *value)
+{
+  cam_overlay_mask_t mask;
+  char *save = NULL;
+  char *token = NULL;
+
+  _mask_count = 0;
+
+  for (token = strtok_r(value, ";", &save); token; token = strtok_r(NULL, ";", &save))
+  {
+    // Each part is checked on its own first, their sum could wrap
+    if (sscanf(token, "%u,%u,%u,%u", &mask.left, &mask.top, &mask.width, &mask.height) != 4
+      || mask.left > 100U || mask.top > 100U || mask.width > 100U || mask.height > 100U
+      || mask.left + mask.width > 100U || mask.top + mask.height > 100U)
+    {
+      ESP_LOGI(LOG_TAG, "Invalid Privacy Mask <%s>\n", token);
+      continue;
+    }
+
+    if (!mask.width || !mask.height)
+    {
+      continue;
+    }
+
+    if (_mask_count == CAM_OVERLAY_MAX_MASKS)
+    {
+      ESP_LOGI(LOG_TAG, "Only %u Privacy Masks are applied\n", CAM_OVERLAY_MAX_MASKS);
+      break;
+    }
+    _masks[_mask_count++] = mask;
+  }
+}
+
+static void CAM_OVERLAY_load()
+{
+  kvs_entry_t entry = {
+    .key = kvs_entry_eye_privacy_masks,
+    .value_len = KVS_SERVICE_MAXIMUM_VALUE_SIZE
+  };
+  int64_t now = esp_timer_get_time();
+
+  if (_loaded && now - _read_at < CAM_OVERLAY_POLL_US)
+  {
+    return;
+  }
+
+  memset(entry.value, '\0', KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+
+  // Only parsed again once changed, parsing cuts the value apart
+  if (SC_send_cmd(sc_service_kvs, KVS_SERVICE_CMD_GET_KEY_VALUE, &entry) == EXIT_SUCCESS
+    && strncmp(entry.value, _masks_value, KVS_SERVICE_MAXIMUM_VALUE_SIZE) != 0)
+  {
+    entry.value[KVS_SERVICE_MAXIMUM_VALUE_SIZE - 1] = '\0';
+    memcpy(_masks_value, entry.value, KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+    CAM_OVERLAY_parse_masks(entry.value);
+  }
+
+  _timestamp = (CAM_SERVICE_kvs_get_uint(kvs_entry_eye_timestamp_overlay, 0) != 0);
+  _read_at = now;
+  _loaded = 1;
+}
+
+// Fills len bytes with the pattern a word at a time. The pattern repeats one
+// pixel of 1 or 2 bytes, so as long as dst starts on a pixel it reads the same
+// from any byte offset and needs no rotation after the unaligned head.
+static void CAM_OVERLAY_fill(uint8_t *dst, size_t len, const uint8_t pattern[4])
+{
+  uint32_t word = 0;
+  uint32_t *words = NULL;
+  size_t count = 0;
+  size_t i = 0;
+
+  while (len && ((uintptr_t) dst & 3U))
+  {
+    *dst++ = pattern[i++ & 3U];
+    len--;
+  }
+
+  memcpy(&word, pattern, sizeof(word));
+  words = (uint32_t *) dst;
+  count = len / 4U;
+  for (i = 0; i < count; ++i)
+  {
+    words[i] = word;
+  }
+
+  dst += count * 4U;
+  len -= count * 4U;
+  for (i = 0; i < len; ++i)
+  {
+    dst[i] = pattern[i & 3U];
+  }
+}
+
+// Sets the black and white pixel patterns, returns the bytes per pixel or 0
+// if the format is not handled
+static uint8_t CAM_OVERLAY_patterns(pixformat_t format, uint8_t black[4], uint8_t white[4])
+{
+  switch (format)
+  {
+    case PIXFORMAT_GRAYSCALE:
+      memset(black, 0x00, 4);
+      memset(white, 0xFF, 4);
+      return 1;
+    case PIXFORMAT_RGB565:
+      memset(black, 0x00, 4);
+      memset(white, 0xFF, 4);
+      return 2;
+    case PIXFORMAT_YUV422:
+      // YUYV, with neutral chroma every pixel is its luma followed by 128
+      black[0] = black[2] = 0x00;
+      white[0] = white[2] = 0xFF;
+      black[1] = black[3] = white[1] = white[3] = 0x80;
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+static void CAM_OVERLAY_mask(camera_fb_t *fb, uint8_t bpp, const uint8_t black[4])
+{
+  size_t stride = (size_t) fb->width * bpp;
+  size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+  for (uint8_t i = 0; i < _mask_count; ++i)
+  {
+    // Widened outwards to whole pixels
+    x0 = (size_t) _masks[i].left * fb->width / 100U;
+    y0 = (size_t) _masks[i].top * fb->height / 100U;
+    x1 = ((size_t) (_masks[i].left + _masks[i].width) * fb->width + 99U) / 100U;
+    y1 = ((size_t) (_masks[i].top + _masks[i].height) * fb->height + 99U) / 100U;
+
+    // Full width rows are contiguous, blank them in one go
+    if (0 == x0 && fb->width == x1)
+    {
+      CAM_OVERLAY_fill(&fb->buf[y0 * stride], (y1 - y0) * stride, black);
+      continue;
+    }
+
+    for (size_t y = y0; y < y1; ++y)
+    {
+      CAM_OVERLAY_fill(&fb->buf[y * stride + x0 * bpp], (x1 - x0) * bpp, black);
+    }
+  }
+}
+
+// Blanks the masks in the coded data. The masked frame is written next to the
+// original and copied back over it, it only grows past the original when
+// little of the frame is masked and is then refused.
+static int CAM_OVERLAY_mask_jpeg(camera_fb_t *fb)
+{
+  cam_jpeg_rect_t rects[CAM_OVERLAY_MAX_MASKS];
+  uint32_t caps = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  size_t size = 0;
+  size_t len = 0;
+
+  if (fb->len > _scratch_size)
+  {
+    size = (fb->len + CAM_OVERLAY_SCRATCH_STEP - 1U) / CAM_OVERLAY_SCRATCH_STEP * CAM_OVERLAY_SCRATCH_STEP;
+    free(_scratch);
+    _scratch_size = 0;
+    if ((_scratch = heap_caps_malloc(size, caps)) == NULL)
+    {
+      return EXIT_FAILURE;
+    }
+    _scratch_size = size;
+  }
+
+  for (uint8_t i = 0; i < _mask_count; ++i)
+  {
+    rects[i].x = (uint32_t) _masks[i].left * fb->width / 100U;
+    rects[i].y = (uint32_t) _masks[i].top * fb->height / 100U;
+    rects[i].width = ((uint32_t) (_masks[i].left + _masks[i].width) * fb->width + 99U) / 100U - rects[i].x;
+    rects[i].height = ((uint32_t) (_masks[i].top + _masks[i].height) * fb->height + 99U) / 100U - rects[i].y;
+  }
+
+  if (CAM_JPEG_mask(fb->buf, fb->len, rects, _mask_count, _scratch, fb->len, &len) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  memcpy(fb->buf, _scratch, len);
+  fb->len = len;
+
+  return EXIT_SUCCESS;
+}
+
+static uint8_t CAM_OVERLAY_glyph(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return (uint8_t) (c - '0');
+  }
+  return ('-' == c) ? CAM_OVERLAY_GLYPH_DASH : ((':' == c) ? CAM_OVERLAY_GLYPH_COLON : CAM_OVERLAY_GLYPH_BLANK);
+}
+
+// Capture time as UTC date and time, or the uptime while the clock is unset
+static void CAM_OVERLAY_format_time(const camera_fb_t *fb, char *text, size_t len)
+{
+  time_t captured = fb->timestamp.tv_sec;
+  uint32_t uptime = (uint32_t) (esp_timer_get_time() / 1000000LL);
+  struct tm tm;
+
+  if (captured >= CAM_OVERLAY_VALID_TIME)
+  {
+    gmtime_r(&captured, &tm);
+    if (strftime(text, len, "%Y-%m-%d %H:%M:%S", &tm) != 0)
+    {
+      return;
+    }
+  }
+
+  snprintf(text, len, "%u:%02u:%02u", uptime / 3600U, uptime / 60U % 60U, uptime % 60U);
+}
+
+// Renders each glyph row once into the line buffer and copies it onto all
+// scanlines it covers
+static void CAM_OVERLAY_stamp(camera_fb_t *fb, uint8_t bpp, const uint8_t black[4], const uint8_t white[4])
+{
+  char text[CAM_OVERLAY_MAX_CHARS + 1];
+  uint8_t *line = (uint8_t *) _line;
+  size_t stride = (size_t) fb->width * bpp;
+  size_t scale = 1U + fb->width / CAM_OVERLAY_SCALE_WIDTH;
+  size_t margin = 0;
+  size_t chars = 0;
+  size_t box_width = 0;
+  size_t copy = 0;
+  size_t y = 0;
+  uint8_t bits = 0;
+
+  scale = (scale > CAM_OVERLAY_MAX_SCALE) ? CAM_OVERLAY_MAX_SCALE : scale;
+  margin = 2U * scale;
+
+  CAM_OVERLAY_format_time(fb, text, sizeof(text));
+  chars = strlen(text);
+  box_width = (chars * CAM_OVERLAY_CELL_WIDTH + 1U) * scale;
+
+  if (fb->width <= margin || fb->height <= margin)
+  {
+    return;
+  }
+  copy = (box_width < fb->width - margin ? box_width : fb->width - margin) * bpp;
+
+  for (uint8_t row = 0; row < CAM_OVERLAY_BOX_HEIGHT; ++row)
+  {
+    CAM_OVERLAY_fill(line, box_width * bpp, black);
+
+    // The top and bottom rows of the box are left blank
+    for (size_t c = 0; row > 0 && row <= CAM_OVERLAY_GLYPH_HEIGHT && c < chars; ++c)
+    {
+      bits = _glyphs[CAM_OVERLAY_glyph(text[c])][row - 1U];
+      for (uint8_t x = 0; bits && x < CAM_OVERLAY_GLYPH_WIDTH; ++x)
+      {
+        if (bits & (0x10U >> x))
+        {
+          CAM_OVERLAY_fill(&line[(1U + c * CAM_OVERLAY_CELL_WIDTH + x) * scale * bpp], scale * bpp, white);
+        }
+      }
+    }
+
+    for (size_t s = 0; s < scale; ++s)
+    {
+      y = margin + row * scale + s;
+      if (y >= fb->height)
+      {
+        return;
+      }
+      memcpy(&fb->buf[y * stride + margin * bpp], line, copy);
+    }
+  }
+}
+
+int CAM_OVERLAY_apply(camera_fb_t *fb)
+{
+  uint8_t black[4];
+  uint8_t white[4];
+  int64_t start = esp_timer_get_time();
+  uint8_t bpp = 0;
+
+  if (NULL == fb || NULL == fb->buf)
+  {
+    return EXIT_FAILURE;
+  }
+
+  CAM_OVERLAY_load();
+
+  if (!_mask_count && !_timestamp)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (PIXFORMAT_JPEG == fb->format)
+  {
+    if (_mask_count && CAM_OVERLAY_mask_jpeg(fb) != EXIT_SUCCESS)
+    {
+      if (!_stats.refused++)
+      {
+        ESP_LOGW(LOG_TAG, "Privacy Masks could not be applied, frames dropped\n");
+      }
+      return EXIT_FAILURE;
+    }
+
+    // The capture time is carried in the JPEG comment instead
+    if (_timestamp && !_stats.skipped++)
+    {
+      ESP_LOGW(LOG_TAG, "Timestamp Overlay needs raw frames, not applied\n");
+    }
+  }
+  else if ((bpp = CAM_OVERLAY_patterns(fb->format, black, white)) == 0
+    || fb->len < (size_t) fb->width * fb->height * bpp)
+  {
+    // A frame that cannot be masked must never reach a consumer
+    if (_mask_count)
+    {
+      if (!_stats.refused++)
+      {
+        ESP_LOGW(LOG_TAG, "Privacy Masks not supported for this frame format, frames dropped\n");
+      }
+      return EXIT_FAILURE;
+    }
+    _stats.skipped++;
+    return EXIT_SUCCESS;
+  }
+  else
+  {
+    CAM_OVERLAY_mask(fb, bpp, black);
+
+    if (_timestamp)
+    {
+      CAM_OVERLAY_stamp(fb, bpp, black, white);
+    }
+  }
+
+  _stats.processed++;
+  _stats.last_us = esp_timer_get_time() - start;
+  if (_stats.last_us > _stats.max_us)
+  {
+    _stats.max_us = _stats.last_us;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_OVERLAY_get_stats(cam_overlay_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_overlay_stats_t));
+}
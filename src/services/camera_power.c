@@ -0,0 +1,319 @@
+/*
+* @file camera_power.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_power.h"
+#include "camera_service.h"
+#include "kvs_service.h"
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define LOG_TAG                     "CAMERA POWER"
+
+// The driver runs XCLK off a high speed LEDC timer on the ESP32
+#define CAM_POWER_LEDC_MODE         (LEDC_HIGH_SPEED_MODE)
+
+// Time the sensor is given to come out of power down before it is configured
+#define CAM_POWER_WAKE_MS           (10U)
+// The idle time is read from KVS at most this often
+#define CAM_POWER_IDLE_POLL_US      (1000000LL)
+
+// OV2640 datasheet figures, used to estimate the average sensor power
+#define CAM_POWER_ACTIVE_MW         (125U)
+#define CAM_POWER_STANDBY_MW        (2U)
+
+static int _pin_pwdn = -1;
+static ledc_timer_t _ledc_timer;
+
+// Sensor settings from before the last power down, restored on wake up
+static camera_status_t _snapshot;
+
+static volatile uint8_t _powered = 1;
+static volatile int64_t _last_demand = 0;
+static volatile int64_t _wake_started = 0;
+static uint64_t _idle_seconds = 0;
+static int64_t _idle_read_at = 0;
+
+static int64_t _started = 0;
+static int64_t _powered_since = 0;
+static int64_t _powered_us = 0;
+static cam_power_stats_t _stats;
+
+static SemaphoreHandle_t _power_mutex = NULL;
+static SemaphoreHandle_t _wake_sem = NULL;  // Given on every wake up
+
+static uint8_t _initialized = 0;
+
+// Reapplies the settings through the sensor driver, which keeps its status in
+// sync with the registers
+static void CAM_POWER_restore(sensor_t *s, const camera_status_t *st)
+{
+  s->set_framesize(s, st->framesize);
+  s->set_quality(s, st->quality);
+  s->set_brightness(s, st->brightness);
+  s->set_contrast(s, st->contrast);
+  s->set_saturation(s, st->saturation);
+  s->set_sharpness(s, st->sharpness);
+  s->set_denoise(s, st->denoise);
+  s->set_special_effect(s, st->special_effect);
+  s->set_wb_mode(s, st->wb_mode);
+  s->set_whitebal(s, st->awb);
+  s->set_awb_gain(s, st->awb_gain);
+  s->set_exposure_ctrl(s, st->aec);
+  s->set_aec2(s, st->aec2);
+  s->set_ae_level(s, st->ae_level);
+  s->set_aec_value(s, st->aec_value);
+  s->set_gain_ctrl(s, st->agc);
+  s->set_agc_gain(s, st->agc_gain);
+  s->set_gainceiling(s, st->gainceiling);
+  s->set_bpc(s, st->bpc);
+  s->set_wpc(s, st->wpc);
+  s->set_raw_gma(s, st->raw_gma);
+  s->set_lenc(s, st->lenc);
+  s->set_hmirror(s, st->hmirror);
+  s->set_vflip(s, st->vflip);
+  s->set_dcw(s, st->dcw);
+  s->set_colorbar(s, st->colorbar);
+}
+
+// Must be called with the power mutex held
+static void CAM_POWER_down()
+{
+  sensor_t *s = esp_camera_sensor_get();
+  int64_t now = esp_timer_get_time();
+
+  if (s)
+  {
+    memcpy(&_snapshot, &s->status, sizeof(camera_status_t));
+  }
+
+  gpio_set_level(_pin_pwdn, 1);
+  ledc_timer_pause(CAM_POWER_LEDC_MODE, _ledc_timer);
+
+  // A wake up left over from before must not end the next wait early
+  xSemaphoreTake(_wake_sem, 0);
+
+  _powered_us += now - _powered_since;
+  _powered = 0;
+  _stats.sleeps++;
+
+  ESP_LOGI(LOG_TAG, "Sensor powered down after %u s idle\n", (uint32_t) ((now - _last_demand) / 1000000LL));
+}
+
+// Must be called with the power mutex held. Brings the sensor back without
+// probing it again, the driver and its buffers stayed in place.
+static void CAM_POWER_up()
+{
+  sensor_t *s = esp_camera_sensor_get();
+
+  _wake_started = esp_timer_get_time();
+
+  ledc_timer_resume(CAM_POWER_LEDC_MODE, _ledc_timer);
+  gpio_set_level(_pin_pwdn, 0);
+  vTaskDelay(CAM_POWER_WAKE_MS / portTICK_PERIOD_MS);
+
+  if (s)
+  {
+    CAM_POWER_restore(s, &_snapshot);
+  }
+
+  _powered_since = esp_timer_get_time();
+  _powered = 1;
+  _stats.wakes++;
+
+  xSemaphoreGive(_wake_sem);
+}
+
+int CAM_POWER_init(const camera_config_t *config)
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (!_power_mutex)
+  {
+    if ((_power_mutex = xSemaphoreCreateMutex()) == NULL
+      || (_wake_sem = xSemaphoreCreateBinary()) == NULL)
+    {
+      return EXIT_FAILURE;
+    }
+    _started = esp_timer_get_time();
+  }
+
+  // Without a power down pin the sensor simply keeps running
+  _pin_pwdn = config->pin_pwdn;
+  _ledc_timer = config->ledc_timer;
+
+  _powered = 1;
+  _powered_since = esp_timer_get_time();
+  _last_demand = _powered_since;
+  _wake_started = 0;
+  _idle_read_at = 0;
+
+  _initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_POWER_deinit()
+{
+  if (!_initialized)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_power_mutex, portMAX_DELAY);
+  if (!_powered)
+  {
+    ledc_timer_resume(CAM_POWER_LEDC_MODE, _ledc_timer);
+    gpio_set_level(_pin_pwdn, 0);
+    _powered_since = esp_timer_get_time();
+    _powered = 1;
+  }
+  _powered_us += esp_timer_get_time() - _powered_since;
+  _initialized = 0;
+  xSemaphoreGive(_power_mutex);
+
+  // Let a producer waiting for a wake up see that it is stopped
+  xSemaphoreGive(_wake_sem);
+}
+
+void CAM_POWER_demand()
+{
+  if (!_initialized)
+  {
+    return;
+  }
+
+  _last_demand = esp_timer_get_time();
+
+  if (_powered)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_power_mutex, portMAX_DELAY);
+  if (_initialized && !_powered)
+  {
+    CAM_POWER_up();
+  }
+  xSemaphoreGive(_power_mutex);
+}
+
+uint8_t CAM_POWER_suspended(TickType_t wait)
+{
+  int64_t now = esp_timer_get_time();
+
+  if (!_initialized || _pin_pwdn < 0)
+  {
+    return 0;
+  }
+
+  if (_powered)
+  {
+    if (now - _idle_read_at >= CAM_POWER_IDLE_POLL_US)
+    {
+      _idle_seconds = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_sensor_idle_seconds, 0);
+      _idle_read_at = now;
+    }
+
+    if (!_idle_seconds || now - _last_demand < (int64_t) _idle_seconds * 1000000LL)
+    {
+      return 0;
+    }
+
+    // Demand may have come in since the check above
+    xSemaphoreTake(_power_mutex, portMAX_DELAY);
+    if (_powered && now - _last_demand >= (int64_t) _idle_seconds * 1000000LL)
+    {
+      CAM_POWER_down();
+    }
+    xSemaphoreGive(_power_mutex);
+  }
+
+  if (!_powered)
+  {
+    xSemaphoreTake(_wake_sem, wait);
+  }
+
+  return !_powered;
+}
+
+void CAM_POWER_frame_published()
+{
+  int64_t started = _wake_started;
+
+  if (!started)
+  {
+    return;
+  }
+
+  _wake_started = 0;
+  _stats.wake_us = esp_timer_get_time() - started;
+  if (_stats.wake_us > _stats.max_wake_us)
+  {
+    _stats.max_wake_us = _stats.wake_us;
+  }
+
+  ESP_LOGI(LOG_TAG, "Sensor woke up, first frame after %u us\n", _stats.wake_us);
+}
+
+void CAM_POWER_get_stats(cam_power_stats_t *stats)
+{
+  int64_t now = esp_timer_get_time();
+  int64_t powered = 0;
+
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  if (!_power_mutex)
+  {
+    memset(stats, 0, sizeof(cam_power_stats_t));
+    return;
+  }
+
+  xSemaphoreTake(_power_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_power_stats_t));
+  powered = _powered_us + ((_initialized && _powered) ? now - _powered_since : 0);
+  xSemaphoreGive(_power_mutex);
+
+  if (now > _started)
+  {
+    stats->duty_percent = 100LL * powered / (now - _started);
+    stats->power_mw = CAM_POWER_STANDBY_MW + (CAM_POWER_ACTIVE_MW - CAM_POWER_STANDBY_MW) * powered / (now - _started);
+  }
+}
@@ -0,0 +1,228 @@
+/*
+* @file camera_preview.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_preview.h"
+#include "camera_jpeg.h"
+#include "camera_jpeg_pool.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define LOG_TAG                       "CAMERA PREVIEW"
+
+// Previews are small, a lower quality than for full frames hardly shows
+#define CAM_PREVIEW_JPEG_QUALITY      (70U)
+
+// The scaled image is handed to the encoder as YUYV, two bytes per pixel
+#define CAM_PREVIEW_BYTES_PER_PIXEL   (2U)
+
+/*
+* @brief Destination of the scaled blocks. Each sample of a component covers
+* h_span by v_span output pixels, as given by the sampling factors.
+*/
+typedef struct cam_preview_writer {
+  uint8_t *yuv;
+  uint16_t width;
+  uint16_t height;
+  uint8_t h_span[CAM_JPEG_MAX_COMPONENTS];
+  uint8_t v_span[CAM_JPEG_MAX_COMPONENTS];
+} cam_preview_writer_t;
+
+// Scaled image of the last preview, kept and only grown between previews
+static uint8_t *_yuv = NULL;
+static size_t _yuv_size = 0;
+
+static cam_preview_stats_t _stats;
+
+static int CAM_PREVIEW_reserve(size_t size)
+{
+  uint32_t caps = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+  if (size <= _yuv_size)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  free(_yuv);
+  _yuv_size = 0;
+
+  if ((_yuv = heap_caps_malloc(size, caps)) == NULL)
+  {
+    ESP_LOGW(LOG_TAG, "Could not allocate %u bytes for a preview\n", (uint32_t) size);
+    return EXIT_FAILURE;
+  }
+  _yuv_size = size;
+
+  return EXIT_SUCCESS;
+}
+
+// Writes a scaled block into the YUYV image. Chroma is taken from the sample
+// covering the even pixel of each pair.
+static void CAM_PREVIEW_write_block(void *arg, uint8_t component, uint16_t bx, uint16_t by, const uint8_t *pixels, uint8_t size)
+{
+  cam_preview_writer_t *writer = (cam_preview_writer_t*) arg;
+  uint8_t h_span = writer->h_span[component];
+  uint8_t v_span = writer->v_span[component];
+  uint8_t offset = (0 == component) ? 0 : ((1 == component) ? 1 : 3);
+  uint16_t x0 = 0;
+  uint16_t y0 = 0;
+  uint8_t *row = NULL;
+
+  for (uint8_t j = 0; j < size; ++j)
+  {
+    y0 = (by * size + j) * v_span;
+
+    for (uint16_t y = y0; y < y0 + v_span && y < writer->height; ++y)
+    {
+      row = writer->yuv + (size_t) y * writer->width * CAM_PREVIEW_BYTES_PER_PIXEL;
+
+      for (uint8_t i = 0; i < size; ++i)
+      {
+        x0 = (bx * size + i) * h_span;
+
+        for (uint16_t x = x0; x < x0 + h_span && x < writer->width; ++x)
+        {
+          if (0 == component)
+          {
+            row[x * CAM_PREVIEW_BYTES_PER_PIXEL] = pixels[j * size + i];
+          }
+          else if (!(x & 1U))
+          {
+            row[x * CAM_PREVIEW_BYTES_PER_PIXEL + offset] = pixels[j * size + i];
+          }
+        }
+      }
+    }
+  }
+}
+
+cam_frame_t* CAM_PREVIEW_make(const cam_frame_t *frame, uint8_t scale)
+{
+  cam_preview_writer_t writer;
+  cam_jpeg_info_t info;
+  camera_fb_t fb;
+  cam_frame_t scaled;
+  cam_frame_t *jpeg = NULL;
+  int64_t start = esp_timer_get_time();
+  uint8_t size = 0;
+
+  if (NULL == frame || PIXFORMAT_JPEG != frame->format
+    || (2 != scale && 4 != scale && 8 != scale)
+    || CAM_JPEG_parse(frame->buf, frame->len, &info) != EXIT_SUCCESS)
+  {
+    _stats.failed++;
+    return NULL;
+  }
+
+  size = CAM_JPEG_MAX_SCALED_SIZE * 2U / scale;
+
+  memset(&writer, 0, sizeof(writer));
+  for (uint8_t c = 0; c < info.components; ++c)
+  {
+    // Sampling factors that do not divide the largest ones are not supported
+    if (info.h_max % info.comp[c].h || info.v_max % info.comp[c].v)
+    {
+      _stats.failed++;
+      return NULL;
+    }
+    writer.h_span[c] = info.h_max / info.comp[c].h;
+    writer.v_span[c] = info.v_max / info.comp[c].v;
+  }
+
+  // YUYV needs an even width, an odd last column is dropped
+  writer.width = ((info.width * size + 7U) / 8U) & ~1U;
+  writer.height = (info.height * size + 7U) / 8U;
+
+  if (!writer.width || CAM_PREVIEW_reserve((size_t) writer.width * writer.height * CAM_PREVIEW_BYTES_PER_PIXEL) != EXIT_SUCCESS)
+  {
+    _stats.failed++;
+    return NULL;
+  }
+  writer.yuv = _yuv;
+
+  // Grayscale frames only write luma
+  if (1 == info.components)
+  {
+    memset(_yuv, 128, _yuv_size);
+  }
+
+  if (CAM_JPEG_scan_scaled(frame->buf, frame->len, NULL, size, CAM_PREVIEW_write_block, &writer) != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "Frame %u could not be scaled\n", frame->seq);
+    _stats.failed++;
+    return NULL;
+  }
+
+  memset(&fb, 0, sizeof(fb));
+  fb.buf = _yuv;
+  fb.len = (size_t) writer.width * writer.height * CAM_PREVIEW_BYTES_PER_PIXEL;
+  fb.width = writer.width;
+  fb.height = writer.height;
+  fb.format = PIXFORMAT_YUV422;
+
+  memset(&scaled, 0, sizeof(scaled));
+  scaled.buf = fb.buf;
+  scaled.len = fb.len;
+  scaled.width = fb.width;
+  scaled.height = fb.height;
+  scaled.format = fb.format;
+  scaled.seq = frame->seq;
+  scaled.timestamp = frame->timestamp;
+  scaled.captured = frame->captured;
+  scaled.wall_time = frame->wall_time;
+  scaled.fb = &fb;
+
+  if ((jpeg = CAM_JPOOL_encode(&scaled, CAM_PREVIEW_JPEG_QUALITY)) == NULL)
+  {
+    _stats.failed++;
+    return NULL;
+  }
+
+  _stats.made++;
+  _stats.last_us = (uint32_t) (esp_timer_get_time() - start);
+  if (_stats.last_us > _stats.max_us)
+  {
+    _stats.max_us = _stats.last_us;
+  }
+  _stats.last_percent = frame->len ? 100ULL * jpeg->len / frame->len : 0;
+
+  return jpeg;
+}
+
+void CAM_PREVIEW_get_stats(cam_preview_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  memcpy(stats, &_stats, sizeof(cam_preview_stats_t));
+}
@@ -0,0 +1,402 @@
+/*
+* @file camera_rate_control.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_rate_control.h"
+#include "camera_service.h"
+#include "kvs_service.h"
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define LOG_TAG                       "CAMERA RATE CONTROL"
+
+#define CAM_RC_INTERVAL_US            (1000000LL)
+// Intervals to ignore after a change, frames in flight still carry the old settings
+#define CAM_RC_SETTLE_INTERVALS       (2U)
+// Consecutive intervals well below target required before improving again
+#define CAM_RC_UPGRADE_INTERVALS      (3U)
+
+#define CAM_RC_QUALITY_STEP           (5U)
+#define CAM_RC_QUALITY_WORST          (40U)
+#define CAM_RC_DEFAULT_TARGET_MS      (300U)
+
+// Frame sizes the controller steps through, largest first
+static const framesize_t _frame_sizes[] = {
+  FRAMESIZE_UXGA,
+  FRAMESIZE_SXGA,
+  FRAMESIZE_XGA,
+  FRAMESIZE_SVGA,
+  FRAMESIZE_VGA,
+  FRAMESIZE_CIF,
+  FRAMESIZE_QVGA
+};
+
+// Frame intervals the controller steps through once quality and size are at
+// their lowest, i.e. the controller skips frames as a last resort
+static const uint32_t _frame_intervals_ms[] = { 0, 100, 200, 500, 1000 };
+
+#define CAM_RC_FRAME_SIZE_COUNT       (sizeof(_frame_sizes) / sizeof(_frame_sizes[0]))
+#define CAM_RC_FRAME_INTERVAL_COUNT   (sizeof(_frame_intervals_ms) / sizeof(_frame_intervals_ms[0]))
+
+static framesize_t _max_frame_size;
+static uint8_t _best_quality;
+
+static framesize_t _frame_size;
+static uint8_t _quality;
+static uint8_t _interval_index;
+
+static int64_t _interval_worst_us;
+static int64_t _latency_us;
+static int64_t _last_update;
+static uint8_t _settle;
+static uint8_t _good_intervals;
+static uint32_t _adjustments;
+static uint32_t _target_ms;
+static uint8_t _held;           // The sensor runs other settings, see CAM_RC_hold
+
+// Guards the controller state against baseline changes from other tasks
+static SemaphoreHandle_t _rc_mutex = NULL;
+
+static void CAM_RC_apply_frame_size(framesize_t frame_size)
+{
+  sensor_t *s = esp_camera_sensor_get();
+
+  if (s && s->set_framesize(s, frame_size) == 0)
+  {
+    _frame_size = frame_size;
+  }
+}
+
+static void CAM_RC_apply_quality(uint8_t quality)
+{
+  sensor_t *s = esp_camera_sensor_get();
+
+  // Quality only affects the sensor JPEG encoder
+  if (s && PIXFORMAT_JPEG == s->pixformat && s->set_quality(s, quality) == 0)
+  {
+    _quality = quality;
+  }
+}
+
+// Next size down the ladder, or the given size if it is already the smallest
+static framesize_t CAM_RC_smaller(framesize_t frame_size)
+{
+  for (uint8_t i = 0; i < CAM_RC_FRAME_SIZE_COUNT; ++i)
+  {
+    if (_frame_sizes[i] < frame_size)
+    {
+      return _frame_sizes[i];
+    }
+  }
+  return frame_size;
+}
+
+// Next size up the ladder, never above the configured size
+static framesize_t CAM_RC_larger(framesize_t frame_size)
+{
+  for (int i = CAM_RC_FRAME_SIZE_COUNT - 1; i >= 0; --i)
+  {
+    if (_frame_sizes[i] > frame_size)
+    {
+      return (_frame_sizes[i] < _max_frame_size) ? _frame_sizes[i] : _max_frame_size;
+    }
+  }
+  return _max_frame_size;
+}
+
+// Lowers quality first, then frame size, then frame rate
+static int CAM_RC_degrade()
+{
+  framesize_t smaller = CAM_RC_smaller(_frame_size);
+
+  if (_quality + CAM_RC_QUALITY_STEP <= CAM_RC_QUALITY_WORST)
+  {
+    CAM_RC_apply_quality(_quality + CAM_RC_QUALITY_STEP);
+  }
+  else if (smaller != _frame_size)
+  {
+    CAM_RC_apply_frame_size(smaller);
+  }
+  else if (_interval_index + 1U < CAM_RC_FRAME_INTERVAL_COUNT)
+  {
+    _interval_index++;
+  }
+  else
+  {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Undoes the degrade steps in reverse order
+static int CAM_RC_upgrade()
+{
+  if (_interval_index > 0)
+  {
+    _interval_index--;
+  }
+  else if (_frame_size < _max_frame_size)
+  {
+    CAM_RC_apply_frame_size(CAM_RC_larger(_frame_size));
+  }
+  else if (_quality > _best_quality)
+  {
+    CAM_RC_apply_quality((_quality - CAM_RC_QUALITY_STEP > _best_quality) ? _quality - CAM_RC_QUALITY_STEP : _best_quality);
+  }
+  else
+  {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void CAM_RC_init(framesize_t frame_size, uint8_t quality)
+{
+  if (!_rc_mutex)
+  {
+    _rc_mutex = xSemaphoreCreateMutex();
+  }
+
+  _max_frame_size = frame_size;
+  _best_quality = quality;
+  _frame_size = frame_size;
+  _quality = quality;
+  _interval_index = 0;
+
+  _interval_worst_us = 0;
+  _latency_us = 0;
+  _last_update = esp_timer_get_time();
+  _settle = 0;
+  _good_intervals = 0;
+  _adjustments = 0;
+  _target_ms = CAM_RC_DEFAULT_TARGET_MS;
+  _held = 0;
+}
+
+void CAM_RC_report(int64_t latency_us)
+{
+  if (latency_us > _interval_worst_us)
+  {
+    _interval_worst_us = latency_us;
+  }
+}
+
+// Must be called with the controller mutex held
+static void CAM_RC_run(uint8_t clients)
+{
+  int64_t now = esp_timer_get_time();
+  int64_t target_us = 0;
+
+  if (_held)
+  {
+    return;
+  }
+
+  if (!clients)
+  {
+    // Nobody is watching, give stills the configured settings back
+    if (_frame_size != _max_frame_size)
+    {
+      CAM_RC_apply_frame_size(_max_frame_size);
+    }
+    if (_quality != _best_quality)
+    {
+      CAM_RC_apply_quality(_best_quality);
+    }
+    _interval_index = 0;
+    _interval_worst_us = 0;
+    _latency_us = 0;
+    _last_update = now;
+    return;
+  }
+
+  if (now - _last_update < CAM_RC_INTERVAL_US)
+  {
+    return;
+  }
+  _last_update = now;
+
+  // Nothing was delivered this interval, the link is stalled
+  if (!_interval_worst_us)
+  {
+    _interval_worst_us = CAM_RC_INTERVAL_US;
+  }
+
+  _latency_us = _latency_us ? (3 * _latency_us + _interval_worst_us) / 4 : _interval_worst_us;
+  _interval_worst_us = 0;
+
+  _target_ms = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_stream_target_latency, CAM_RC_DEFAULT_TARGET_MS);
+  target_us = 1000LL * _target_ms;
+
+  if (_settle)
+  {
+    _settle--;
+    return;
+  }
+
+  if (_latency_us > target_us)
+  {
+    _good_intervals = 0;
+    if (CAM_RC_degrade() == EXIT_SUCCESS)
+    {
+      _adjustments++;
+      _settle = CAM_RC_SETTLE_INTERVALS;
+      ESP_LOGI(LOG_TAG, "Latency %u ms over target, quality %u, frame size %u, interval %u ms\n",
+               (uint32_t) (_latency_us / 1000), _quality, _frame_size, _frame_intervals_ms[_interval_index]);
+    }
+  }
+  else if (_latency_us < target_us / 2)
+  {
+    if (++_good_intervals >= CAM_RC_UPGRADE_INTERVALS)
+    {
+      _good_intervals = 0;
+      if (CAM_RC_upgrade() == EXIT_SUCCESS)
+      {
+        _adjustments++;
+        _settle = CAM_RC_SETTLE_INTERVALS;
+        ESP_LOGI(LOG_TAG, "Latency %u ms well below target, quality %u, frame size %u, interval %u ms\n",
+                 (uint32_t) (_latency_us / 1000), _quality, _frame_size, _frame_intervals_ms[_interval_index]);
+      }
+    }
+  }
+  else
+  {
+    _good_intervals = 0;
+  }
+}
+
+void CAM_RC_update(uint8_t clients)
+{
+  xSemaphoreTake(_rc_mutex, portMAX_DELAY);
+  CAM_RC_run(clients);
+  xSemaphoreGive(_rc_mutex);
+}
+
+int CAM_RC_set_baseline(framesize_t frame_size, uint8_t quality)
+{
+  int status = EXIT_SUCCESS;
+
+  xSemaphoreTake(_rc_mutex, portMAX_DELAY);
+
+  // Whatever the controller had degraded to, the sensor now runs the new settings
+  if (_frame_size != frame_size)
+  {
+    CAM_RC_apply_frame_size(frame_size);
+    status = (_frame_size == frame_size) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (EXIT_SUCCESS == status && _quality != quality)
+  {
+    CAM_RC_apply_quality(quality);
+  }
+
+  if (EXIT_SUCCESS == status)
+  {
+    _max_frame_size = frame_size;
+    _best_quality = quality;
+    _quality = quality;
+    _interval_index = 0;
+    _interval_worst_us = 0;
+    _latency_us = 0;
+    _good_intervals = 0;
+    _settle = CAM_RC_SETTLE_INTERVALS;
+  }
+
+  xSemaphoreGive(_rc_mutex);
+
+  return status;
+}
+
+int CAM_RC_hold(framesize_t frame_size, uint8_t quality)
+{
+  sensor_t *s = esp_camera_sensor_get();
+  int status = EXIT_FAILURE;
+
+  xSemaphoreTake(_rc_mutex, portMAX_DELAY);
+
+  // The stream settings stay in the controller state, only the sensor changes
+  if (s && s->set_framesize(s, frame_size) == 0)
+  {
+    if (PIXFORMAT_JPEG == s->pixformat)
+    {
+      s->set_quality(s, quality);
+    }
+    _held = 1;
+    status = EXIT_SUCCESS;
+  }
+
+  xSemaphoreGive(_rc_mutex);
+
+  return status;
+}
+
+void CAM_RC_resume()
+{
+  sensor_t *s = esp_camera_sensor_get();
+
+  xSemaphoreTake(_rc_mutex, portMAX_DELAY);
+
+  if (_held && s)
+  {
+    s->set_framesize(s, _frame_size);
+    if (PIXFORMAT_JPEG == s->pixformat)
+    {
+      s->set_quality(s, _quality);
+    }
+
+    // Latency measured across the switch says nothing about the link
+    _interval_worst_us = 0;
+    _settle = CAM_RC_SETTLE_INTERVALS;
+  }
+  _held = 0;
+
+  xSemaphoreGive(_rc_mutex);
+}
+
+int64_t CAM_RC_frame_interval_us()
+{
+  return 1000LL * _frame_intervals_ms[_interval_index];
+}
+
+void CAM_RC_get_stats(cam_rc_stats_t *stats)
+{
+  if (NULL == stats)
+  {
+    return;
+  }
+
+  stats->latency_ms = _latency_us / 1000;
+  stats->target_ms = _target_ms;
+  stats->quality = _quality;
+  stats->frame_size = _frame_size;
+  stats->frame_interval_ms = _frame_intervals_ms[_interval_index];
+  stats->adjustments = _adjustments;
+}
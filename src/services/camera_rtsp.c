@@ -0,0 +1,908 @@
+/*
+* @file camera_rtsp.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_rtsp.h"
+#include "camera_service.h"
+#include "camera_jpeg.h"
+#include "camera_power.h"
+
+#include "fsu_rtsp_server_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "platform/iot_threads.h"
+
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+#define LOG_TAG                         "CAMERA RTSP"
+
+#define CAM_RTSP_TASK_PRIORITY          (tskIDLE_PRIORITY + 5U)
+#define CAM_RTSP_STACKSIZE              (0x1000U)
+#define CAM_RTSP_STOP_POLL_MS           (50U)
+
+// Socket wait while a session is playing and while all are idle
+#define CAM_RTSP_PLAY_TIMEOUT_MS        (10U)
+#define CAM_RTSP_IDLE_TIMEOUT_MS        (100U)
+// A TCP client that cannot take a reply within this time is dropped
+#define CAM_RTSP_SEND_TIMEOUT_MS        (500U)
+// An interleaved client whose send buffer stays full for this many frames in a row is dropped
+#define CAM_RTSP_MAX_DROPPED_FRAMES     (25U)
+
+#define CAM_RTSP_REQUEST_LEN            (1024U)
+#define CAM_RTSP_RESPONSE_LEN           (512U)
+#define CAM_RTSP_HEADER_VALUE_LEN       (128U)
+
+// Largest RTP packet, keeps a packet within a single Ethernet/WiFi frame
+#define CAM_RTSP_PACKET_LEN             (1400U)
+#define CAM_RTSP_RTP_HEADER_LEN         (12U)
+#define CAM_RTSP_JPEG_HEADER_LEN        (8U)
+#define CAM_RTSP_RESTART_HEADER_LEN     (4U)
+#define CAM_RTSP_QT_HEADER_LEN          (4U)
+#define CAM_RTSP_QT_LEN                 (64U)
+
+// Static payload type for JPEG, RFC 3551
+#define CAM_RTSP_PAYLOAD_TYPE           (26U)
+// RFC 2435 types, 4:2:2 and 4:2:0, with restart markers the type is offset by 64
+#define CAM_RTSP_TYPE_422               (0U)
+#define CAM_RTSP_TYPE_420               (1U)
+#define CAM_RTSP_TYPE_RESTART           (64U)
+// Q values of 128 and above carry the quantization tables in band
+#define CAM_RTSP_Q_IN_BAND              (255U)
+
+#define CAM_RTSP_SESSION_TIMEOUT_S      (60U)
+
+typedef enum {
+  cam_rtsp_client_free,
+  cam_rtsp_client_init,     // Connected, no transport set up yet
+  cam_rtsp_client_ready,    // Transport set up, not playing
+  cam_rtsp_client_playing
+} cam_rtsp_client_state_t;
+
+/*
+* @brief An RTSP session. The control connection and the session are one, a
+* session ends when its connection closes.
+*/
+typedef struct cam_rtsp_client {
+  cam_rtsp_client_state_t state;
+  int fd;
+  char req[CAM_RTSP_REQUEST_LEN + 1];
+  size_t req_len;
+  size_t skip;                  // Bytes of an interleaved packet from the client left to discard
+  uint8_t interleaved;          // RTP is sent on the control connection
+  uint8_t channel;
+  struct sockaddr_in rtp_addr;  // Destination of RTP over UDP
+  uint32_t session;
+  uint32_t ssrc;
+  uint16_t rtp_seq;
+  uint32_t frames_sent;
+  uint32_t frames_dropped;      // Frames in a row cut short by a full send buffer
+} cam_rtsp_client_t;
+
+/*
+* @brief Per frame parameters shared by every session the frame is sent to.
+*/
+typedef struct cam_rtsp_frame {
+  const uint8_t *scan;
+  size_t scan_len;
+  uint32_t timestamp;
+  uint8_t jpeg_header[CAM_RTSP_JPEG_HEADER_LEN];
+  uint8_t restart_header[CAM_RTSP_RESTART_HEADER_LEN];
+  uint8_t has_restart;
+  uint8_t qt_header[CAM_RTSP_QT_HEADER_LEN];
+  const uint8_t *qt[2];
+} cam_rtsp_frame_t;
+
+static const char *_RTSP_RESPONSE = "RTSP/1.0 %s\r\n"
+                                    "CSeq: %u\r\n"
+                                    "Server: FSU Eye\r\n"
+                                    "%s"
+                                    "\r\n";
+
+static cam_rtsp_client_t _clients[FSU_RTSP_SERVER_MAX_CLIENTS];
+static int _listen_fd = -1;
+static int _rtp_fd = -1;
+static uint32_t _seq = 0;
+
+static cam_rtsp_stats_t _stats;
+static SemaphoreHandle_t _stats_mutex;
+
+static volatile uint8_t _server_running = 0;
+static volatile uint8_t _server_active = 0;
+static uint8_t _initialized = 0;
+
+static void CAM_RTSP_close_client(cam_rtsp_client_t *client)
+{
+  if (cam_rtsp_client_free == client->state)
+  {
+    return;
+  }
+
+  ESP_LOGI(LOG_TAG, "Session on socket %d closed after %u frames\n", client->fd, client->frames_sent);
+
+  close(client->fd);
+  memset(client, 0, sizeof(cam_rtsp_client_t));
+  client->fd = -1;
+  client->state = cam_rtsp_client_free;
+}
+
+// Looks up a header of a request, the name is matched case insensitively
+static int CAM_RTSP_header(const char *req, const char *name, char *value, size_t len)
+{
+  const char *line = strstr(req, "\r\n");
+  const char *end = NULL;
+  size_t name_len = strlen(name);
+  size_t value_len = 0;
+
+  while (line && line[2] != '\r' && line[2] != '\0')
+  {
+    line += 2;
+    end = strstr(line, "\r\n");
+    if (!end)
+    {
+      return EXIT_FAILURE;
+    }
+
+    if (0 == strncasecmp(line, name, name_len) && ':' == line[name_len])
+    {
+      line += name_len + 1;
+      while (' ' == *line)
+      {
+        line++;
+      }
+      value_len = end - line;
+      if (value_len >= len)
+      {
+        value_len = len - 1;
+      }
+      memcpy(value, line, value_len);
+      value[value_len] = '\0';
+      return EXIT_SUCCESS;
+    }
+    line = end;
+  }
+  return EXIT_FAILURE;
+}
+
+static int CAM_RTSP_send_all(int fd, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t*) data;
+  ssize_t sent = 0;
+
+  while (len)
+  {
+    sent = send(fd, p, len, 0);
+    if (sent <= 0)
+    {
+      return EXIT_FAILURE;
+    }
+    p += sent;
+    len -= sent;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int CAM_RTSP_reply(cam_rtsp_client_t *client, uint32_t cseq, const char *status,
+                          const char *headers, const char *body)
+{
+  char response[CAM_RTSP_RESPONSE_LEN];
+  int len = snprintf(response, sizeof(response), _RTSP_RESPONSE, status, cseq, headers ? headers : "");
+
+  if (len < 0 || (size_t) len >= sizeof(response))
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_RTSP_send_all(client->fd, response, len) != EXIT_SUCCESS
+    || (body && CAM_RTSP_send_all(client->fd, body, strlen(body)) != EXIT_SUCCESS))
+  {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int CAM_RTSP_describe(cam_rtsp_client_t *client, uint32_t cseq, const char *url)
+{
+  char headers[CAM_RTSP_RESPONSE_LEN / 2];
+  char sdp[CAM_RTSP_RESPONSE_LEN / 2];
+  char address[INET_ADDRSTRLEN] = "0.0.0.0";
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+
+  if (0 == getsockname(client->fd, (struct sockaddr*) &local, &local_len))
+  {
+    inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address));
+  }
+
+  snprintf(sdp, sizeof(sdp), "v=0\r\n"
+                             "o=- %u 1 IN IP4 %s\r\n"
+                             "s=FSU Eye\r\n"
+                             "c=IN IP4 0.0.0.0\r\n"
+                             "t=0 0\r\n"
+                             "m=video 0 RTP/AVP %u\r\n"
+                             "a=control:track0\r\n",
+           client->session, address, CAM_RTSP_PAYLOAD_TYPE);
+
+  snprintf(headers, sizeof(headers), "Content-Base: %s/\r\n"
+                                     "Content-Type: application/sdp\r\n"
+                                     "Content-Length: %u\r\n",
+           url, (uint32_t) strlen(sdp));
+
+  return CAM_RTSP_reply(client, cseq, "200 OK", headers, sdp);
+}
+
+static int CAM_RTSP_setup(cam_rtsp_client_t *client, uint32_t cseq)
+{
+  char transport[CAM_RTSP_HEADER_VALUE_LEN];
+  char headers[CAM_RTSP_RESPONSE_LEN / 2];
+  const char *param = NULL;
+  struct sockaddr_in peer;
+  socklen_t peer_len = sizeof(peer);
+  uint16_t port = 0;
+
+  if (CAM_RTSP_header(client->req, "Transport", transport, sizeof(transport)) != EXIT_SUCCESS)
+  {
+    return CAM_RTSP_reply(client, cseq, "400 Bad Request", NULL, NULL);
+  }
+
+  if (strstr(transport, "RTP/AVP/TCP"))
+  {
+    param = strstr(transport, "interleaved=");
+    client->interleaved = 1;
+    client->channel = param ? atoi(param + strlen("interleaved=")) : 0;
+
+    snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u;ssrc=%08X\r\n"
+                                       "Session: %08X;timeout=%u\r\n",
+             client->channel, client->channel + 1, client->ssrc, client->session, CAM_RTSP_SESSION_TIMEOUT_S);
+  }
+  else
+  {
+    param = strstr(transport, "client_port=");
+    if (!param || 0 == (port = atoi(param + strlen("client_port=")))
+      || 0 != getpeername(client->fd, (struct sockaddr*) &peer, &peer_len))
+    {
+      return CAM_RTSP_reply(client, cseq, "461 Unsupported Transport", NULL, NULL);
+    }
+
+    client->interleaved = 0;
+    memcpy(&client->rtp_addr, &peer, sizeof(peer));
+    client->rtp_addr.sin_port = htons(port);
+
+    snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u;ssrc=%08X\r\n"
+                                       "Session: %08X;timeout=%u\r\n",
+             port, port + 1, FSU_RTSP_SERVER_RTP_PORT, FSU_RTSP_SERVER_RTP_PORT + 1,
+             client->ssrc, client->session, CAM_RTSP_SESSION_TIMEOUT_S);
+  }
+
+  if (cam_rtsp_client_init == client->state)
+  {
+    client->state = cam_rtsp_client_ready;
+  }
+
+  return CAM_RTSP_reply(client, cseq, "200 OK", headers, NULL);
+}
+
+// Handles the complete request in the client buffer
+static int CAM_RTSP_handle_request(cam_rtsp_client_t *client)
+{
+  char method[16];
+  char url[CAM_RTSP_HEADER_VALUE_LEN];
+  char value[CAM_RTSP_HEADER_VALUE_LEN];
+  char headers[CAM_RTSP_HEADER_VALUE_LEN];
+  uint32_t cseq = 0;
+
+  if (sscanf(client->req, "%15s %127s", method, url) != 2)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_RTSP_header(client->req, "CSeq", value, sizeof(value)) == EXIT_SUCCESS)
+  {
+    cseq = strtoul(value, NULL, 10);
+  }
+
+  if (0 == strcmp(method, "OPTIONS"))
+  {
+    return CAM_RTSP_reply(client, cseq, "200 OK",
+                          "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n", NULL);
+  }
+  if (0 == strcmp(method, "DESCRIBE"))
+  {
+    return CAM_RTSP_describe(client, cseq, url);
+  }
+  if (0 == strcmp(method, "SETUP"))
+  {
+    return CAM_RTSP_setup(client, cseq);
+  }
+
+  snprintf(headers, sizeof(headers), "Session: %08X\r\n", client->session);
+
+  if (0 == strcmp(method, "PLAY"))
+  {
+    if (cam_rtsp_client_init == client->state)
+    {
+      return CAM_RTSP_reply(client, cseq, "455 Method Not Valid in This State", NULL, NULL);
+    }
+    client->state = cam_rtsp_client_playing;
+    ESP_LOGI(LOG_TAG, "Session on socket %d playing over %s\n", client->fd, client->interleaved ? "TCP" : "UDP");
+
+    strncat(headers, "Range: npt=0.000-\r\n", sizeof(headers) - strlen(headers) - 1);
+    return CAM_RTSP_reply(client, cseq, "200 OK", headers, NULL);
+  }
+  if (0 == strcmp(method, "GET_PARAMETER"))
+  {
+    // Keep alive
+    return CAM_RTSP_reply(client, cseq, "200 OK", headers, NULL);
+  }
+  if (0 == strcmp(method, "TEARDOWN"))
+  {
+    CAM_RTSP_reply(client, cseq, "200 OK", headers, NULL);
+    return EXIT_FAILURE;
+  }
+
+  return CAM_RTSP_reply(client, cseq, "501 Not Implemented", NULL, NULL);
+}
+
+// Reads what the control connection has pending and handles every complete
+// request. Interleaved packets from the client, i.e. RTCP reports, are skipped.
+static int CAM_RTSP_receive(cam_rtsp_client_t *client)
+{
+  char value[CAM_RTSP_HEADER_VALUE_LEN];
+  char *end = NULL;
+  size_t consumed = 0;
+  ssize_t received = recv(client->fd, client->req + client->req_len, CAM_RTSP_REQUEST_LEN - client->req_len, 0);
+
+  if (received <= 0)
+  {
+    return EXIT_FAILURE;
+  }
+  client->req_len += received;
+
+  while (client->req_len)
+  {
+    client->req[client->req_len] = '\0';
+
+    if (client->skip || '$' == client->req[0])
+    {
+      if (!client->skip)
+      {
+        if (client->req_len < 4)
+        {
+          return EXIT_SUCCESS;
+        }
+        client->skip = 4 + (((uint8_t) client->req[2] << 8) | (uint8_t) client->req[3]);
+      }
+      consumed = (client->skip < client->req_len) ? client->skip : client->req_len;
+      client->skip -= consumed;
+    }
+    else
+    {
+      if (!(end = strstr(client->req, "\r\n\r\n")))
+      {
+        // A request that does not fit the buffer is not one of ours
+        return (client->req_len < CAM_RTSP_REQUEST_LEN) ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+      consumed = end + 4 - client->req;
+
+      if (CAM_RTSP_header(client->req, "Content-Length", value, sizeof(value)) == EXIT_SUCCESS)
+      {
+        consumed += strtoul(value, NULL, 10);
+        if (consumed > CAM_RTSP_REQUEST_LEN)
+        {
+          return EXIT_FAILURE;
+        }
+        if (consumed > client->req_len)
+        {
+          return EXIT_SUCCESS;
+        }
+      }
+
+      if (CAM_RTSP_handle_request(client) != EXIT_SUCCESS)
+      {
+        return EXIT_FAILURE;
+      }
+    }
+
+    client->req_len -= consumed;
+    memmove(client->req, client->req + consumed, client->req_len);
+  }
+  return EXIT_SUCCESS;
+}
+
+// Fills in the per frame headers of RFC 2435, returns EXIT_FAILURE for frames
+// that cannot be described by a type, e.g. grayscale
+static int CAM_RTSP_prepare(cam_frame_t *jpeg, cam_rtsp_frame_t *frame)
+{
+  cam_jpeg_info_t info;
+  uint8_t type = 0;
+  size_t end = 0;
+
+  if (CAM_JPEG_parse(jpeg->buf, jpeg->len, &info) != EXIT_SUCCESS
+    || 3 != info.components
+    || 2 != info.h_max
+    || 1 != info.comp[1].h || 1 != info.comp[1].v
+    || 1 != info.comp[2].h || 1 != info.comp[2].v
+    || info.comp[1].tq != info.comp[2].tq
+    || !info.quant[info.comp[0].tq] || !info.quant[info.comp[1].tq]
+    || info.width > 2040 || info.height > 2040)
+  {
+    return EXIT_FAILURE;
+  }
+
+  type = (1 == info.v_max) ? CAM_RTSP_TYPE_422 : CAM_RTSP_TYPE_420;
+
+  // The scan ends at the last EOI, the driver may pad the buffer behind it
+  for (end = jpeg->len; end >= info.header_len + 2; --end)
+  {
+    if (0xFF == jpeg->buf[end - 2] && 0xD9 == jpeg->buf[end - 1])
+    {
+      break;
+    }
+  }
+  if (end < info.header_len + 2)
+  {
+    return EXIT_FAILURE;
+  }
+
+  frame->scan = jpeg->buf + info.header_len;
+  frame->scan_len = end - 2 - info.header_len;
+  frame->timestamp = (uint32_t) (jpeg->timestamp * 9 / 100);
+
+  frame->has_restart = (info.restart_interval != 0);
+  memset(frame->jpeg_header, 0, sizeof(frame->jpeg_header));
+  frame->jpeg_header[4] = type + (frame->has_restart ? CAM_RTSP_TYPE_RESTART : 0);
+  frame->jpeg_header[5] = CAM_RTSP_Q_IN_BAND;
+  frame->jpeg_header[6] = info.width / 8;
+  frame->jpeg_header[7] = info.height / 8;
+
+  // Packets are not aligned to restart intervals, so every packet has F and L
+  // set and the count field is all ones
+  frame->restart_header[0] = info.restart_interval >> 8;
+  frame->restart_header[1] = info.restart_interval & 0xFF;
+  frame->restart_header[2] = 0xFF;
+  frame->restart_header[3] = 0xFF;
+
+  frame->qt_header[0] = 0;
+  frame->qt_header[1] = 0;  // 8-bit tables
+  frame->qt_header[2] = 0;
+  frame->qt_header[3] = 2 * CAM_RTSP_QT_LEN;
+  frame->qt[0] = info.quant[info.comp[0].tq];
+  frame->qt[1] = info.quant[info.comp[1].tq];
+
+  return EXIT_SUCCESS;
+}
+
+// Packetizes the frame into the session, the payload is gathered straight from
+// the frame buffer
+static int CAM_RTSP_send_frame(cam_rtsp_client_t *client, cam_rtsp_frame_t *frame)
+{
+  uint8_t interleave[4];
+  uint8_t rtp[CAM_RTSP_RTP_HEADER_LEN];
+  uint8_t jpeg_header[CAM_RTSP_JPEG_HEADER_LEN];
+  struct iovec iov[7];
+  struct msghdr msg;
+  size_t offset = 0;
+  size_t chunk = 0;
+  size_t header_len = 0;
+  size_t packet_len = 0;
+  int iov_count = 0;
+  ssize_t sent = 0;
+
+  memcpy(jpeg_header, frame->jpeg_header, sizeof(jpeg_header));
+
+  rtp[0] = 0x80;  // Version 2
+  rtp[4] = frame->timestamp >> 24;
+  rtp[5] = frame->timestamp >> 16;
+  rtp[6] = frame->timestamp >> 8;
+  rtp[7] = frame->timestamp;
+  rtp[8] = client->ssrc >> 24;
+  rtp[9] = client->ssrc >> 16;
+  rtp[10] = client->ssrc >> 8;
+  rtp[11] = client->ssrc;
+
+  while (offset < frame->scan_len)
+  {
+    iov_count = 0;
+    header_len = CAM_RTSP_RTP_HEADER_LEN + CAM_RTSP_JPEG_HEADER_LEN
+                 + (frame->has_restart ? CAM_RTSP_RESTART_HEADER_LEN : 0)
+                 + (offset ? 0 : CAM_RTSP_QT_HEADER_LEN + 2 * CAM_RTSP_QT_LEN);
+    chunk = frame->scan_len - offset;
+    if (chunk > CAM_RTSP_PACKET_LEN - header_len)
+    {
+      chunk = CAM_RTSP_PACKET_LEN - header_len;
+    }
+    packet_len = header_len + chunk;
+
+    rtp[1] = CAM_RTSP_PAYLOAD_TYPE | ((offset + chunk == frame->scan_len) ? 0x80 : 0);
+    rtp[2] = client->rtp_seq >> 8;
+    rtp[3] = client->rtp_seq;
+    jpeg_header[1] = offset >> 16;
+    jpeg_header[2] = offset >> 8;
+    jpeg_header[3] = offset;
+
+    if (client->interleaved)
+    {
+      interleave[0] = '$';
+      interleave[1] = client->channel;
+      interleave[2] = packet_len >> 8;
+      interleave[3] = packet_len;
+      iov[iov_count].iov_base = interleave;
+      iov[iov_count++].iov_len = sizeof(interleave);
+    }
+    iov[iov_count].iov_base = rtp;
+    iov[iov_count++].iov_len = sizeof(rtp);
+    iov[iov_count].iov_base = jpeg_header;
+    iov[iov_count++].iov_len = sizeof(jpeg_header);
+    if (frame->has_restart)
+    {
+      iov[iov_count].iov_base = frame->restart_header;
+      iov[iov_count++].iov_len = CAM_RTSP_RESTART_HEADER_LEN;
+    }
+    if (!offset)
+    {
+      iov[iov_count].iov_base = frame->qt_header;
+      iov[iov_count++].iov_len = CAM_RTSP_QT_HEADER_LEN;
+      iov[iov_count].iov_base = (void*) frame->qt[0];
+      iov[iov_count++].iov_len = CAM_RTSP_QT_LEN;
+      iov[iov_count].iov_base = (void*) frame->qt[1];
+      iov[iov_count++].iov_len = CAM_RTSP_QT_LEN;
+    }
+    iov[iov_count].iov_base = (void*) (frame->scan + offset);
+    iov[iov_count++].iov_len = chunk;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    if (client->interleaved)
+    {
+      // One task serves every session, so a full send buffer cuts the frame
+      // short instead of waiting on the client. A short write would leave the
+      // interleaved stream out of sync and ends the session.
+      sent = sendmsg(client->fd, &msg, MSG_DONTWAIT);
+      if (sent < 0 && (ENOMEM == errno || EAGAIN == errno || EWOULDBLOCK == errno))
+      {
+        return (++client->frames_dropped < CAM_RTSP_MAX_DROPPED_FRAMES) ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+      if (sent != (ssize_t) (packet_len + sizeof(interleave)))
+      {
+        return EXIT_FAILURE;
+      }
+    }
+    else
+    {
+      msg.msg_name = &client->rtp_addr;
+      msg.msg_namelen = sizeof(client->rtp_addr);
+
+      // A datagram the stack has no room for is lost like one lost on the air
+      sent = sendmsg(_rtp_fd, &msg, 0);
+      if (sent < 0 && ENOMEM != errno && EAGAIN != errno && EWOULDBLOCK != errno)
+      {
+        return EXIT_FAILURE;
+      }
+    }
+
+    client->rtp_seq++;
+    offset += chunk;
+
+    xSemaphoreTake(_stats_mutex, portMAX_DELAY);
+    _stats.packets++;
+    _stats.bytes += packet_len;
+    xSemaphoreGive(_stats_mutex);
+  }
+
+  client->frames_sent++;
+  client->frames_dropped = 0;
+
+  xSemaphoreTake(_stats_mutex, portMAX_DELAY);
+  _stats.frames++;
+  xSemaphoreGive(_stats_mutex);
+
+  return EXIT_SUCCESS;
+}
+
+static void CAM_RTSP_accept()
+{
+  cam_rtsp_client_t *client = NULL;
+  struct timeval timeout;
+  int nodelay = 1;
+  int fd = accept(_listen_fd, NULL, NULL);
+
+  if (fd < 0)
+  {
+    return;
+  }
+
+  for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+  {
+    if (cam_rtsp_client_free == _clients[i].state)
+    {
+      client = &_clients[i];
+      break;
+    }
+  }
+
+  if (!client)
+  {
+    ESP_LOGI(LOG_TAG, "Session limit reached, rejecting socket %d\n", fd);
+    close(fd);
+    return;
+  }
+
+  timeout.tv_sec = CAM_RTSP_SEND_TIMEOUT_MS / 1000U;
+  timeout.tv_usec = (CAM_RTSP_SEND_TIMEOUT_MS % 1000U) * 1000U;
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  memset(client, 0, sizeof(cam_rtsp_client_t));
+  client->fd = fd;
+  client->state = cam_rtsp_client_init;
+  client->session = esp_random();
+  client->ssrc = esp_random();
+  client->rtp_seq = esp_random();
+
+  ESP_LOGI(LOG_TAG, "Session connected on socket %d\n", fd);
+}
+
+static void CAM_RTSP_server_runner(void *arg)
+{
+  cam_rtsp_client_t *client = NULL;
+  cam_rtsp_frame_t rtp_frame;
+  cam_frame_t *frame = NULL;
+  cam_frame_t *jpeg = NULL;
+  uint8_t playing = 0;
+  int max_fd = -1;
+  fd_set read_fds;
+  struct timeval timeout;
+
+  (void) arg;
+
+  _server_active = 1;
+
+  while (_server_running)
+  {
+    playing = 0;
+    max_fd = _listen_fd;
+    FD_ZERO(&read_fds);
+    FD_SET(_listen_fd, &read_fds);
+
+    for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+    {
+      if (cam_rtsp_client_free != _clients[i].state)
+      {
+        FD_SET(_clients[i].fd, &read_fds);
+        max_fd = (_clients[i].fd > max_fd) ? _clients[i].fd : max_fd;
+        playing += (cam_rtsp_client_playing == _clients[i].state);
+      }
+    }
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = (playing ? CAM_RTSP_PLAY_TIMEOUT_MS : CAM_RTSP_IDLE_TIMEOUT_MS) * 1000U;
+    if (select(max_fd + 1, &read_fds, NULL, NULL, &timeout) > 0)
+    {
+      if (FD_ISSET(_listen_fd, &read_fds))
+      {
+        CAM_RTSP_accept();
+      }
+
+      for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+      {
+        client = &_clients[i];
+        if (cam_rtsp_client_free != client->state
+          && FD_ISSET(client->fd, &read_fds)
+          && CAM_RTSP_receive(client) != EXIT_SUCCESS)
+        {
+          CAM_RTSP_close_client(client);
+        }
+      }
+    }
+
+    if (!playing)
+    {
+      continue;
+    }
+
+    CAM_POWER_demand();
+
+    // The socket wait paces the loop, so never block on the producer here
+    if (!(frame = CAM_SERVICE_frame_acquire(_seq, 0)))
+    {
+      continue;
+    }
+    _seq = frame->seq;
+
+    if (!CAM_SERVICE_is_stream_frame(frame))
+    {
+      CAM_SERVICE_frame_release(frame);
+      continue;
+    }
+
+    jpeg = CAM_SERVICE_frame_to_jpeg(frame);
+    CAM_SERVICE_frame_release(frame);
+    if (!jpeg)
+    {
+      continue;
+    }
+
+    if (CAM_RTSP_prepare(jpeg, &rtp_frame) == EXIT_SUCCESS)
+    {
+      for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+      {
+        client = &_clients[i];
+        if (cam_rtsp_client_playing == client->state
+          && CAM_RTSP_send_frame(client, &rtp_frame) != EXIT_SUCCESS)
+        {
+          ESP_LOGI(LOG_TAG, "Session on socket %d stopped taking packets\n", client->fd);
+          CAM_RTSP_close_client(client);
+        }
+      }
+    }
+    else
+    {
+      xSemaphoreTake(_stats_mutex, portMAX_DELAY);
+      _stats.skipped++;
+      xSemaphoreGive(_stats_mutex);
+    }
+
+    CAM_SERVICE_frame_release(jpeg);
+  }
+
+  for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+  {
+    CAM_RTSP_close_client(&_clients[i]);
+  }
+
+  _server_active = 0;
+}
+
+static int CAM_RTSP_open_socket(int type, uint16_t port)
+{
+  struct sockaddr_in addr;
+  int reuse = 1;
+  int fd = socket(AF_INET, type, 0);
+
+  if (fd < 0)
+  {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+    || (SOCK_STREAM == type && listen(fd, FSU_RTSP_SERVER_MAX_CLIENTS) != 0))
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int CAM_RTSP_init()
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if (!_stats_mutex && (_stats_mutex = xSemaphoreCreateMutex()) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  memset(_clients, 0, sizeof(_clients));
+  memset(&_stats, 0, sizeof(_stats));
+  for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+  {
+    _clients[i].fd = -1;
+  }
+  _seq = 0;
+
+  if ((_listen_fd = CAM_RTSP_open_socket(SOCK_STREAM, FSU_RTSP_SERVER_PORT)) < 0
+    || (_rtp_fd = CAM_RTSP_open_socket(SOCK_DGRAM, FSU_RTSP_SERVER_RTP_PORT)) < 0)
+  {
+    ESP_LOGI(LOG_TAG, "Could not open RTSP sockets\n");
+    if (_listen_fd >= 0)
+    {
+      close(_listen_fd);
+      _listen_fd = -1;
+    }
+    return EXIT_FAILURE;
+  }
+
+  _server_running = 1;
+
+  if (!Iot_CreateDetachedThread(CAM_RTSP_server_runner,
+                                NULL,
+                                CAM_RTSP_TASK_PRIORITY,
+                                CAM_RTSP_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create RTSP server task\n");
+    _server_running = 0;
+    close(_listen_fd);
+    close(_rtp_fd);
+    _listen_fd = -1;
+    _rtp_fd = -1;
+    return EXIT_FAILURE;
+  }
+
+  _initialized = 1;
+
+  ESP_LOGI(LOG_TAG, "RTSP server listening on port %u\n", FSU_RTSP_SERVER_PORT);
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_RTSP_deinit()
+{
+  if (!_initialized)
+  {
+    return;
+  }
+
+  _initialized = 0;
+  _server_running = 0;
+  while (_server_active)
+  {
+    vTaskDelay(CAM_RTSP_STOP_POLL_MS / portTICK_PERIOD_MS);
+  }
+
+  close(_listen_fd);
+  close(_rtp_fd);
+  _listen_fd = -1;
+  _rtp_fd = -1;
+}
+
+void CAM_RTSP_get_stats(cam_rtsp_stats_t *stats)
+{
+  if (!_initialized || NULL == stats)
+  {
+    return;
+  }
+
+  xSemaphoreTake(_stats_mutex, portMAX_DELAY);
+  memcpy(stats, &_stats, sizeof(cam_rtsp_stats_t));
+  stats->clients = 0;
+  for (uint8_t i = 0; i < FSU_RTSP_SERVER_MAX_CLIENTS; ++i)
+  {
+    stats->clients += (cam_rtsp_client_playing == _clients[i].state);
+  }
+  xSemaphoreGive(_stats_mutex);
+}
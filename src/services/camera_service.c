@@ -26,18 +26,111 @@
 
 #include "system_controller.h"
 #include "camera_service.h"
+#include "camera_frame_ring.h"
+#include "camera_stream.h"
+#include "camera_capture.h"
+#include "camera_motion.h"
+#include "camera_jpeg.h"
+#include "camera_jpeg_pool.h"
+#include "camera_dedup.h"
+#include "camera_history.h"
+#include "camera_rtsp.h"
+#include "camera_rate_control.h"
+#include "camera_latency.h"
+#include "camera_power.h"
+#include "camera_preview.h"
+#include "camera_crop.h"
+#include "camera_budget.h"
+#include "camera_overlay.h"
 #include "aws_service.h"
 
 #include "fsu_http_server_config.h"
 
+#include <string.h>
+#include <stdlib.h>
+
 #include "esp_http_server.h"
 #include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 
+#include "FreeRTOS.h"
+#include "task.h"
 #include "semphr.h"
+#include "platform/iot_threads.h"
 
 #define LOG_TAG     "CAMERA SERVICE"
 
+// Frame buffers kept in flight by the driver. With PSRAM the ring holds all
+// but one of them, so the driver always has a buffer to capture into and the
+// latest frame is available without waiting for the sensor. Without PSRAM a
+// single buffer is cycled between the driver and the ring.
+#define CAM_FB_COUNT_PSRAM              (3U)
+#define CAM_FB_COUNT_DRAM               (1U)
+
+#define CAM_PRODUCER_TASK_PRIORITY      (tskIDLE_PRIORITY + 5U)
+#define CAM_PRODUCER_STACKSIZE          (0x1000U)
+#define CAM_PRODUCER_RETRY_MS           (100U)
+#define CAM_PRODUCER_STOP_POLL_MS       (50U)
+// Time frames still held are given to come back before the driver goes away,
+// covers an upload waiting for its ack with one retry
+#define CAM_RELEASE_WAIT_MS             (5000U)
+
+// Maximum time a consumer waits on the producer for a new frame
+#define CAM_FRAME_WAIT_MS               (2000U)
+// Camera part of the info message, see CAM_SERVICE_CMD_GET_INFO
+#define CAM_SERVICE_INFO                ("\"frames unread percent\":\"%u\"," \
+                                         "\"image hash us\":\"%u\"," \
+                                         "\"image duplicate skip percent\":\"%u\"," \
+                                         "\"image duplicate bytes saved\":\"%llu\"," \
+                                         "\"history frames\":\"%u\"," \
+                                         "\"history bytes\":\"%u\"," \
+                                         "\"history evicted\":\"%u\"," \
+                                         "\"history dropped\":\"%u\"," \
+                                         "\"burst capture fps\":\"%u.%u\"," \
+                                         "\"burst drain ms\":\"%u\"," \
+                                         "\"jpeg pool fallbacks\":\"%u\"," \
+                                         "\"heap fragmentation percent\":\"%u\"," \
+                                         "\"camera switch us\":\"%u/%u/%u/%u\"," \
+                                         "\"stream latency ms\":\"%u/%u/%u\"," \
+                                         "\"upload latency ms\":\"%u/%u/%u\"," \
+                                         "\"still switch us\":\"%u/%u\"," \
+                                         "\"stream hiccup ms\":\"%u/%u\"," \
+                                         "\"fresh capture ms\":\"%u/%u\"," \
+                                         "\"capture stale percent\":\"%u\"," \
+                                         "\"sensor duty percent\":\"%u\"," \
+                                         "\"sensor power mw\":\"%u\"," \
+                                         "\"sensor wake ms\":\"%u/%u\"," \
+                                         "\"preview us\":\"%u/%u\"," \
+                                         "\"preview size percent\":\"%u\"," \
+                                         "\"crop us\":\"%u/%u\"," \
+                                         "\"crop bytes saved\":\"%llu\"," \
+                                         "\"budget retries per capture\":\"%u.%u\"," \
+                                         "\"budget average quality\":\"%u\"," \
+                                         "\"budget misses\":\"%u\"," \
+                                         "\"overlay us\":\"%u/%u\"," \
+                                         "\"overlay refused\":\"%u\"")
+
+// Quality used when frames are converted to JPEG in software
+#define CAM_FRAME_JPEG_QUALITY          (80U)
+
+// Limits of the settings that can be changed at runtime
+#define CAM_QUALITY_WORST               (63U)
+#define CAM_XCLK_MIN_HZ                 (8000000U)
+#define CAM_XCLK_MAX_HZ                 (20000000U)
+
+// Frames beyond the queued ones a still may take to arrive at its frame size
+#define CAM_STILL_EXTRA_FRAMES          (2U)
+
+// Captures taken again at a lower quality if an upload exceeds its budget
+#define CAM_BUDGET_MAX_RETRIES          (2U)
+
+// Frames beyond the queued ones a fresh capture waits for, and settle frames
+// it skips at most
+#define CAM_FRESH_EXTRA_FRAMES          (2U)
+#define CAM_FRESH_MAX_SETTLE_FRAMES     (10U)
+
 // ESP32-S Camera Pins
 #define CAM_PIN_PWDN 32
 #define CAM_PIN_RESET -1 //software reset will be performed
@@ -57,14 +150,6 @@
 #define CAM_PIN_HREF 23
 #define CAM_PIN_PCLK 22
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-
-static const char* _STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char* _STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char* _STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
-
-static SemaphoreHandle_t _camera_mutex;
-
 static camera_config_t camera_config = {
   .pin_pwdn  = CAM_PIN_PWDN,
   .pin_reset = CAM_PIN_RESET,
@@ -93,135 +178,418 @@ static camera_config_t camera_config = {
   .frame_size = FRAMESIZE_VGA,
 
   .jpeg_quality = 12, //0-63 lower number means higher quality
-  .fb_count = 1 //if more than one, i2s runs in continuous mode. Use only with JPEG
+  .fb_count = CAM_FB_COUNT_DRAM //if more than one, i2s runs in continuous mode. Use only with JPEG
+};
+
+/*
+* @brief Frame sizes that can be configured, by their width. The names of the
+* framesize_t values differ between driver versions, their order does not.
+*/
+typedef struct cam_frame_size {
+  framesize_t frame_size;
+  uint16_t width;
+} cam_frame_size_t;
+
+static const cam_frame_size_t _frame_sizes[] = {
+  { FRAMESIZE_QQVGA, 160 },
+  { FRAMESIZE_QCIF, 176 },
+  { FRAMESIZE_HQVGA, 240 },
+  { FRAMESIZE_QVGA, 320 },
+  { FRAMESIZE_CIF, 400 },
+  { FRAMESIZE_VGA, 640 },
+  { FRAMESIZE_SVGA, 800 },
+  { FRAMESIZE_XGA, 1024 },
+  { FRAMESIZE_SXGA, 1280 },
+  { FRAMESIZE_UXGA, 1600 }
+};
+
+#define CAM_FRAME_SIZE_COUNT            (sizeof(_frame_sizes) / sizeof(_frame_sizes[0]))
+
+/*
+* @brief Kinds of runtime changes, timed separately. Changes to the buffer
+* geometry restart the driver, everything else is applied to the running sensor.
+*/
+typedef enum {
+  cam_switch_frame_size,
+  cam_switch_quality,
+  cam_switch_xclk,
+  cam_switch_reallocate,
+  cam_switch_count
+} cam_switch_t;
+
+typedef struct cam_switch_stats {
+  uint32_t count;
+  uint32_t last_us;   // From the command to the first frame fully captured with the change
+  uint32_t max_us;
+} cam_switch_stats_t;
+
+static const char *_switch_names[cam_switch_count] = {
+  "Frame size",
+  "Quality",
+  "XCLK",
+  "Reallocation"
 };
 
 static httpd_handle_t httpd_handle;
 
+/*
+* @brief Cost of taking stills at their own frame size while streaming. The
+* switch runs from the still request until the still was captured, the stream
+* hiccup from the last stream frame before the switch to the first one after.
+*/
+typedef struct cam_still_stats {
+  uint32_t count;
+  uint32_t switch_us;
+  uint32_t max_switch_us;
+  uint32_t hiccup_us;
+  uint32_t max_hiccup_us;
+  uint32_t discarded;         // Transition frames dropped while switching to the still
+} cam_still_stats_t;
+
+// Frame size the driver buffers were allocated for, larger ones need new buffers
+static framesize_t _allocated_frame_size;
+
+// Frame size stills are taken at, unless it is the stream frame size
+static framesize_t _still_frame_size;
+static uint8_t _still_profile = 0;
+static cam_still_stats_t _still_stats;
+
+/*
+* @brief Cost of guaranteeing uploads were exposed after they were requested.
+* Frames are stale if they were, or may have been, exposed before the request.
+*/
+typedef struct cam_fresh_stats {
+  uint32_t captures;
+  uint32_t latency_us;        // From the request until a fresh frame was available
+  uint32_t max_latency_us;
+  uint32_t frames;            // Frames looked at
+  uint32_t stale;             // Frames skipped for being stale
+} cam_fresh_stats_t;
+
+static cam_fresh_stats_t _fresh_stats;
+// Frames after from and up to to were captured for a still, not for the stream
+static volatile uint32_t _still_from_seq = 0;
+static volatile uint32_t _still_to_seq = 0;
+static cam_switch_stats_t _switch_stats[cam_switch_count];
+// Serializes configuration changes against each other and against uploads
+static SemaphoreHandle_t _config_mutex = NULL;
+
 static uint8_t _service_initialized = 0;
 static uint8_t _camera_initialized = 0;
 static uint8_t _http_server_initialized = 0;
+static volatile uint8_t _producer_running = 0;
+static volatile uint8_t _producer_active = 0;
 
-static int CAM_SERVICE_camera_init()
+static portMUX_TYPE _frame_ref_lock = portMUX_INITIALIZER_UNLOCKED;
+
+cam_frame_t* CAM_SERVICE_frame_acquire(uint32_t after_seq, TickType_t wait)
 {
-  esp_err_t err = ESP_OK;
+  return CAM_RING_acquire(after_seq, wait);
+}
 
-  if (_camera_initialized)
+void CAM_SERVICE_frame_retain(cam_frame_t *frame)
+{
+  portENTER_CRITICAL(&_frame_ref_lock);
+  frame->refs++;
+  portEXIT_CRITICAL(&_frame_ref_lock);
+}
+
+void CAM_SERVICE_frame_release(cam_frame_t *frame)
+{
+  uint32_t refs = 0;
+
+  if (NULL == frame)
+  {
+    return;
+  }
+
+  portENTER_CRITICAL(&_frame_ref_lock);
+  refs = --frame->refs;
+  portEXIT_CRITICAL(&_frame_ref_lock);
+
+  if (0 == refs && frame->free_fn)
+  {
+    frame->free_fn(frame);
+  }
+}
+
+cam_frame_t* CAM_SERVICE_frame_to_jpeg(cam_frame_t *frame)
+{
+  if (PIXFORMAT_JPEG == frame->format)
+  {
+    CAM_SERVICE_frame_retain(frame);
+    return frame;
+  }
+
+  // Encoder output goes to reused buffers, a long stream would otherwise
+  // allocate and free a large block for every frame
+  return CAM_JPOOL_encode(frame, CAM_FRAME_JPEG_QUALITY);
+}
+
+/*
+* @brief Producer task, keeps the driver capturing and publishes every finished
+* frame into the frame ring from which all consumers read.
+*/
+static void CAM_SERVICE_producer_runner(void *arg)
+{
+  camera_fb_t *fb = NULL;
+  sensor_t *s = NULL;
+
+  (void) arg;
+
+  _producer_active = 1;
+
+  while (_producer_running)
+  {
+    // Nothing is asked of the driver while the sensor is powered down
+    if (CAM_POWER_suspended(CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS))
+    {
+      continue;
+    }
+
+    // Consumers may hold on to frames, make sure the driver is left with a
+    // buffer to capture into before asking it for the next frame
+    if (CAM_RING_reclaim(CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS) != EXIT_SUCCESS)
+    {
+      continue;
+    }
+
+    if ((fb = esp_camera_fb_get()) == NULL)
+    {
+      ESP_LOGI(LOG_TAG, "Producer failed to acquire frame\n");
+      vTaskDelay(CAM_PRODUCER_RETRY_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    // Every consumer, from the stream to the pre-event history, only ever
+    // sees the frame masked and stamped. A frame whose masks could not be
+    // applied is handed back to the driver unseen.
+    if (CAM_OVERLAY_apply(fb) != EXIT_SUCCESS)
+    {
+      esp_camera_fb_return(fb);
+      continue;
+    }
+
+    if ((s = esp_camera_sensor_get()) != NULL)
+    {
+      CAM_BUDGET_observe(fb, s->status.quality);
+    }
+
+    if (CAM_RING_publish(fb) == EXIT_SUCCESS)
+    {
+      CAM_POWER_frame_published();
+    }
+  }
+
+  _producer_active = 0;
+}
+
+uint64_t CAM_SERVICE_kvs_get_uint(kvs_entry_id_t key, uint64_t fallback)
+{
+  kvs_entry_t entry = {
+    .key = key,
+    .value_len = KVS_SERVICE_MAXIMUM_VALUE_SIZE
+  };
+
+  memset(entry.value, '\0', KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+
+  // The value was verified as an unsigned before it was allowed into KVS
+  if (SC_send_cmd(sc_service_kvs, KVS_SERVICE_CMD_GET_KEY_VALUE, &entry) != EXIT_SUCCESS
+    || '\0' == entry.value[0])
+  {
+    return fallback;
+  }
+
+  return strtoull(entry.value, NULL, 10);
+}
+
+static int CAM_SERVICE_producer_start()
+{
+  if (_producer_running)
   {
     return EXIT_SUCCESS;
   }
 
-  if ((err = esp_camera_init(&camera_config)) != ESP_OK)
+  if (CAM_RING_init(camera_config.fb_count > 1 ? camera_config.fb_count - 1 : 1, camera_config.fb_count) != EXIT_SUCCESS)
   {
-    ESP_LOGI(LOG_TAG, "Camera init failed with %d\n", err);
     return EXIT_FAILURE;
   }
 
-  _camera_initialized = 1;
+  _producer_running = 1;
+
+  if (!Iot_CreateDetachedThread(CAM_SERVICE_producer_runner,
+                                NULL,
+                                CAM_PRODUCER_TASK_PRIORITY,
+                                CAM_PRODUCER_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create frame producer task\n");
+    _producer_running = 0;
+    CAM_RING_deinit(0);
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
 
-static void CAM_SERVICE_camera_deinit()
+// Fails if frames are still held after CAM_RELEASE_WAIT_MS, the ring is then
+// kept and the producer can be started on it again
+static int CAM_SERVICE_producer_stop()
 {
-  esp_camera_deinit();
+  _producer_running = 0;
 
-  _camera_initialized = 0;
+  while (_producer_active)
+  {
+    vTaskDelay(CAM_PRODUCER_STOP_POLL_MS / portTICK_PERIOD_MS);
+  }
+
+  return CAM_RING_deinit(CAM_RELEASE_WAIT_MS / portTICK_PERIOD_MS);
 }
 
-/**
- *  Below function has been substantionally taken from random nerd tutorials, with below original copyright notice:
- *
- *  Rui Santos
- *  Complete project details at https://RandomNerdTutorials.com/esp32-cam-video-streaming-web-server-camera-home-assistant/
- *
- *  IMPORTANT!!!
- *   - Select Board "AI Thinker ESP32-CAM"
- *   - GPIO 0 must be connected to GND to upload a sketch
- *   - After connecting GPIO 0 to GND, press the ESP32-CAM on-board RESET button to put your board in flashing mode
- *
- *  Permission is hereby granted, free of charge, to any person obtaining a copy
- *  of this software and associated documentation files.
- *
-**/
-static esp_err_t http_server_handler(httpd_req_t *req)
+static int CAM_SERVICE_kvs_put_uint(kvs_entry_id_t key, uint32_t value)
 {
-  camera_fb_t *fb = NULL;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t * _jpg_buf = NULL;
-  char * part_buf[64];
+  kvs_entry_t entry = {
+    .key = key
+  };
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK)
-  {
-    return res;
-  }
+  memset(entry.value, '\0', KVS_SERVICE_MAXIMUM_VALUE_SIZE);
+  entry.value_len = snprintf(entry.value, KVS_SERVICE_MAXIMUM_VALUE_SIZE, "%u", value);
 
-  if(xSemaphoreTake(_camera_mutex, (TickType_t) 10U) == pdTRUE)
+  return SC_send_cmd(sc_service_kvs, KVS_SERVICE_CMD_PUT_KEY_VALUE, &entry);
+}
+
+static int CAM_SERVICE_frame_size_from_width(uint32_t width, framesize_t *frame_size)
+{
+  for (uint8_t i = 0; i < CAM_FRAME_SIZE_COUNT; ++i)
   {
-    while (true)
+    if (_frame_sizes[i].width == width)
     {
-      fb = esp_camera_fb_get();
-      if (!fb)
-      {
-        ESP_LOGI(LOG_TAG, "Camera capture failed");
-        res = ESP_FAIL;
-      }
-      else
-      {
-        if (fb->width > 400)
-        {
-          if (fb->format != PIXFORMAT_JPEG)
-          {
-            bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-            esp_camera_fb_return(fb);
-            fb = NULL;
-            if (!jpeg_converted)
-            {
-              ESP_LOGI("CAM_SERIVE", "JPEG compression failed");
-              res = ESP_FAIL;
-            }
-          }
-          else
-          {
-            _jpg_buf_len = fb->len;
-            _jpg_buf = fb->buf;
-          }
-        }
-      }
-      if (res == ESP_OK)
-      {
-        size_t hlen = snprintf((char *)part_buf, 64, _STREAM_PART, _jpg_buf_len);
-        res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
-      }
-      if (res == ESP_OK)
-      {
-        res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-      }
-      if (res == ESP_OK)
-      {
-        res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
-      }
-      if (fb)
-      {
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        _jpg_buf = NULL;
-      }
-      else if (_jpg_buf)
-      {
-        free(_jpg_buf);
-        _jpg_buf = NULL;
-      }
-      if (res != ESP_OK)
-      {
-        break;
-      }
+      *frame_size = _frame_sizes[i].frame_size;
+      return EXIT_SUCCESS;
     }
-    xSemaphoreGive(_camera_mutex);
   }
-  return res;
+  return EXIT_FAILURE;
+}
+
+static int CAM_SERVICE_valid_fb_count(uint32_t fb_count)
+{
+  // Continuous capture into several buffers only works for JPEG
+  return fb_count >= 1 && fb_count <= CAM_RING_MAX_BUFFERS
+    && (1 == fb_count || PIXFORMAT_JPEG == camera_config.pixel_format);
+}
+
+// Applies the settings stored in KVS over the built-in configuration, invalid
+// entries are ignored
+static void CAM_SERVICE_load_config()
+{
+  framesize_t frame_size;
+  uint32_t quality = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_camera_quality, camera_config.jpeg_quality);
+  uint32_t xclk = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_camera_xclk, camera_config.xclk_freq_hz);
+  uint32_t fb_count = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_camera_fb_count, 0);
+
+  if (CAM_SERVICE_frame_size_from_width(CAM_SERVICE_kvs_get_uint(kvs_entry_eye_camera_frame_size, 0), &frame_size) == EXIT_SUCCESS)
+  {
+    camera_config.frame_size = frame_size;
+  }
+  _still_profile = (CAM_SERVICE_frame_size_from_width(CAM_SERVICE_kvs_get_uint(kvs_entry_eye_camera_still_frame_size, 0),
+                                                      &_still_frame_size) == EXIT_SUCCESS);
+  if (quality <= CAM_QUALITY_WORST)
+  {
+    camera_config.jpeg_quality = quality;
+  }
+  if (xclk >= CAM_XCLK_MIN_HZ && xclk <= CAM_XCLK_MAX_HZ)
+  {
+    camera_config.xclk_freq_hz = xclk;
+  }
+
+  // Keep several buffers in flight when they can be placed in PSRAM, the driver
+  // allocates from there by itself when it is available
+  if (CAM_SERVICE_valid_fb_count(fb_count))
+  {
+    camera_config.fb_count = fb_count;
+  }
+  else
+  {
+    camera_config.fb_count = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? CAM_FB_COUNT_PSRAM : CAM_FB_COUNT_DRAM;
+  }
+}
+
+static int CAM_SERVICE_camera_init()
+{
+  esp_err_t err = ESP_OK;
+  framesize_t stream_frame_size = camera_config.frame_size;
+  sensor_t *s = NULL;
+
+  if (_camera_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  // The driver sizes its buffers by the initial frame size, so it starts at
+  // the larger of the stream and still profiles and drops to the stream one
+  if (_still_profile && _still_frame_size > camera_config.frame_size)
+  {
+    camera_config.frame_size = _still_frame_size;
+  }
+
+  err = esp_camera_init(&camera_config);
+  _allocated_frame_size = camera_config.frame_size;
+  camera_config.frame_size = stream_frame_size;
+
+  if (ESP_OK != err)
+  {
+    ESP_LOGI(LOG_TAG, "Camera init failed with %d\n", err);
+    return EXIT_FAILURE;
+  }
+
+  if (_allocated_frame_size != stream_frame_size
+    && ((s = esp_camera_sensor_get()) == NULL || s->set_framesize(s, stream_frame_size) != 0))
+  {
+    esp_camera_deinit();
+    return EXIT_FAILURE;
+  }
+
+  ESP_LOGI(LOG_TAG, "Camera running with %u frame buffers\n", camera_config.fb_count);
+
+  if (CAM_POWER_init(&camera_config) != EXIT_SUCCESS)
+  {
+    esp_camera_deinit();
+    return EXIT_FAILURE;
+  }
+
+  CAM_RC_init(camera_config.frame_size, camera_config.jpeg_quality);
+
+  if (CAM_JPOOL_init() != EXIT_SUCCESS)
+  {
+    esp_camera_deinit();
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_SERVICE_producer_start() != EXIT_SUCCESS)
+  {
+    esp_camera_deinit();
+    return EXIT_FAILURE;
+  }
+
+  _camera_initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+// The driver is only torn down once every buffer it handed out is back,
+// otherwise the producer is left stopped and EXIT_FAILURE returned
+static int CAM_SERVICE_camera_deinit()
+{
+  if (CAM_SERVICE_producer_stop() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  CAM_POWER_deinit();
+  esp_camera_deinit();
+
+  _camera_initialized = 0;
+
+  return EXIT_SUCCESS;
 }
 
 static int CAM_SERVICE_http_server_start()
@@ -238,17 +606,52 @@ static int CAM_SERVICE_http_server_start()
 
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.server_port = FSU_HTTP_SERVER_PORT;
+  config.close_fn = CAM_STREAM_close_fn;
 
   httpd_uri_t index_uri = {
     .uri       = "/",
     .method    = HTTP_GET,
-    .handler   = http_server_handler,
+    .handler   = CAM_STREAM_http_handler,
+    .user_ctx  = NULL
+  };
+
+  httpd_uri_t capture_uri = {
+    .uri       = "/capture",
+    .method    = HTTP_GET,
+    .handler   = CAM_CAPTURE_http_handler,
     .user_ctx  = NULL
   };
 
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = {
+    .uri          = "/ws",
+    .method       = HTTP_GET,
+    .handler      = CAM_STREAM_ws_handler,
+    .user_ctx     = NULL,
+    .is_websocket = true,
+    // The stream workers are the only writers of the socket, control frames
+    // are answered through them
+    .handle_ws_control_frames = true
+  };
+#endif
+
   ESP_LOGI(LOG_TAG, "Starting http server on port: '%d'\n", config.server_port);
   if (httpd_start(&httpd_handle, &config) == ESP_OK) {
     httpd_register_uri_handler(httpd_handle, &index_uri);
+    httpd_register_uri_handler(httpd_handle, &capture_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_register_uri_handler(httpd_handle, &ws_uri);
+#endif
+  }
+
+  if (CAM_CAPTURE_init() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_STREAM_init(httpd_handle) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
   }
 
   _http_server_initialized = 1;
@@ -256,81 +659,810 @@ static int CAM_SERVICE_http_server_start()
   return EXIT_SUCCESS;
 }
 
-static int CAM_SERVICE_send_camera_capture()
+int CAM_SERVICE_is_stream_frame(const cam_frame_t *frame)
 {
-  if(xSemaphoreTake(_camera_mutex, (TickType_t) 10U) == pdTRUE)
-  {
-    camera_fb_t *fb = esp_camera_fb_get();
-    image_info_t image = {0};
+  return !(frame->seq > _still_from_seq && frame->seq <= _still_to_seq);
+}
 
-    if (!fb)
-    {
-      ESP_LOGI(LOG_TAG, "Capture failed to acquire frame\n");
-      xSemaphoreGive(_camera_mutex);
-      return EXIT_FAILURE;
-    }
+// Sequence number of the newest frame and its publish time, 0 if there is none
+static uint32_t CAM_SERVICE_newest(int64_t *timestamp)
+{
+  cam_frame_t *frame = CAM_SERVICE_frame_acquire(0, 0);
+  uint32_t seq = frame ? frame->seq : 0;
 
-    image.buf = fb->buf;
-    image.len = fb->len;
-    image.width = fb->width;
-    image.height = fb->height;
-    image.format = (uint8_t) fb->format;
+  if (timestamp)
+  {
+    *timestamp = frame ? frame->timestamp : 0;
+  }
 
-    ESP_LOGI(LOG_TAG, "Sending Picture\n");
-    SC_send_cmd(sc_service_aws, AWS_SERVICE_CMD_MQTT_PUBLISH_IMAGE, &image);
+  CAM_SERVICE_frame_release(frame);
+  return seq;
+}
 
-    //return the frame buffer back to the driver for reuse
-    esp_camera_fb_return(fb);
+// Records how long the stream went without a frame of its own after a still,
+// nothing to do if the sensor was not switched
+static void CAM_SERVICE_still_resumed(int64_t last_stream_frame)
+{
+  cam_frame_t *frame = NULL;
 
-    xSemaphoreGive(_camera_mutex);
+  if (!last_stream_frame)
+  {
+    return;
+  }
 
-    return EXIT_SUCCESS;
+  if ((frame = CAM_SERVICE_frame_acquire(_still_to_seq, CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS)) != NULL)
+  {
+    _still_stats.hiccup_us = frame->timestamp - last_stream_frame;
+    if (_still_stats.hiccup_us > _still_stats.max_hiccup_us)
+    {
+      _still_stats.max_hiccup_us = _still_stats.hiccup_us;
+    }
   }
-  return EXIT_FAILURE;
+
+  CAM_SERVICE_frame_release(frame);
 }
 
-static int CAM_SERVICE_init()
+// Tells whether a frame was exposed after request. Without a sensor timestamp
+// only frames past those the driver had queued at the time are certain to be.
+static int CAM_SERVICE_is_fresh(const cam_frame_t *frame, int64_t request, uint32_t request_seq)
 {
-  if (_service_initialized)
+  if (frame->captured)
   {
-    return EXIT_SUCCESS;
+    return frame->captured >= request;
   }
+  return frame->seq > request_seq + camera_config.fb_count;
+}
 
-  _camera_mutex = xSemaphoreCreateMutex();
+// Acquires a frame exposed after request. The newest frame may have been
+// captured long ago if the producer was held up, or just before the request
+// while the driver queue still holds frames exposed even earlier, so frames
+// are skipped until one is fresh. Settle frames configured in KVS are skipped
+// on top, to let exposure control catch up with the scene.
+static cam_frame_t* CAM_SERVICE_fresh_acquire(int64_t request)
+{
+  cam_frame_t *frame = NULL;
+  uint32_t request_seq = CAM_SERVICE_newest(NULL);
+  uint32_t seq = 0;
+  uint32_t settle = 0;
+  uint32_t stale = 0;
+  uint32_t frames = 0;
+  uint8_t fresh = 0;
 
-  if (CAM_SERVICE_camera_init() != EXIT_SUCCESS)
+  if (!CAM_SERVICE_kvs_get_uint(kvs_entry_eye_fresh_capture, 1))
   {
-    return EXIT_FAILURE;
+    return CAM_SERVICE_frame_acquire(0, CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS);
   }
 
-  if (CAM_SERVICE_http_server_start() != EXIT_SUCCESS)
+  settle = CAM_SERVICE_kvs_get_uint(kvs_entry_eye_capture_settle_frames, 0);
+  settle = (settle > CAM_FRESH_MAX_SETTLE_FRAMES) ? CAM_FRESH_MAX_SETTLE_FRAMES : settle;
+
+  while ((frame = CAM_SERVICE_frame_acquire(seq, CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS)) != NULL)
   {
-    return EXIT_FAILURE;
+    frames++;
+
+    // Bounded in case the sensor timestamps can not be trusted
+    fresh = CAM_SERVICE_is_fresh(frame, request, request_seq)
+      || stale > camera_config.fb_count + CAM_FRESH_EXTRA_FRAMES;
+    if (fresh && !settle)
+    {
+      break;
+    }
+    stale += !fresh;
+    settle -= fresh;
+
+    seq = frame->seq;
+    CAM_SERVICE_frame_release(frame);
+    frame = NULL;
   }
 
-  _service_initialized = 1;
+  _fresh_stats.frames += frames;
+  _fresh_stats.stale += stale;
+  if (frame)
+  {
+    _fresh_stats.captures++;
+    _fresh_stats.latency_us = esp_timer_get_time() - request;
+    if (_fresh_stats.latency_us > _fresh_stats.max_latency_us)
+    {
+      _fresh_stats.max_latency_us = _fresh_stats.latency_us;
+    }
+  }
 
-  return EXIT_SUCCESS;
+  return frame;
+}
+
+// Frame size and quality uploads are taken at, the still profile if one is set
+// and differs from the stream, otherwise the settings the stream runs at
+static void CAM_SERVICE_still_settings(const cam_rc_stats_t *rc, framesize_t *frame_size, uint8_t *quality)
+{
+  if (_still_profile && _still_frame_size != rc->frame_size && _still_frame_size <= _allocated_frame_size)
+  {
+    *frame_size = _still_frame_size;
+    *quality = camera_config.jpeg_quality;
+    return;
+  }
+
+  *frame_size = rc->frame_size;
+  *quality = rc->quality;
+}
+
+// Takes a frame for upload at the still frame size and the given quality. If
+// that differs from the stream the sensor is switched for as long as it takes
+// to capture one frame, and then handed back to the stream. Frames captured in
+// between are kept from the stream and the frames still carrying the old
+// settings from the still. last_stream_frame is set if the sensor was switched.
+static cam_frame_t* CAM_SERVICE_still_acquire(int64_t *last_stream_frame, uint8_t quality)
+{
+  cam_frame_t *frame = NULL;
+  int64_t start = esp_timer_get_time();
+  uint32_t seq = 0;
+  uint16_t width = 0;
+  framesize_t frame_size = FRAMESIZE_INVALID;
+  uint8_t unused = 0;
+  cam_rc_stats_t rc;
+
+  CAM_RC_get_stats(&rc);
+  CAM_SERVICE_still_settings(&rc, &frame_size, &unused);
+  for (uint8_t i = 0; i < CAM_FRAME_SIZE_COUNT; ++i)
+  {
+    width = (_frame_sizes[i].frame_size == frame_size) ? _frame_sizes[i].width : width;
+  }
+
+  *last_stream_frame = 0;
+  if ((frame_size == rc.frame_size && quality == rc.quality) || !width)
+  {
+    return CAM_SERVICE_fresh_acquire(start);
+  }
+
+  _still_to_seq = UINT32_MAX;
+  _still_from_seq = seq = CAM_SERVICE_newest(last_stream_frame);
+
+  if (CAM_RC_hold(frame_size, quality) == EXIT_SUCCESS)
+  {
+    // Frames already queued in the driver were taken with the stream settings,
+    // the first one past them is taken with the new ones
+    seq += camera_config.fb_count;
+    for (uint8_t i = 0; i <= camera_config.fb_count + CAM_STILL_EXTRA_FRAMES; ++i)
+    {
+      if ((frame = CAM_SERVICE_frame_acquire(seq, CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS)) == NULL
+        || frame->width == width)
+      {
+        break;
+      }
+      seq = frame->seq;
+      CAM_SERVICE_frame_release(frame);
+      frame = NULL;
+    }
+
+    _still_stats.switch_us = esp_timer_get_time() - start;
+    if (_still_stats.switch_us > _still_stats.max_switch_us)
+    {
+      _still_stats.max_switch_us = _still_stats.switch_us;
+    }
+    _still_stats.count++;
+    _still_stats.discarded += frame ? frame->seq - _still_from_seq - 1U : 0;
+  }
+
+  CAM_RC_resume();
+  _still_to_seq = CAM_SERVICE_newest(NULL) + camera_config.fb_count;
+
+  if (frame)
+  {
+    ESP_LOGI(LOG_TAG, "Still taken in %u us, %u frames discarded in total\n", _still_stats.switch_us, _still_stats.discarded);
+  }
+  else
+  {
+    ESP_LOGI(LOG_TAG, "Still profile frame not captured\n");
+  }
+
+  return frame;
+}
+
+// Takes a frame for upload that fits the Image Size Budget. The quality is
+// picked from the sizes frames were seen to have, and lowered further as long
+// as a capture does not fit. last_stream_frame is as for still_acquire.
+static cam_frame_t* CAM_SERVICE_budget_acquire(int64_t *last_stream_frame)
+{
+  size_t budget = (size_t) CAM_SERVICE_kvs_get_uint(kvs_entry_eye_image_size_budget, 0);
+  cam_frame_t *frame = NULL;
+  int64_t last = 0;
+  framesize_t frame_size = FRAMESIZE_INVALID;
+  uint8_t quality = 0;
+  uint8_t retries = 0;
+  cam_rc_stats_t rc;
+
+  CAM_RC_get_stats(&rc);
+  CAM_SERVICE_still_settings(&rc, &frame_size, &quality);
+
+  if (!budget || PIXFORMAT_JPEG != camera_config.pixel_format)
+  {
+    return CAM_SERVICE_still_acquire(last_stream_frame, quality);
+  }
+
+  quality = CAM_BUDGET_quality(frame_size, quality, budget);
+  frame = CAM_SERVICE_still_acquire(last_stream_frame, quality);
+
+  while (frame && frame->len > budget && retries < CAM_BUDGET_MAX_RETRIES && quality < CAM_QUALITY_WORST)
+  {
+    CAM_BUDGET_captured(frame, quality, budget, 0);
+    CAM_SERVICE_frame_release(frame);
+
+    quality = CAM_BUDGET_quality(frame_size, quality + 1U, budget);
+    frame = CAM_SERVICE_still_acquire(&last, quality);
+    retries++;
+
+    // The stream has been waiting since the first switch
+    *last_stream_frame = *last_stream_frame ? *last_stream_frame : last;
+  }
+
+  if (frame)
+  {
+    CAM_BUDGET_captured(frame, quality, budget, 1);
+  }
+
+  return frame;
+}
+
+// Replaces the frame by its preview, keeps it if no preview could be made
+static uint8_t CAM_SERVICE_to_preview(cam_frame_t **frame, uint8_t scale)
+{
+  cam_frame_t *jpeg = CAM_SERVICE_frame_to_jpeg(*frame);
+  cam_frame_t *preview = jpeg ? CAM_PREVIEW_make(jpeg, scale) : NULL;
+
+  CAM_SERVICE_frame_release(jpeg);
+
+  if (!preview)
+  {
+    ESP_LOGI(LOG_TAG, "Preview failed, sending the full image\n");
+    return 0;
+  }
+
+  CAM_SERVICE_frame_release(*frame);
+  *frame = preview;
+
+  return 1;
+}
+
+// Replaces a sensor JPEG by the Crop Region of it, if one is set
+static void CAM_SERVICE_to_region(cam_frame_t **frame)
+{
+  cam_frame_t *cropped = CAM_CROP_region(*frame);
+
+  if (cropped)
+  {
+    CAM_SERVICE_frame_release(*frame);
+    *frame = cropped;
+  }
+}
+
+// Uploads a capture, cut down to the Crop Region and as a preview if a
+// Preview Scale is set, unless full was asked for
+static int CAM_SERVICE_send_camera_capture(uint32_t *full)
+{
+  int64_t last_stream_frame = 0;
+  cam_frame_t *frame = CAM_SERVICE_budget_acquire(&last_stream_frame);
+  image_info_t image = {0};
+  uint8_t forced = full && *full;
+  uint8_t scale = forced ? 0 : (uint8_t) CAM_SERVICE_kvs_get_uint(kvs_entry_eye_preview_scale, 0);
+  uint8_t cmd = AWS_SERVICE_CMD_MQTT_PUBLISH_IMAGE;
+
+  if (!frame)
+  {
+    ESP_LOGI(LOG_TAG, "Capture failed to acquire frame\n");
+    CAM_SERVICE_still_resumed(last_stream_frame);
+    return EXIT_FAILURE;
+  }
+
+  if (!forced)
+  {
+    CAM_SERVICE_to_region(&frame);
+  }
+
+  // A full image is asked for on purpose, it is sent even if nothing changed
+  if (!forced && CAM_DEDUP_is_duplicate(frame))
+  {
+    CAM_SERVICE_frame_release(frame);
+    CAM_SERVICE_still_resumed(last_stream_frame);
+    return EXIT_SUCCESS;
+  }
+
+  if (scale && CAM_SERVICE_to_preview(&frame, scale))
+  {
+    cmd = AWS_SERVICE_CMD_MQTT_PUBLISH_PREVIEW;
+  }
+
+  image.buf = frame->buf;
+  image.len = frame->len;
+  image.width = frame->width;
+  image.height = frame->height;
+  image.format = (uint8_t) frame->format;
+  image.frame = frame;
+
+  ESP_LOGI(LOG_TAG, "Sending %s\n", (AWS_SERVICE_CMD_MQTT_PUBLISH_PREVIEW == cmd) ? "Preview" : "Picture");
+  if (SC_send_cmd(sc_service_aws, cmd, &image) == EXIT_SUCCESS && !forced)
+  {
+    CAM_DEDUP_uploaded();
+  }
+
+  // The AWS service takes over the reference and releases it once the publish
+  // completed, if it did not the frame is released here
+  if (image.frame)
+  {
+    CAM_SERVICE_frame_release(image.frame);
+  }
+
+  // Only now, the still is not held back while the stream recovers
+  CAM_SERVICE_still_resumed(last_stream_frame);
+
+  return EXIT_SUCCESS;
+}
+
+static int CAM_SERVICE_init()
+{
+  if (_service_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  if ((!_config_mutex && (_config_mutex = xSemaphoreCreateMutex()) == NULL)
+    || CAM_LAT_init() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  CAM_SERVICE_load_config();
+
+  if (CAM_SERVICE_camera_init() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_SERVICE_http_server_start() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_JPEG_init() != EXIT_SUCCESS
+    || CAM_MOTION_init() != EXIT_SUCCESS
+    || CAM_HISTORY_init() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  // RTSP is an extra way out for the stream, the camera is served without it
+  if (CAM_RTSP_init() != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "RTSP server not started, continuing without it\n");
+  }
+
+  _service_initialized = 1;
+
+  return EXIT_SUCCESS;
 }
 
 static int CAM_SERVICE_deinit()
 {
-  CAM_SERVICE_camera_deinit();
+  // Consumers hold frames, drop them before the ring goes away
+  CAM_RTSP_deinit();
+  CAM_HISTORY_deinit();
+  CAM_MOTION_deinit();
+  CAM_STREAM_deinit();
+  CAM_CAPTURE_deinit();
+  _http_server_initialized = 0;
+
+  if (CAM_SERVICE_camera_deinit() != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "Frames still in use, camera driver left running\n");
+    return EXIT_FAILURE;
+  }
 
-  vSemaphoreDelete(_camera_mutex);
   _service_initialized = 0;
 
   return EXIT_SUCCESS;
 }
 
+// Times a change up to the first frame captured entirely after it. Frames the
+// driver had already queued when the change was made, at most one per buffer,
+// still carry the old settings.
+static void CAM_SERVICE_switch_done(cam_switch_t type, int64_t start, uint32_t seq)
+{
+  cam_frame_t *frame = CAM_SERVICE_frame_acquire(seq, CAM_FRAME_WAIT_MS / portTICK_PERIOD_MS);
+  cam_switch_stats_t *stats = &_switch_stats[type];
+
+  CAM_SERVICE_frame_release(frame);
+
+  stats->count++;
+  stats->last_us = esp_timer_get_time() - start;
+  if (stats->last_us > stats->max_us)
+  {
+    stats->max_us = stats->last_us;
+  }
+
+  ESP_LOGI(LOG_TAG, "%s switch took %u us%s\n", _switch_names[type], stats->last_us, frame ? "" : ", no frame followed");
+}
+
+// Restores the configuration the driver ran with before a restart was tried
+static void CAM_SERVICE_restore_config(const camera_config_t *previous, framesize_t previous_still, uint8_t previous_profile)
+{
+  memcpy(&camera_config, previous, sizeof(camera_config_t));
+  _still_frame_size = previous_still;
+  _still_profile = previous_profile;
+}
+
+// Restarts the driver with the current configuration, the only way to change
+// the buffer geometry. If that fails it is started with the previous
+// configuration and still profile again. The consumers are stopped and started
+// again afterwards, stream viewers have to reconnect. Frames may still be held
+// beyond them, by an upload waiting for its ack or a capture request being
+// answered; the restart waits for those and is refused if they do not come
+// back in time, the driver then keeps running with the previous configuration.
+static int CAM_SERVICE_camera_restart(const camera_config_t *previous, framesize_t previous_still, uint8_t previous_profile)
+{
+  int status = EXIT_SUCCESS;
+
+  CAM_RTSP_deinit();
+  CAM_HISTORY_deinit();
+  CAM_MOTION_deinit();
+  CAM_STREAM_deinit();
+
+  if (CAM_CAPTURE_deinit() != EXIT_SUCCESS || CAM_SERVICE_camera_deinit() != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "Frames still in use, camera not restarted\n");
+    CAM_SERVICE_restore_config(previous, previous_still, previous_profile);
+    status = EXIT_FAILURE;
+
+    // The ring is kept as long as the driver runs, the producer continues on it
+    if (_camera_initialized && CAM_SERVICE_producer_start() != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  else if (CAM_SERVICE_camera_init() != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "Camera restart failed, restoring the previous configuration\n");
+    CAM_SERVICE_restore_config(previous, previous_still, previous_profile);
+    status = EXIT_FAILURE;
+
+    if (CAM_SERVICE_camera_init() != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (CAM_CAPTURE_init() != EXIT_SUCCESS
+    || CAM_STREAM_init(httpd_handle) != EXIT_SUCCESS
+    || CAM_MOTION_init() != EXIT_SUCCESS
+    || CAM_HISTORY_init() != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (CAM_RTSP_init() != EXIT_SUCCESS)
+  {
+    ESP_LOGI(LOG_TAG, "RTSP server not restarted, continuing without it\n");
+  }
+
+  return status;
+}
+
+static int CAM_SERVICE_set_frame_size(uint32_t *width)
+{
+  camera_config_t previous;
+  framesize_t frame_size;
+  int64_t start = esp_timer_get_time();
+
+  if (NULL == width || CAM_SERVICE_frame_size_from_width(*width, &frame_size) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (frame_size > _allocated_frame_size)
+  {
+    memcpy(&previous, &camera_config, sizeof(camera_config_t));
+    camera_config.frame_size = frame_size;
+    if (CAM_SERVICE_camera_restart(&previous, _still_frame_size, _still_profile) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+    CAM_SERVICE_switch_done(cam_switch_reallocate, start, 0);
+  }
+  else
+  {
+    if (CAM_RC_set_baseline(frame_size, camera_config.jpeg_quality) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+    camera_config.frame_size = frame_size;
+    CAM_SERVICE_switch_done(cam_switch_frame_size, start, CAM_SERVICE_newest(NULL) + camera_config.fb_count);
+  }
+
+  return CAM_SERVICE_kvs_put_uint(kvs_entry_eye_camera_frame_size, *width);
+}
+
+static int CAM_SERVICE_set_quality(uint32_t *quality)
+{
+  int64_t start = esp_timer_get_time();
+
+  if (NULL == quality || *quality > CAM_QUALITY_WORST
+    || CAM_RC_set_baseline(camera_config.frame_size, *quality) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  camera_config.jpeg_quality = *quality;
+  CAM_SERVICE_switch_done(cam_switch_quality, start, CAM_SERVICE_newest(NULL) + camera_config.fb_count);
+
+  return CAM_SERVICE_kvs_put_uint(kvs_entry_eye_camera_quality, *quality);
+}
+
+static int CAM_SERVICE_set_xclk(uint32_t *xclk)
+{
+  sensor_t *s = esp_camera_sensor_get();
+  int64_t start = esp_timer_get_time();
+
+  if (NULL == xclk || *xclk < CAM_XCLK_MIN_HZ || *xclk > CAM_XCLK_MAX_HZ
+    || NULL == s || NULL == s->set_xclk)
+  {
+    return EXIT_FAILURE;
+  }
+
+  // The sensor interface takes whole MHz
+  if (s->set_xclk(s, camera_config.ledc_timer, *xclk / 1000000U) != 0)
+  {
+    return EXIT_FAILURE;
+  }
+
+  camera_config.xclk_freq_hz = *xclk / 1000000U * 1000000U;
+  CAM_SERVICE_switch_done(cam_switch_xclk, start, CAM_SERVICE_newest(NULL) + camera_config.fb_count);
+
+  return CAM_SERVICE_kvs_put_uint(kvs_entry_eye_camera_xclk, camera_config.xclk_freq_hz);
+}
+
+static int CAM_SERVICE_set_fb_count(uint32_t *fb_count)
+{
+  camera_config_t previous;
+  int64_t start = esp_timer_get_time();
+
+  if (NULL == fb_count || !CAM_SERVICE_valid_fb_count(*fb_count))
+  {
+    return EXIT_FAILURE;
+  }
+
+  if (*fb_count != camera_config.fb_count)
+  {
+    memcpy(&previous, &camera_config, sizeof(camera_config_t));
+    camera_config.fb_count = *fb_count;
+    if (CAM_SERVICE_camera_restart(&previous, _still_frame_size, _still_profile) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+    CAM_SERVICE_switch_done(cam_switch_reallocate, start, 0);
+  }
+
+  return CAM_SERVICE_kvs_put_uint(kvs_entry_eye_camera_fb_count, *fb_count);
+}
+
+static int CAM_SERVICE_set_still_frame_size(uint32_t *width)
+{
+  camera_config_t previous;
+  framesize_t frame_size = 0;
+  framesize_t previous_still;
+  int64_t start = esp_timer_get_time();
+  uint8_t profile = 0;
+  uint8_t previous_profile = 0;
+
+  if (NULL == width)
+  {
+    return EXIT_FAILURE;
+  }
+
+  // 0 takes stills at the stream frame size
+  if (*width && CAM_SERVICE_frame_size_from_width(*width, &frame_size) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+  profile = (0 != *width);
+
+  if (profile && frame_size > _allocated_frame_size)
+  {
+    memcpy(&previous, &camera_config, sizeof(camera_config_t));
+    previous_still = _still_frame_size;
+    previous_profile = _still_profile;
+    _still_frame_size = frame_size;
+    _still_profile = profile;
+    if (CAM_SERVICE_camera_restart(&previous, previous_still, previous_profile) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+    CAM_SERVICE_switch_done(cam_switch_reallocate, start, 0);
+  }
+  else
+  {
+    _still_frame_size = frame_size;
+    _still_profile = profile;
+  }
+
+  return CAM_SERVICE_kvs_put_uint(kvs_entry_eye_camera_still_frame_size, *width);
+}
+
+// Runs a command that captures or reconfigures with the configuration locked
+static int CAM_SERVICE_locked(int (*fn)(uint32_t*), uint32_t *arg)
+{
+  int status = EXIT_FAILURE;
+
+  if (!_service_initialized)
+  {
+    return EXIT_FAILURE;
+  }
+
+  // The sensor only takes settings while powered
+  CAM_POWER_demand();
+
+  xSemaphoreTake(_config_mutex, portMAX_DELAY);
+  status = fn(arg);
+  xSemaphoreGive(_config_mutex);
+
+  return status;
+}
+
+static int CAM_SERVICE_get_motion(uint8_t *motion)
+{
+  if (NULL == motion)
+  {
+    return EXIT_FAILURE;
+  }
+
+  *motion = CAM_MOTION_take_event();
+
+  return EXIT_SUCCESS;
+}
+
+// Publishes the full latency histograms on the info topic, and starts them
+// over if asked to, e.g. to measure the effect of a changed setting
+static int CAM_SERVICE_publish_latency(uint32_t *reset)
+{
+  message_info_t msg = {0};
+  char *report = NULL;
+  int status = EXIT_FAILURE;
+
+  if ((report = malloc(CAM_LAT_REPORT_LEN)) == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  if ((msg.msg_len = CAM_LAT_report(report, CAM_LAT_REPORT_LEN)) > 0)
+  {
+    msg.msg = report;
+    status = SC_send_cmd(sc_service_aws, AWS_SERVICE_CMD_MQTT_PUBLISH_MESSAGE, &msg);
+  }
+  free(report);
+
+  if (EXIT_SUCCESS == status && reset && *reset)
+  {
+    CAM_LAT_reset();
+  }
+
+  return status;
+}
+
+static int CAM_SERVICE_get_info(cam_service_info_t *info)
+{
+  cam_ring_stats_t ring = {0};
+  cam_dedup_stats_t dedup;
+  cam_history_stats_t history;
+  cam_jpool_stats_t jpool = {0};
+  cam_power_stats_t power;
+  cam_preview_stats_t preview;
+  cam_crop_stats_t crop;
+  cam_budget_stats_t budget;
+  cam_overlay_stats_t overlay;
+  int len = 0;
+
+  if (NULL == info || NULL == info->buf || 0 == info->len)
+  {
+    return EXIT_FAILURE;
+  }
+
+  CAM_RING_get_stats(&ring);
+  CAM_DEDUP_get_stats(&dedup);
+  CAM_HISTORY_get_stats(&history);
+  CAM_JPOOL_get_stats(&jpool);
+  CAM_POWER_get_stats(&power);
+  CAM_PREVIEW_get_stats(&preview);
+  CAM_CROP_get_stats(&crop);
+  CAM_BUDGET_get_stats(&budget);
+  CAM_OVERLAY_get_stats(&overlay);
+
+  len = snprintf(info->buf, info->len, CAM_SERVICE_INFO,
+                 ring.published ? (uint32_t) (100ULL * ring.unread / ring.published) : 0,
+                 dedup.checked ? (uint32_t) (dedup.total_us / dedup.checked) : 0,
+                 dedup.checked ? 100U * dedup.skipped / dedup.checked : 0,
+                 dedup.bytes_saved,
+                 history.frames,
+                 history.bytes,
+                 history.evicted,
+                 history.dropped,
+                 history.capture_fps_tenths / 10U,
+                 history.capture_fps_tenths % 10U,
+                 history.drain_ms,
+                 jpool.fallbacks,
+                 jpool.max_fragmentation,
+                 _switch_stats[cam_switch_frame_size].last_us,
+                 _switch_stats[cam_switch_quality].last_us,
+                 _switch_stats[cam_switch_xclk].last_us,
+                 _switch_stats[cam_switch_reallocate].last_us,
+                 CAM_LAT_percentile_ms(cam_lat_stream, cam_lat_total, 50),
+                 CAM_LAT_percentile_ms(cam_lat_stream, cam_lat_total, 90),
+                 CAM_LAT_percentile_ms(cam_lat_stream, cam_lat_total, 100),
+                 CAM_LAT_percentile_ms(cam_lat_upload, cam_lat_total, 50),
+                 CAM_LAT_percentile_ms(cam_lat_upload, cam_lat_total, 90),
+                 CAM_LAT_percentile_ms(cam_lat_upload, cam_lat_total, 100),
+                 _still_stats.switch_us,
+                 _still_stats.max_switch_us,
+                 _still_stats.hiccup_us / 1000U,
+                 _still_stats.max_hiccup_us / 1000U,
+                 _fresh_stats.latency_us / 1000U,
+                 _fresh_stats.max_latency_us / 1000U,
+                 _fresh_stats.frames ? 100U * _fresh_stats.stale / _fresh_stats.frames : 0,
+                 power.duty_percent,
+                 power.power_mw,
+                 power.wake_us / 1000U,
+                 power.max_wake_us / 1000U,
+                 preview.last_us,
+                 preview.max_us,
+                 preview.last_percent,
+                 crop.last_us,
+                 crop.max_us,
+                 crop.bytes_saved,
+                 budget.captures ? 10U * budget.retries / budget.captures / 10U : 0,
+                 budget.captures ? 10U * budget.retries / budget.captures % 10U : 0,
+                 budget.captures ? (uint32_t) (budget.quality_sum / budget.captures) : 0,
+                 budget.misses,
+                 overlay.last_us,
+                 overlay.max_us,
+                 overlay.refused);
+
+  if (len < 0 || (size_t) len >= info->len)
+  {
+    info->buf[0] = '\0';
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
 static int CAM_SERVICE_recv_msg(uint8_t cmd, void* arg)
 {
-  (void) arg;
+  uint32_t full = 0;
 
   switch (cmd)
   {
     case (CAM_SERVICE_CMD_CAPTURE_SEND_IMAGE):
-      return CAM_SERVICE_send_camera_capture();
+      return CAM_SERVICE_locked(CAM_SERVICE_send_camera_capture, NULL);
+    case (CAM_SERVICE_CMD_GET_MOTION):
+      return CAM_SERVICE_get_motion((uint8_t *) arg);
+    case (CAM_SERVICE_CMD_GET_INFO):
+      return CAM_SERVICE_get_info((cam_service_info_t *) arg);
+    case (CAM_SERVICE_CMD_BURST_UPLOAD):
+      CAM_POWER_demand();
+      return CAM_HISTORY_trigger();
+    case (CAM_SERVICE_CMD_SET_FRAME_SIZE):
+      return CAM_SERVICE_locked(CAM_SERVICE_set_frame_size, (uint32_t *) arg);
+    case (CAM_SERVICE_CMD_SET_QUALITY):
+      return CAM_SERVICE_locked(CAM_SERVICE_set_quality, (uint32_t *) arg);
+    case (CAM_SERVICE_CMD_SET_XCLK):
+      return CAM_SERVICE_locked(CAM_SERVICE_set_xclk, (uint32_t *) arg);
+    case (CAM_SERVICE_CMD_SET_FB_COUNT):
+      return CAM_SERVICE_locked(CAM_SERVICE_set_fb_count, (uint32_t *) arg);
+    case (CAM_SERVICE_CMD_PUBLISH_LATENCY):
+      return CAM_SERVICE_publish_latency((uint32_t *) arg);
+    case (CAM_SERVICE_CMD_BURST_CAPTURE):
+      CAM_POWER_demand();
+      return CAM_HISTORY_capture(arg ? *(uint32_t *) arg : 0);
+    case (CAM_SERVICE_CMD_SET_STILL_SIZE):
+      return CAM_SERVICE_locked(CAM_SERVICE_set_still_frame_size, (uint32_t *) arg);
+    case (CAM_SERVICE_CMD_SEND_FULL_IMAGE):
+      full = 1;
+      return CAM_SERVICE_locked(CAM_SERVICE_send_camera_capture, &full);
   }
 
   return EXIT_FAILURE;
@@ -0,0 +1,1059 @@
+/*
+* @file camera_stream.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_stream.h"
+#include "camera_service.h"
+#include "camera_rate_control.h"
+#include "camera_latency.h"
+#include "camera_power.h"
+#include "camera_meta.h"
+
+#include "fsu_http_server_config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "event_groups.h"
+#include "platform/iot_threads.h"
+
+#include "lwip/sockets.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define LOG_TAG                         "CAMERA STREAM"
+
+#define CAM_STREAM_TASK_PRIORITY        (tskIDLE_PRIORITY + 5U)
+#define CAM_STREAM_STACKSIZE            (0x1000U)
+#define CAM_STREAM_STOP_POLL_MS         (50U)
+
+// Client slots of each sender worker, the total is still capped by the config
+#define CAM_STREAM_WORKER_CLIENTS       ((FSU_HTTP_SERVER_MAX_STREAM_CLIENTS + FSU_HTTP_SERVER_STREAM_WORKERS - 1U) \
+                                         / FSU_HTTP_SERVER_STREAM_WORKERS)
+#define CAM_STREAM_WORKER_BITS          ((1U << FSU_HTTP_SERVER_STREAM_WORKERS) - 1U)
+
+// Time to wait for a new frame, or for a worker with nothing to send to be woken
+#define CAM_STREAM_FRAME_WAIT_MS        (100U)
+// Time to wait for a busy client socket to drain
+#define CAM_STREAM_SELECT_TIMEOUT_MS    (10U)
+
+#define CAM_STREAM_STATS_LOG_US         (10000000LL)
+
+#define CAM_STREAM_PART_HEADER_LEN      (64U)
+
+// Websocket messages are a single unmasked binary frame, RFC 6455, carrying
+// the frame sequence number ahead of the JPEG. Acks carry it back.
+#define CAM_STREAM_WS_FIN               (0x80U)
+#define CAM_STREAM_WS_OPCODE_BINARY     (0x02U)
+#define CAM_STREAM_WS_OPCODE_PONG       (0x0AU)
+#define CAM_STREAM_WS_SEQ_LEN           (4U)
+#define CAM_STREAM_WS_ACK_LEN           (16U)
+// Largest payload of a control frame
+#define CAM_STREAM_WS_CONTROL_LEN       (125U)
+
+#define CAM_STREAM_WS_ACK_TIMEOUT_US    (FSU_HTTP_SERVER_WS_ACK_TIMEOUT_MS * 1000LL)
+
+/**
+ *  The multipart framing has been taken from random nerd tutorials, with below original copyright notice:
+ *
+ *  Rui Santos
+ *  Complete project details at https://RandomNerdTutorials.com/esp32-cam-video-streaming-web-server-camera-home-assistant/
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files.
+ *
+**/
+#define PART_BOUNDARY "123456789000000000000987654321"
+
+static const char* _STREAM_RESPONSE = "HTTP/1.1 200 OK\r\n"
+                                      "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+                                      "Cache-Control: no-cache\r\n"
+                                      "\r\n";
+static const char* _STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
+static const char* _STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+
+typedef enum {
+  cam_stream_client_free,
+  cam_stream_client_opening,  // Slot reserved, response header being sent
+  cam_stream_client_streaming,
+  cam_stream_client_closing   // Connection broke, waiting for the server to close it
+} cam_stream_client_state_t;
+
+typedef enum {
+  cam_stream_client_multipart,
+  cam_stream_client_websocket
+} cam_stream_client_kind_t;
+
+typedef enum {
+  cam_stream_segment_control,   // A pong owed to a websocket client, sent ahead of the next message
+  cam_stream_segment_part,
+  cam_stream_segment_meta,
+  cam_stream_segment_payload,
+  cam_stream_segment_boundary,
+  cam_stream_segment_count
+} cam_stream_segment_t;
+
+/*
+* @brief A stream viewer. Each client has its own send cursor into the frame it
+* is currently sending, a slow client skips frames instead of holding back the
+* others.
+*/
+typedef struct cam_stream_client {
+  cam_stream_client_state_t state;
+  cam_stream_client_kind_t kind;
+  int fd;
+  cam_frame_t *frame;     // Frame being sent, NULL while waiting for a new one
+  uint32_t seq;           // Sequence number of the last frame started
+  int64_t started_at;     // When the last frame was started
+  int64_t first_sent;     // When the first byte of the current frame went out, 0 before
+  uint8_t segment;
+  size_t offset;
+  char part[CAM_STREAM_PART_HEADER_LEN];
+  size_t part_len;
+  uint8_t meta[CAM_META_PREFIX_SIZE];   // Start of the frame with its metadata, sent in place of the first skip bytes
+  size_t meta_len;
+  size_t skip;
+  uint32_t frames_sent;
+  uint32_t frames_skipped;
+  struct {
+    uint32_t seq;
+    int64_t timestamp;
+  } window[FSU_HTTP_SERVER_WS_WINDOW];  // Frames sent to a websocket client and not acked yet, oldest first
+  uint8_t unacked;
+  uint8_t control[2 + CAM_STREAM_WS_CONTROL_LEN];
+  size_t control_len;
+} cam_stream_client_t;
+
+/*
+* @brief A sender task with the clients it serves. A client stays with the
+* worker it was assigned to on connect, so a worker only ever locks its own
+* clients and workers send in parallel.
+*/
+typedef struct cam_stream_worker {
+  cam_stream_client_t clients[CAM_STREAM_WORKER_CLIENTS];
+  cam_stream_worker_stats_t stats;
+  SemaphoreHandle_t mutex;    // Guards the clients and stats of the worker
+  volatile uint8_t active;
+} cam_stream_worker_t;
+
+static cam_stream_worker_t _workers[FSU_HTTP_SERVER_STREAM_WORKERS];
+static cam_frame_t *_latest = NULL;
+static uint8_t _latest_meta[CAM_META_PREFIX_SIZE];
+static size_t _latest_meta_len = 0;
+static size_t _latest_skip = 0;
+
+static cam_stream_stats_t _logged;
+static int64_t _stats_logged_at = 0;
+
+static httpd_handle_t _server;
+static SemaphoreHandle_t _hub_mutex;    // Guards the latest frame
+static EventGroupHandle_t _hub_events;  // One bit per worker, set when it may have a frame to start
+
+static volatile uint8_t _hub_running = 0;
+static volatile uint8_t _hub_active = 0;
+static uint8_t _initialized = 0;
+
+// Must be called with the worker mutex held
+static void CAM_STREAM_reset_client(cam_stream_client_t *client, cam_frame_t **frame)
+{
+  *frame = client->frame;
+  memset(client, 0, sizeof(cam_stream_client_t));
+  client->fd = -1;
+  client->state = cam_stream_client_free;
+}
+
+// Must be called with the worker mutex held. Stops sending to the client, the
+// slot is freed once the server closes the socket.
+static void CAM_STREAM_drop_client(cam_stream_client_t *client)
+{
+  client->state = cam_stream_client_closing;
+  CAM_SERVICE_frame_release(client->frame);
+  client->frame = NULL;
+  httpd_sess_trigger_close(_server, client->fd);
+}
+
+// Must be called with the worker mutex held. Drops the websocket clients whose
+// oldest unacked frame has been out for too long, they would hold their slot
+// for good.
+static void CAM_STREAM_check_acks(cam_stream_worker_t *worker)
+{
+  cam_stream_client_t *client = NULL;
+  int64_t now = esp_timer_get_time();
+
+  for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+  {
+    client = &worker->clients[i];
+
+    if (cam_stream_client_streaming == client->state
+      && client->unacked
+      && now - client->window[0].timestamp > CAM_STREAM_WS_ACK_TIMEOUT_US)
+    {
+      ESP_LOGI(LOG_TAG, "Stream client on socket %d stopped acking frames\n", client->fd);
+      CAM_STREAM_drop_client(client);
+    }
+  }
+}
+
+// Builds the websocket frame header of a message carrying the frame as image_len bytes
+static size_t CAM_STREAM_ws_header(uint8_t *header, const cam_frame_t *frame, size_t image_len)
+{
+  uint64_t payload = CAM_STREAM_WS_SEQ_LEN + image_len;
+  size_t len = 0;
+
+  header[len++] = CAM_STREAM_WS_FIN | CAM_STREAM_WS_OPCODE_BINARY;
+  if (payload < 126U)
+  {
+    header[len++] = payload;
+  }
+  else if (payload <= 0xFFFFU)
+  {
+    header[len++] = 126U;
+    header[len++] = payload >> 8;
+    header[len++] = payload;
+  }
+  else
+  {
+    header[len++] = 127U;
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+      header[len++] = payload >> shift;
+    }
+  }
+
+  header[len++] = frame->seq >> 24;
+  header[len++] = frame->seq >> 16;
+  header[len++] = frame->seq >> 8;
+  header[len++] = frame->seq;
+
+  return len;
+}
+
+// Must be called with the worker mutex held. Starts sending the newest frame
+// to every streaming client of the worker that has finished its previous one.
+// A websocket client only gets a new frame while it has fewer than the window
+// unacked.
+static void CAM_STREAM_start_parts(cam_stream_worker_t *worker)
+{
+  cam_stream_client_t *client = NULL;
+  int64_t now = esp_timer_get_time();
+  int64_t interval = CAM_RC_frame_interval_us();
+
+  xSemaphoreTake(_hub_mutex, portMAX_DELAY);
+
+  for (uint8_t i = 0; _latest && i < CAM_STREAM_WORKER_CLIENTS; ++i)
+  {
+    client = &worker->clients[i];
+
+    if (cam_stream_client_streaming != client->state
+      || client->frame
+      || client->seq >= _latest->seq
+      || now - client->started_at < interval
+      || client->unacked >= FSU_HTTP_SERVER_WS_WINDOW)
+    {
+      continue;
+    }
+
+    if (client->seq)
+    {
+      client->frames_skipped += _latest->seq - client->seq - 1;
+      worker->stats.frames_skipped += _latest->seq - client->seq - 1;
+    }
+
+    CAM_SERVICE_frame_retain(_latest);
+    client->frame = _latest;
+    client->seq = _latest->seq;
+    client->started_at = now;
+    client->first_sent = 0;
+    client->segment = cam_stream_segment_control;
+    client->offset = 0;
+    memcpy(client->meta, _latest_meta, _latest_meta_len);
+    client->meta_len = _latest_meta_len;
+    client->skip = _latest_skip;
+
+    if (cam_stream_client_websocket == client->kind)
+    {
+      client->part_len = CAM_STREAM_ws_header((uint8_t*) client->part, _latest, _latest_meta_len + _latest->len - _latest_skip);
+      client->window[client->unacked].seq = _latest->seq;
+      client->window[client->unacked].timestamp = _latest->timestamp;
+      client->unacked++;
+    }
+    else
+    {
+      client->part_len = snprintf(client->part, CAM_STREAM_PART_HEADER_LEN, _STREAM_PART, _latest_meta_len + _latest->len - _latest_skip);
+    }
+  }
+
+  xSemaphoreGive(_hub_mutex);
+}
+
+// Must be called with the worker mutex held
+static void CAM_STREAM_segment(cam_stream_client_t *client, uint8_t segment, const uint8_t **data, size_t *len)
+{
+  switch (segment)
+  {
+    case (cam_stream_segment_control):
+      *data = client->control;
+      *len = client->control_len;
+      break;
+
+    case (cam_stream_segment_part):
+      *data = (const uint8_t*) client->part;
+      *len = client->part_len;
+      break;
+
+    case (cam_stream_segment_meta):
+      *data = client->meta;
+      *len = client->meta_len;
+      break;
+
+    case (cam_stream_segment_payload):
+      *data = client->frame->buf + client->skip;
+      *len = client->frame->len - client->skip;
+      break;
+
+    default:
+      // A websocket message is complete with its payload
+      *data = (const uint8_t*) _STREAM_BOUNDARY;
+      *len = (cam_stream_client_websocket == client->kind) ? 0 : strlen(_STREAM_BOUNDARY);
+      break;
+  }
+}
+
+// Must be called with the worker mutex held. Writes what is left of the
+// current part, header, payload and boundary gathered into a single send, as
+// far as the socket accepts it without blocking.
+static int CAM_STREAM_send(cam_stream_worker_t *worker, cam_stream_client_t *client)
+{
+  struct iovec iov[cam_stream_segment_count];
+  struct msghdr msg;
+  const uint8_t *data = NULL;
+  size_t len = 0;
+  ssize_t sent = 0;
+  int iov_count = 0;
+  int64_t now = 0;
+
+  if (!client->frame)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  for (uint8_t segment = client->segment; segment < cam_stream_segment_count; ++segment)
+  {
+    CAM_STREAM_segment(client, segment, &data, &len);
+    iov[iov_count].iov_base = (void*) (data + (segment == client->segment ? client->offset : 0));
+    iov[iov_count].iov_len = len - (segment == client->segment ? client->offset : 0);
+    iov_count++;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iov_count;
+
+  now = esp_timer_get_time();
+  sent = sendmsg(client->fd, &msg, MSG_DONTWAIT);
+  worker->stats.send_calls++;
+  if (sent < 0)
+  {
+    return (EAGAIN == errno || EWOULDBLOCK == errno) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  worker->stats.bytes += sent;
+  if (sent > 0 && !client->first_sent)
+  {
+    client->first_sent = now;
+  }
+
+  // Advance the cursor over what the socket took, a partial write continues
+  // from there once the socket drains
+  while (client->segment < cam_stream_segment_count)
+  {
+    CAM_STREAM_segment(client, client->segment, &data, &len);
+    if ((size_t) sent < len - client->offset)
+    {
+      client->offset += sent;
+      return EXIT_SUCCESS;
+    }
+    sent -= len - client->offset;
+    client->offset = 0;
+    if (cam_stream_segment_control == client->segment)
+    {
+      client->control_len = 0;
+    }
+    client->segment++;
+  }
+
+  now = esp_timer_get_time();
+  CAM_LAT_record(cam_lat_stream, client->frame, client->first_sent, now);
+
+  // A websocket client reports its latency with the ack, once it has the frame
+  if (cam_stream_client_multipart == client->kind)
+  {
+    CAM_RC_report(now - client->frame->timestamp);
+  }
+
+  CAM_SERVICE_frame_release(client->frame);
+  client->frame = NULL;
+  client->frames_sent++;
+  worker->stats.frames++;
+
+  return EXIT_SUCCESS;
+}
+
+// Sums up the worker counters, takes each worker mutex in turn
+static void CAM_STREAM_collect_stats(cam_stream_stats_t *stats)
+{
+  cam_stream_worker_t *worker = NULL;
+
+  memset(stats, 0, sizeof(cam_stream_stats_t));
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    worker = &_workers[w];
+
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    memcpy(&stats->workers[w], &worker->stats, sizeof(cam_stream_worker_stats_t));
+    stats->workers[w].clients = 0;
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      stats->workers[w].clients += (cam_stream_client_streaming == worker->clients[i].state);
+    }
+    xSemaphoreGive(worker->mutex);
+
+    stats->frames += stats->workers[w].frames;
+    stats->frames_skipped += stats->workers[w].frames_skipped;
+    stats->bytes += stats->workers[w].bytes;
+    stats->send_calls += stats->workers[w].send_calls;
+    stats->acks += stats->workers[w].acks;
+    stats->clients += stats->workers[w].clients;
+  }
+}
+
+static void CAM_STREAM_log_stats()
+{
+  int64_t now = esp_timer_get_time();
+  int64_t elapsed = now - _stats_logged_at;
+  cam_stream_stats_t stats;
+  cam_stream_worker_stats_t *worker = NULL;
+  cam_rc_stats_t rc;
+
+  if (elapsed < CAM_STREAM_STATS_LOG_US)
+  {
+    return;
+  }
+
+  CAM_STREAM_collect_stats(&stats);
+
+  if (stats.frames != _logged.frames)
+  {
+    ESP_LOGI(LOG_TAG, "Stream: %u fps, %u bytes/s, %u.%02u sends per frame\n",
+             (uint32_t) ((stats.frames - _logged.frames) * 1000000LL / elapsed),
+             (uint32_t) ((stats.bytes - _logged.bytes) * 1000000LL / elapsed),
+             (stats.send_calls - _logged.send_calls) / (stats.frames - _logged.frames),
+             (100U * (stats.send_calls - _logged.send_calls) / (stats.frames - _logged.frames)) % 100U);
+
+    for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+    {
+      worker = &stats.workers[w];
+      ESP_LOGI(LOG_TAG, "Stream worker %u: %u clients, %u fps, %u bytes/s, queue depth %u (max %u)\n",
+               w, worker->clients,
+               (uint32_t) ((worker->frames - _logged.workers[w].frames) * 1000000LL / elapsed),
+               (uint32_t) ((worker->bytes - _logged.workers[w].bytes) * 1000000LL / elapsed),
+               worker->pending, worker->max_pending);
+    }
+
+    CAM_RC_get_stats(&rc);
+    ESP_LOGI(LOG_TAG, "Stream: %u ms latency (target %u ms), quality %u, frame size %u, interval %u ms\n",
+             rc.latency_ms, rc.target_ms, rc.quality, rc.frame_size, rc.frame_interval_ms);
+  }
+
+  memcpy(&_logged, &stats, sizeof(cam_stream_stats_t));
+  _stats_logged_at = now;
+}
+
+/*
+* @brief Sender task of a worker. Waits for its clients to be writable and
+* sends them their frames, or sleeps until the hub signals a new frame.
+*/
+static void CAM_STREAM_worker_runner(void *arg)
+{
+  cam_stream_worker_t *worker = (cam_stream_worker_t*) arg;
+  cam_stream_client_t *client = NULL;
+  EventBits_t bit = 1U << (worker - _workers);
+  uint8_t pending = 0;
+  int max_fd = -1;
+  fd_set write_fds;
+  struct timeval timeout;
+
+  worker->active = 1;
+
+  while (_hub_running)
+  {
+    pending = 0;
+    max_fd = -1;
+    FD_ZERO(&write_fds);
+
+    // Clear the doorbell first, a frame published from here on rings it again
+    xEventGroupClearBits(_hub_events, bit);
+
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    CAM_STREAM_check_acks(worker);
+    CAM_STREAM_start_parts(worker);
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      if (cam_stream_client_streaming == worker->clients[i].state && worker->clients[i].frame)
+      {
+        FD_SET(worker->clients[i].fd, &write_fds);
+        max_fd = (worker->clients[i].fd > max_fd) ? worker->clients[i].fd : max_fd;
+        pending++;
+      }
+    }
+    worker->stats.pending = pending;
+    worker->stats.max_pending = (pending > worker->stats.max_pending) ? pending : worker->stats.max_pending;
+    xSemaphoreGive(worker->mutex);
+
+    if (max_fd < 0)
+    {
+      xEventGroupWaitBits(_hub_events, bit, pdTRUE, pdFALSE, CAM_STREAM_FRAME_WAIT_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = CAM_STREAM_SELECT_TIMEOUT_MS * 1000U;
+    if (select(max_fd + 1, NULL, &write_fds, NULL, &timeout) <= 0)
+    {
+      continue;
+    }
+
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      client = &worker->clients[i];
+
+      if (cam_stream_client_streaming != client->state
+        || !client->frame
+        || !FD_ISSET(client->fd, &write_fds))
+      {
+        continue;
+      }
+
+      if (CAM_STREAM_send(worker, client) != EXIT_SUCCESS)
+      {
+        ESP_LOGI(LOG_TAG, "Stream client on socket %d disconnected\n", client->fd);
+        CAM_STREAM_drop_client(client);
+      }
+    }
+    xSemaphoreGive(worker->mutex);
+  }
+
+  worker->active = 0;
+}
+
+/*
+* @brief Hub task. Captures and converts each frame once and rings the workers,
+* which fan it out to their clients.
+*/
+static void CAM_STREAM_hub_runner(void *arg)
+{
+  cam_stream_stats_t stats;
+  cam_frame_t *frame = NULL;
+  cam_frame_t *jpeg = NULL;
+  cam_frame_t *previous = NULL;
+  uint32_t seq = 0;
+
+  (void) arg;
+
+  _hub_active = 1;
+
+  while (_hub_running)
+  {
+    CAM_STREAM_collect_stats(&stats);
+    CAM_RC_update(stats.clients);
+
+    // Nobody is watching, do not keep a frame from the driver
+    if (!stats.clients)
+    {
+      xSemaphoreTake(_hub_mutex, portMAX_DELAY);
+      previous = _latest;
+      _latest = NULL;
+      xSemaphoreGive(_hub_mutex);
+
+      CAM_SERVICE_frame_release(previous);
+      vTaskDelay(CAM_STREAM_FRAME_WAIT_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    CAM_POWER_demand();
+    frame = CAM_SERVICE_frame_acquire(seq, CAM_STREAM_FRAME_WAIT_MS / portTICK_PERIOD_MS);
+    seq = frame ? frame->seq : seq;
+
+    // During a still the viewers keep the last stream frame
+    if (frame && !CAM_SERVICE_is_stream_frame(frame))
+    {
+      CAM_SERVICE_frame_release(frame);
+      continue;
+    }
+
+    if (frame)
+    {
+      jpeg = CAM_SERVICE_frame_to_jpeg(frame);
+      CAM_SERVICE_frame_release(frame);
+
+      if (jpeg)
+      {
+        xSemaphoreTake(_hub_mutex, portMAX_DELAY);
+        previous = _latest;
+        _latest = jpeg;
+        // Built once per frame, the workers copy it for each viewer
+        _latest_meta_len = CAM_META_prefix(jpeg, _latest_meta, sizeof(_latest_meta), &_latest_skip);
+        _latest_skip = _latest_meta_len ? _latest_skip : 0;
+        xSemaphoreGive(_hub_mutex);
+
+        CAM_SERVICE_frame_release(previous);
+        xEventGroupSetBits(_hub_events, CAM_STREAM_WORKER_BITS);
+      }
+    }
+
+    CAM_STREAM_log_stats();
+  }
+
+  _hub_active = 0;
+}
+
+// Finds the client on a socket and takes the mutex of its worker, which the
+// caller has to give back
+static cam_stream_client_t* CAM_STREAM_find_client(int fd, cam_stream_worker_t **owner)
+{
+  cam_stream_worker_t *worker = NULL;
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    worker = &_workers[w];
+
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      if (cam_stream_client_free != worker->clients[i].state && worker->clients[i].fd == fd)
+      {
+        *owner = worker;
+        return &worker->clients[i];
+      }
+    }
+    xSemaphoreGive(worker->mutex);
+  }
+  return NULL;
+}
+
+// Reserves a slot with the least loaded worker, holding every worker mutex so
+// the total stays within the configured number of clients
+static cam_stream_client_t* CAM_STREAM_reserve_client(int fd, cam_stream_client_kind_t kind, cam_stream_worker_t **owner)
+{
+  cam_stream_client_t *client = NULL;
+  cam_stream_client_t *candidate = NULL;
+  uint8_t used[FSU_HTTP_SERVER_STREAM_WORKERS] = {0};
+  uint8_t total = 0;
+  int best = -1;
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    xSemaphoreTake(_workers[w].mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      used[w] += (cam_stream_client_free != _workers[w].clients[i].state);
+    }
+    total += used[w];
+    if (used[w] < CAM_STREAM_WORKER_CLIENTS && (best < 0 || used[w] < used[best]))
+    {
+      best = w;
+    }
+  }
+
+  if (best >= 0 && total < FSU_HTTP_SERVER_MAX_STREAM_CLIENTS)
+  {
+    for (uint8_t i = 0; !client && i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      candidate = &_workers[best].clients[i];
+      if (cam_stream_client_free == candidate->state)
+      {
+        client = candidate;
+        client->state = cam_stream_client_opening;
+        client->kind = kind;
+        client->fd = fd;
+        *owner = &_workers[best];
+      }
+    }
+  }
+
+  for (int w = FSU_HTTP_SERVER_STREAM_WORKERS - 1; w >= 0; --w)
+  {
+    xSemaphoreGive(_workers[w].mutex);
+  }
+
+  return client;
+}
+
+// Registers a new client with the hub
+static esp_err_t CAM_STREAM_open_client(httpd_req_t *req, cam_stream_client_kind_t kind)
+{
+  cam_stream_worker_t *worker = NULL;
+  cam_stream_client_t *client = NULL;
+  cam_frame_t *frame = NULL;
+  int fd = httpd_req_to_sockfd(req);
+  int nodelay = 1;
+
+  if (!(client = CAM_STREAM_reserve_client(fd, kind, &worker)))
+  {
+    ESP_LOGI(LOG_TAG, "Stream client limit reached, rejecting socket %d\n", fd);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  // The response is not chunked, the stream lasts until the connection closes.
+  // A websocket client has had its handshake answered by the server already.
+  if (cam_stream_client_multipart == kind
+    && (httpd_send(req, _STREAM_RESPONSE, strlen(_STREAM_RESPONSE)) < 0
+      || httpd_send(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY)) < 0))
+  {
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    CAM_STREAM_reset_client(client, &frame);
+    xSemaphoreGive(worker->mutex);
+
+    return ESP_FAIL;
+  }
+
+  // Every part leaves in a single write, so Nagle would only hold back the
+  // tail of each frame until the previous segment is acked
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  xSemaphoreTake(worker->mutex, portMAX_DELAY);
+  client->state = cam_stream_client_streaming;
+  xSemaphoreGive(worker->mutex);
+
+  ESP_LOGI(LOG_TAG, "Stream client connected on socket %d to worker %u%s\n", fd,
+           (uint32_t) (worker - _workers), (cam_stream_client_websocket == kind) ? " over websocket" : "");
+
+  return ESP_OK;
+}
+
+esp_err_t CAM_STREAM_http_handler(httpd_req_t *req)
+{
+  if (!_initialized)
+  {
+    return ESP_FAIL;
+  }
+
+  return CAM_STREAM_open_client(req, cam_stream_client_multipart);
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+// Acks are cumulative, every frame up to and including seq has been received
+static void CAM_STREAM_ack(int fd, uint32_t seq)
+{
+  cam_stream_worker_t *worker = NULL;
+  cam_stream_client_t *client = CAM_STREAM_find_client(fd, &worker);
+  int64_t latency = -1;
+  uint8_t acked = 0;
+
+  if (!client)
+  {
+    return;
+  }
+
+  if (cam_stream_client_websocket == client->kind)
+  {
+    while (acked < client->unacked && client->window[acked].seq <= seq)
+    {
+      latency = esp_timer_get_time() - client->window[acked].timestamp;
+      acked++;
+    }
+    client->unacked -= acked;
+    memmove(&client->window[0], &client->window[acked], client->unacked * sizeof(client->window[0]));
+    worker->stats.acks++;
+  }
+  xSemaphoreGive(worker->mutex);
+
+  if (latency >= 0)
+  {
+    CAM_RC_report(latency);
+  }
+
+  // The window may have opened, let the worker start the next frame
+  xEventGroupSetBits(_hub_events, 1U << (worker - _workers));
+}
+
+// Answers a ping. A worker may be in the middle of a message on the socket,
+// the pong then goes out ahead of the next one.
+static esp_err_t CAM_STREAM_pong(httpd_req_t *req, const uint8_t *payload, size_t len)
+{
+  cam_stream_worker_t *worker = NULL;
+  cam_stream_client_t *client = CAM_STREAM_find_client(httpd_req_to_sockfd(req), &worker);
+  httpd_ws_frame_t pong;
+  esp_err_t err = ESP_OK;
+
+  if (!client)
+  {
+    return ESP_FAIL;
+  }
+
+  // The worker mutex is held, no worker writes to the socket meanwhile
+  if (!client->frame)
+  {
+    client->control_len = 0;
+    memset(&pong, 0, sizeof(pong));
+    pong.type = HTTPD_WS_TYPE_PONG;
+    pong.payload = (uint8_t*) payload;
+    pong.len = len;
+    err = httpd_ws_send_frame(req, &pong);
+  }
+  // Only the latest ping needs an answer, one still waiting is replaced unless
+  // it is partly sent already
+  else if (cam_stream_segment_control != client->segment || !client->offset)
+  {
+    client->control[0] = CAM_STREAM_WS_FIN | CAM_STREAM_WS_OPCODE_PONG;
+    client->control[1] = len;
+    memcpy(&client->control[2], payload, len);
+    client->control_len = 2 + len;
+  }
+  xSemaphoreGive(worker->mutex);
+
+  return err;
+}
+
+esp_err_t CAM_STREAM_ws_handler(httpd_req_t *req)
+{
+  httpd_ws_frame_t ws;
+  uint8_t payload[CAM_STREAM_WS_CONTROL_LEN + 1];
+  uint32_t seq = 0;
+
+  if (!_initialized)
+  {
+    return ESP_FAIL;
+  }
+
+  // Called once for the handshake, then for every message from the client
+  if (HTTP_GET == req->method)
+  {
+    return CAM_STREAM_open_client(req, cam_stream_client_websocket);
+  }
+
+  memset(&ws, 0, sizeof(ws));
+  if (httpd_ws_recv_frame(req, &ws, 0) != ESP_OK
+    || ws.len > ((HTTPD_WS_TYPE_PING == ws.type) ? CAM_STREAM_WS_CONTROL_LEN : CAM_STREAM_WS_ACK_LEN))
+  {
+    return ESP_FAIL;
+  }
+
+  ws.payload = payload;
+  if (httpd_ws_recv_frame(req, &ws, CAM_STREAM_WS_CONTROL_LEN) != ESP_OK)
+  {
+    return ESP_FAIL;
+  }
+
+  // Control frames are handed over as the socket is shared with a worker, a
+  // close ends the session without a close frame back
+  if (HTTPD_WS_TYPE_PING == ws.type)
+  {
+    return CAM_STREAM_pong(req, payload, ws.len);
+  }
+  else if (HTTPD_WS_TYPE_CLOSE == ws.type)
+  {
+    return ESP_FAIL;
+  }
+
+  // Acks are either the sequence number as received or in decimal text
+  if (HTTPD_WS_TYPE_BINARY == ws.type && CAM_STREAM_WS_SEQ_LEN == ws.len)
+  {
+    seq = ((uint32_t) payload[0] << 24) | ((uint32_t) payload[1] << 16) | ((uint32_t) payload[2] << 8) | payload[3];
+  }
+  else if (HTTPD_WS_TYPE_TEXT == ws.type)
+  {
+    payload[ws.len] = '\0';
+    seq = strtoul((const char*) payload, NULL, 10);
+  }
+  else
+  {
+    return ESP_OK;
+  }
+
+  CAM_STREAM_ack(httpd_req_to_sockfd(req), seq);
+
+  return ESP_OK;
+}
+#endif /* CONFIG_HTTPD_WS_SUPPORT */
+
+void CAM_STREAM_close_fn(httpd_handle_t server, int sockfd)
+{
+  cam_stream_worker_t *worker = NULL;
+  cam_stream_client_t *client = NULL;
+  cam_frame_t *frame = NULL;
+
+  (void) server;
+
+  // The mutexes outlive a deinit, so this is safe once they exist
+  if (_hub_mutex && (client = CAM_STREAM_find_client(sockfd, &worker)))
+  {
+    CAM_STREAM_reset_client(client, &frame);
+    xSemaphoreGive(worker->mutex);
+
+    CAM_SERVICE_frame_release(frame);
+  }
+
+  close(sockfd);
+}
+
+// Stops the hub and every worker that was started
+static void CAM_STREAM_stop_tasks()
+{
+  _hub_running = 0;
+  while (_hub_active)
+  {
+    vTaskDelay(CAM_STREAM_STOP_POLL_MS / portTICK_PERIOD_MS);
+  }
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    xEventGroupSetBits(_hub_events, CAM_STREAM_WORKER_BITS);
+    while (_workers[w].active)
+    {
+      vTaskDelay(CAM_STREAM_STOP_POLL_MS / portTICK_PERIOD_MS);
+    }
+  }
+}
+
+int CAM_STREAM_init(httpd_handle_t server)
+{
+  if (_initialized)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  _server = server;
+  _latest = NULL;
+
+  // The mutexes outlive a deinit, the server may still close sockets after it
+  if (!_hub_mutex)
+  {
+    for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+    {
+      _workers[w].mutex = xSemaphoreCreateMutex();
+    }
+    _hub_events = xEventGroupCreate();
+    _hub_mutex = xSemaphoreCreateMutex();
+  }
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    memset(_workers[w].clients, 0, sizeof(_workers[w].clients));
+    memset(&_workers[w].stats, 0, sizeof(_workers[w].stats));
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      _workers[w].clients[i].fd = -1;
+    }
+  }
+  memset(&_logged, 0, sizeof(_logged));
+  _stats_logged_at = esp_timer_get_time();
+
+  _hub_running = 1;
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    // Flag the worker up front, so a stop waits for it even before it ran
+    _workers[w].active = 1;
+    if (!Iot_CreateDetachedThread(CAM_STREAM_worker_runner,
+                                  &_workers[w],
+                                  CAM_STREAM_TASK_PRIORITY,
+                                  CAM_STREAM_STACKSIZE))
+    {
+      ESP_LOGI(LOG_TAG, "Could not create stream worker task %u\n", w);
+      _workers[w].active = 0;
+      CAM_STREAM_stop_tasks();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!Iot_CreateDetachedThread(CAM_STREAM_hub_runner,
+                                NULL,
+                                CAM_STREAM_TASK_PRIORITY,
+                                CAM_STREAM_STACKSIZE))
+  {
+    ESP_LOGI(LOG_TAG, "Could not create stream hub task\n");
+    CAM_STREAM_stop_tasks();
+    return EXIT_FAILURE;
+  }
+
+  _initialized = 1;
+
+  return EXIT_SUCCESS;
+}
+
+void CAM_STREAM_deinit()
+{
+  cam_stream_worker_t *worker = NULL;
+  cam_frame_t *frame = NULL;
+
+  if (!_initialized)
+  {
+    return;
+  }
+
+  _initialized = 0;
+  CAM_STREAM_stop_tasks();
+
+  for (uint8_t w = 0; w < FSU_HTTP_SERVER_STREAM_WORKERS; ++w)
+  {
+    worker = &_workers[w];
+
+    xSemaphoreTake(worker->mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < CAM_STREAM_WORKER_CLIENTS; ++i)
+    {
+      // Free slots stay free, the server has no socket to close for them
+      if (cam_stream_client_free != worker->clients[i].state)
+      {
+        CAM_STREAM_drop_client(&worker->clients[i]);
+      }
+    }
+    xSemaphoreGive(worker->mutex);
+  }
+
+  xSemaphoreTake(_hub_mutex, portMAX_DELAY);
+  frame = _latest;
+  _latest = NULL;
+  xSemaphoreGive(_hub_mutex);
+
+  CAM_SERVICE_frame_release(frame);
+}
+
+void CAM_STREAM_get_stats(cam_stream_stats_t *stats)
+{
+  if (!_initialized || NULL == stats)
+  {
+    return;
+  }
+
+  CAM_STREAM_collect_stats(stats);
+}
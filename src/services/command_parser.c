@@ -63,6 +63,15 @@
 #define COMMAND_MESSAGE_KVS_VALUE_FIELD "kvs value"
 /* End KVS Command*/
 
+/* Camera Command Defines */
+/**
+ * Camera commands that change a setting add the new value as an extra field
+**/
+#define COMMAND_MESSAGE_TOKENS_VALUE    (9U)
+#define COMMAND_VALUE_TOKEN_OFFSET      (7U)
+#define COMMAND_MESSAGE_VALUE_FIELD     "value"
+/* End Camera Command*/
+
 #define EYE_SUBSCRIBE_MAX_TOKENS      (0x10U)
 
 #define LOG_TAG     "COMMAND PARSER"
@@ -79,6 +88,22 @@ static int _jsoneq(const char *json, jsmntok_t *tok, const char *s)
   return false;
 }
 
+// Parses a token holding a plain decimal number, as a JSON number or a string
+static int _jsonuint(const char *json, jsmntok_t *tok, uint32_t *value)
+{
+  char *end = NULL;
+
+  if ((JSMN_PRIMITIVE != tok->type && JSMN_STRING != tok->type)
+    || tok->end <= tok->start
+    || json[tok->start] < '0' || json[tok->start] > '9')
+  {
+    return false;
+  }
+
+  *value = strtoul(json + tok->start, &end, 10);
+  return end == json + tok->end;
+}
+
 int CP_parse_upstream_json(cp_fsu_service_argument_t *arg, const char *json, size_t json_len)
 {
   jsmn_parser parser;
@@ -95,6 +120,7 @@ int CP_parse_upstream_json(cp_fsu_service_argument_t *arg, const char *json, siz
   }
 
   if (COMMAND_MESSAGE_TOKENS_NO_ARG != parsed_tokens
+      && COMMAND_MESSAGE_TOKENS_VALUE != parsed_tokens
       && COMMAND_MESSAGE_TOKENS_KVS != parsed_tokens)
   {
     ESP_LOGW(LOG_TAG, "MQTT subscribe invalid command message, found %d tokens.", parsed_tokens);
@@ -121,9 +147,18 @@ int CP_parse_upstream_json(cp_fsu_service_argument_t *arg, const char *json, siz
     }
     arg->sid = service;
 
-    // Command
-    command = strtoul(&payload[tokens[COMMAND_CMD_TOKEN_OFFSET + 1].start], NULL, 10);
-    if (0 == command)
+    // The extra fields depend on the service, the tokens they are read from
+    // are only written by the parser if the message has them
+    if ((sc_service_kvs == arg->sid && COMMAND_MESSAGE_TOKENS_KVS != parsed_tokens)
+      || (sc_service_kvs != arg->sid && COMMAND_MESSAGE_TOKENS_KVS == parsed_tokens)
+      || (sc_service_camera != arg->sid && COMMAND_MESSAGE_TOKENS_VALUE == parsed_tokens))
+    {
+      ESP_LOGW(LOG_TAG, "MQTT subscribe %d tokens do not match service %d.", parsed_tokens, service);
+      return EXIT_FAILURE;
+    }
+
+    // Command, 0 is a valid command on several services
+    if (!_jsonuint(payload, &tokens[COMMAND_CMD_TOKEN_OFFSET + 1], &command))
     {
       ESP_LOGW(LOG_TAG, "MQTT subscribe invalid command received on commange message.");
       return EXIT_FAILURE;
@@ -149,12 +184,32 @@ int CP_parse_upstream_json(cp_fsu_service_argument_t *arg, const char *json, siz
         return EXIT_FAILURE;
       }
 
-      // KVS Value
+      // KVS Value, with room left for the terminator
+      if (tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].end - tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].start >= KVS_SERVICE_MAXIMUM_VALUE_SIZE)
+      {
+        ESP_LOGW(LOG_TAG, "MQTT subscribe KVS value too long on commange message.");
+        return EXIT_FAILURE;
+      }
       memcpy(arg->as.kvs.value, payload + tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].start, tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].end - tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].start);
       arg->as.kvs.value_len = (tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].end - tokens[COMMAND_KVS_VALUE_TOKEN_OFFSET + 1].start);
     }
   }
 
+  // If camera, pick up the value of setting commands
+  if (sc_service_camera == arg->sid)
+  {
+    arg->as.value = 0;
+    if (COMMAND_MESSAGE_TOKENS_VALUE == parsed_tokens)
+    {
+      if (!_jsoneq(payload, &tokens[COMMAND_VALUE_TOKEN_OFFSET], COMMAND_MESSAGE_VALUE_FIELD)
+        || !_jsonuint(payload, &tokens[COMMAND_VALUE_TOKEN_OFFSET + 1], &arg->as.value))
+      {
+        ESP_LOGW(LOG_TAG, "MQTT subscribe invalid value field received on commange message.");
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
   if (service >= sc_service_count)
   {
     ESP_LOGW(LOG_TAG, "MQTT subscribe received unknown service id %d, discarding", service);
@@ -43,7 +43,7 @@
 
 #define KVS_NAMESPACE             "KVS"
 
-#define KVS_MAX_CHARS_IN_ENTRIES  (1U)
+#define KVS_MAX_CHARS_IN_ENTRIES  (2U)
 
 /*
 * @brief Dictionary of what types the KVS entries has to be validated as,
@@ -53,7 +53,28 @@ static char kvs_entry_type_dict[kvs_entry_count] = {
   's',    // WiFi SSID: String
   's',    // WiFi Password: String
   'u',    // Image Report Interval: Unsigned 64-bit int
-  'u'     // Info Report Interval: Unsigned 64-bit int
+  'u',    // Info Report Interval: Unsigned 64-bit int
+  'u',    // Stream Target Latency: Unsigned 64-bit int
+  'u',    // Motion Sensitivity: Unsigned 64-bit int
+  'u',    // Heartbeat Interval: Unsigned 64-bit int
+  'u',    // Duplicate Distance: Unsigned 64-bit int
+  'u',    // Duplicate Refresh: Unsigned 64-bit int
+  'u',    // History Seconds: Unsigned 64-bit int
+  'u',    // History FPS: Unsigned 64-bit int
+  'u',    // Burst Post Frames: Unsigned 64-bit int
+  'u',    // Camera Frame Size: Unsigned 64-bit int
+  'u',    // Camera Quality: Unsigned 64-bit int
+  'u',    // Camera XCLK: Unsigned 64-bit int
+  'u',    // Camera Frame Buffers: Unsigned 64-bit int
+  'u',    // Camera Still Frame Size: Unsigned 64-bit int
+  'u',    // Fresh Capture: Unsigned 64-bit int
+  'u',    // Capture Settle Frames: Unsigned 64-bit int
+  'u',    // Sensor Idle Seconds: Unsigned 64-bit int
+  'u',    // Preview Scale: Unsigned 64-bit int
+  's',    // Crop Region: String
+  'u',    // Image Size Budget: Unsigned 64-bit int
+  's',    // Privacy Masks: String
+  'u'     // Timestamp Overlay: Unsigned 64-bit int
 };
 
 static uint8_t _initialized = 0;
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# Writes test_images.h, the baseline JPEGs the host tests scan. Needs Pillow.
+#
+# Every 8x8 block is a flat grey of a known level, see test_level() in
+# test_camera_jpeg.c, so block means can be checked after decoding.
+
+import io
+from PIL import Image
+
+WIDTH = 64
+HEIGHT = 48
+
+
+def level(bx, by):
+    return 24 + 8 * ((bx * 3 + by * 5) % 25)
+
+
+def image(mode):
+    im = Image.new(mode, (WIDTH, HEIGHT))
+    for y in range(HEIGHT):
+        for x in range(WIDTH):
+            v = level(x // 8, y // 8)
+            im.putpixel((x, y), v if mode == 'L' else (v, v, v))
+    return im
+
+
+def encode(im, **options):
+    out = io.BytesIO()
+    im.save(out, 'JPEG', quality=90, **options)
+    return out.getvalue()
+
+
+def array(name, data):
+    lines = ['static const uint8_t %s[] = {' % name]
+    for i in range(0, len(data), 16):
+        lines.append('  ' + ', '.join('0x%02X' % b for b in data[i:i + 16]) + ',')
+    lines.append('};')
+    return '\n'.join(lines)
+
+
+def main():
+    rgb = image('RGB')
+    images = [
+        ('_jpeg_420', encode(rgb, subsampling=2)),
+        ('_jpeg_422', encode(rgb, subsampling=1)),
+        ('_jpeg_444', encode(rgb, subsampling=0)),
+        ('_jpeg_grey', encode(image('L'))),
+        ('_jpeg_420_dri', encode(rgb, subsampling=2, restart_marker_blocks=3)),
+        ('_jpeg_progressive', encode(rgb, subsampling=2, progressive=True)),
+    ]
+
+    with open('test_images.h', 'w') as f:
+        f.write('// Generated by gen_test_images.py, do not edit\n\n')
+        f.write('#ifndef TEST_IMAGES__H\n#define TEST_IMAGES__H\n\n#include <stdint.h>\n\n')
+        f.write('#define TEST_IMAGE_WIDTH   (%uU)\n#define TEST_IMAGE_HEIGHT  (%uU)\n\n' % (WIDTH, HEIGHT))
+        for name, data in images:
+            f.write(array(name, data) + '\n\n')
+        f.write('#endif /* ifndef TEST_IMAGES__H */\n')
+
+
+if __name__ == '__main__':
+    main()
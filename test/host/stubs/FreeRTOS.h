@@ -0,0 +1,17 @@
+// Just enough of FreeRTOS for the services under test, which run single
+// threaded on the host
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE              (1)
+#define pdFALSE             (0)
+#define portMAX_DELAY       (0xFFFFFFFFU)
+#define portTICK_PERIOD_MS  (1U)
+
+#endif /* ifndef FREERTOS_H */
@@ -0,0 +1,10 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, ...)  do { printf("E %s: ", tag); printf(__VA_ARGS__); } while (0)
+#define ESP_LOGW(tag, ...)  do { printf("W %s: ", tag); printf(__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, ...)  do { printf("I %s: ", tag); printf(__VA_ARGS__); } while (0)
+
+#endif /* ifndef ESP_LOG_H */
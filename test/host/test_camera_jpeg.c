@@ -0,0 +1,391 @@
+/*
+* @file test_camera_jpeg.c
+*
+* The MIT License (MIT)
+*
+* Copyright (c) 2021 Fredrik Danebjer
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "camera_jpeg.h"
+#include "test_images.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_BLOCKS_X       (TEST_IMAGE_WIDTH / 8U)
+#define TEST_BLOCKS_Y       (TEST_IMAGE_HEIGHT / 8U)
+// Quantization moves a flat block mean by a level or two
+#define TEST_TOLERANCE      (3)
+#define TEST_BUFFER_SIZE    (4096U)
+
+typedef struct test_image {
+  const char *name;
+  const uint8_t *buf;
+  size_t len;
+  uint8_t components;
+  uint8_t h_max;
+  uint8_t v_max;
+  uint16_t restart_interval;
+} test_image_t;
+
+/*
+* @brief DC levels a scan reported, luma per block and the range of chroma.
+*/
+typedef struct test_levels {
+  int16_t luma[TEST_BLOCKS_Y][TEST_BLOCKS_X];
+  uint32_t blocks;
+  uint8_t chroma_min;
+  uint8_t chroma_max;
+} test_levels_t;
+
+static const test_image_t _images[] = {
+  { "4:2:0", _jpeg_420, sizeof(_jpeg_420), 3, 2, 2, 0 },
+  { "4:2:2", _jpeg_422, sizeof(_jpeg_422), 3, 2, 1, 0 },
+  { "4:4:4", _jpeg_444, sizeof(_jpeg_444), 3, 1, 1, 0 },
+  { "grey", _jpeg_grey, sizeof(_jpeg_grey), 1, 1, 1, 0 },
+  { "4:2:0 restarts", _jpeg_420_dri, sizeof(_jpeg_420_dri), 3, 2, 2, 3 },
+};
+
+static uint8_t _out[TEST_BUFFER_SIZE];
+static uint32_t _failures = 0;
+
+#define TEST_CHECK(cond, ...) \
+  do { \
+    if (!(cond)) \
+    { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      _failures++; \
+    } \
+  } while (0)
+
+// Level every 8x8 block of the test images was filled with
+static int16_t test_level(uint16_t bx, uint16_t by)
+{
+  return 24 + 8 * ((bx * 3 + by * 5) % 25);
+}
+
+static void test_dc_cb(void *arg, uint8_t component, uint16_t bx, uint16_t by, uint8_t value)
+{
+  test_levels_t *levels = (test_levels_t*) arg;
+
+  if (component)
+  {
+    levels->chroma_min = (value < levels->chroma_min) ? value : levels->chroma_min;
+    levels->chroma_max = (value > levels->chroma_max) ? value : levels->chroma_max;
+    return;
+  }
+
+  if (bx < TEST_BLOCKS_X && by < TEST_BLOCKS_Y)
+  {
+    levels->luma[by][bx] = value;
+  }
+  levels->blocks++;
+}
+
+static int test_scan_levels(const uint8_t *buf, size_t len, cam_jpeg_info_t *info, test_levels_t *levels)
+{
+  memset(levels, 0, sizeof(test_levels_t));
+  memset(levels->luma, 0xFF, sizeof(levels->luma));
+  levels->chroma_min = 255;
+
+  return CAM_JPEG_scan_dc(buf, len, info, test_dc_cb, levels);
+}
+
+static void test_parse()
+{
+  cam_jpeg_info_t info;
+
+  for (size_t i = 0; i < sizeof(_images) / sizeof(_images[0]); ++i)
+  {
+    const test_image_t *image = &_images[i];
+
+    TEST_CHECK(CAM_JPEG_parse(image->buf, image->len, &info) == EXIT_SUCCESS, "%s: parse", image->name);
+    TEST_CHECK(TEST_IMAGE_WIDTH == info.width && TEST_IMAGE_HEIGHT == info.height,
+               "%s: %ux%u", image->name, info.width, info.height);
+    TEST_CHECK(image->components == info.components, "%s: %u components", image->name, info.components);
+    TEST_CHECK(image->h_max == info.h_max && image->v_max == info.v_max,
+               "%s: sampling %ux%u", image->name, info.h_max, info.v_max);
+    TEST_CHECK(TEST_IMAGE_WIDTH / (8U * image->h_max) == info.mcus_x && TEST_IMAGE_HEIGHT / (8U * image->v_max) == info.mcus_y,
+               "%s: %ux%u MCUs", image->name, info.mcus_x, info.mcus_y);
+    TEST_CHECK(image->restart_interval == info.restart_interval, "%s: restart interval %u", image->name, info.restart_interval);
+    TEST_CHECK(info.header_len > 0 && info.header_len < image->len, "%s: header length %u", image->name, (uint32_t) info.header_len);
+  }
+
+  TEST_CHECK(CAM_JPEG_parse(_jpeg_progressive, sizeof(_jpeg_progressive), &info) == EXIT_FAILURE, "progressive is refused");
+}
+
+static void test_scan_dc()
+{
+  test_levels_t levels;
+
+  for (size_t i = 0; i < sizeof(_images) / sizeof(_images[0]); ++i)
+  {
+    const test_image_t *image = &_images[i];
+
+    TEST_CHECK(test_scan_levels(image->buf, image->len, NULL, &levels) == EXIT_SUCCESS, "%s: scan", image->name);
+    TEST_CHECK(TEST_BLOCKS_X * TEST_BLOCKS_Y == levels.blocks, "%s: %u luma blocks", image->name, levels.blocks);
+
+    for (uint16_t by = 0; by < TEST_BLOCKS_Y; ++by)
+    {
+      for (uint16_t bx = 0; bx < TEST_BLOCKS_X; ++bx)
+      {
+        TEST_CHECK(abs(levels.luma[by][bx] - test_level(bx, by)) <= TEST_TOLERANCE,
+                   "%s: block %u,%u is %d, not %d", image->name, bx, by, levels.luma[by][bx], test_level(bx, by));
+      }
+    }
+
+    // The images are grey, chroma stays neutral
+    TEST_CHECK(image->components == 1 || (levels.chroma_min >= 128 - TEST_TOLERANCE && levels.chroma_max <= 128 + TEST_TOLERANCE),
+               "%s: chroma %u-%u", image->name, levels.chroma_min, levels.chroma_max);
+  }
+}
+
+static void test_scaled_cb(void *arg, uint8_t component, uint16_t bx, uint16_t by, const uint8_t *pixels, uint8_t size)
+{
+  uint32_t *mismatches = (uint32_t*) arg;
+
+  // A flat block stays flat at any scale
+  for (uint8_t i = 0; !component && i < size * size; ++i)
+  {
+    *mismatches += abs(pixels[i] - test_level(bx, by)) > TEST_TOLERANCE;
+  }
+}
+
+static void test_scan_scaled()
+{
+  uint32_t mismatches = 0;
+
+  for (size_t i = 0; i < sizeof(_images) / sizeof(_images[0]); ++i)
+  {
+    for (uint8_t size = 1; size <= CAM_JPEG_MAX_SCALED_SIZE; size <<= 1)
+    {
+      mismatches = 0;
+      TEST_CHECK(CAM_JPEG_scan_scaled(_images[i].buf, _images[i].len, NULL, size, test_scaled_cb, &mismatches) == EXIT_SUCCESS,
+                 "%s: scan at %u", _images[i].name, size);
+      TEST_CHECK(0 == mismatches, "%s: %u pixels off at %u", _images[i].name, mismatches, size);
+    }
+  }
+
+  TEST_CHECK(CAM_JPEG_scan_scaled(_jpeg_420, sizeof(_jpeg_420), NULL, 3, test_scaled_cb, &mismatches) == EXIT_FAILURE,
+             "size 3 is refused");
+}
+
+static void test_crop()
+{
+  test_levels_t original;
+  test_levels_t cropped;
+  cam_jpeg_info_t info;
+  size_t len = 0;
+
+  for (size_t i = 0; i < sizeof(_images) / sizeof(_images[0]); ++i)
+  {
+    const test_image_t *image = &_images[i];
+    uint16_t mcu_w = 8U * image->h_max;
+    uint16_t mcu_h = 8U * image->v_max;
+
+    test_scan_levels(image->buf, image->len, NULL, &original);
+
+    // One MCU in from the top left, reaching the right edge
+    TEST_CHECK(CAM_JPEG_crop(image->buf, image->len, 1, 1, TEST_IMAGE_WIDTH / mcu_w - 1U, 1, _out, sizeof(_out), &len) == EXIT_SUCCESS,
+               "%s: crop", image->name);
+    TEST_CHECK(test_scan_levels(_out, len, &info, &cropped) == EXIT_SUCCESS, "%s: scan cropped", image->name);
+    TEST_CHECK(TEST_IMAGE_WIDTH - mcu_w == info.width && mcu_h == info.height && 0 == info.restart_interval,
+               "%s: cropped to %ux%u, restart interval %u", image->name, info.width, info.height, info.restart_interval);
+
+    // The coefficients are copied, the blocks decode exactly as before
+    for (uint16_t by = 0; by < info.height / 8U; ++by)
+    {
+      for (uint16_t bx = 0; bx < info.width / 8U; ++bx)
+      {
+        TEST_CHECK(cropped.luma[by][bx] == original.luma[by + mcu_h / 8U][bx + mcu_w / 8U],
+                   "%s: cropped block %u,%u is %d", image->name, bx, by, cropped.luma[by][bx]);
+      }
+    }
+
+    TEST_CHECK(CAM_JPEG_crop(image->buf, image->len, 1, 1, TEST_IMAGE_WIDTH / mcu_w - 1U, 1, _out, len - 1U, &len) == EXIT_FAILURE,
+               "%s: crop into a small buffer is refused", image->name);
+    TEST_CHECK(CAM_JPEG_crop(image->buf, image->len, 0, 0, TEST_IMAGE_WIDTH / mcu_w + 1U, 1, _out, sizeof(_out), &len) == EXIT_FAILURE,
+               "%s: crop outside the frame is refused", image->name);
+  }
+}
+
+static void test_mask()
+{
+  // The second rectangle is widened to whole MCUs
+  const cam_jpeg_rect_t rects[] = { { 0, 0, 16, 16 }, { 40, 20, 3, 3 } };
+  test_levels_t original;
+  test_levels_t masked;
+  cam_jpeg_info_t info;
+  uint8_t inside = 0;
+  size_t len = 0;
+
+  for (size_t i = 0; i < sizeof(_images) / sizeof(_images[0]); ++i)
+  {
+    const test_image_t *image = &_images[i];
+    uint16_t mcu_w = 8U * image->h_max;
+    uint16_t mcu_h = 8U * image->v_max;
+
+    test_scan_levels(image->buf, image->len, NULL, &original);
+
+    TEST_CHECK(CAM_JPEG_mask(image->buf, image->len, rects, 2, _out, sizeof(_out), &len) == EXIT_SUCCESS, "%s: mask", image->name);
+    TEST_CHECK(test_scan_levels(_out, len, &info, &masked) == EXIT_SUCCESS, "%s: scan masked", image->name);
+    TEST_CHECK(TEST_IMAGE_WIDTH == info.width && TEST_IMAGE_HEIGHT == info.height && 0 == info.restart_interval,
+               "%s: masked is %ux%u, restart interval %u", image->name, info.width, info.height, info.restart_interval);
+
+    for (uint16_t by = 0; by < TEST_BLOCKS_Y; ++by)
+    {
+      for (uint16_t bx = 0; bx < TEST_BLOCKS_X; ++bx)
+      {
+        inside = 0;
+        for (uint8_t r = 0; r < 2; ++r)
+        {
+          inside |= bx * 8U >= rects[r].x / mcu_w * mcu_w
+            && bx * 8U < (rects[r].x + rects[r].width + mcu_w - 1U) / mcu_w * mcu_w
+            && by * 8U >= rects[r].y / mcu_h * mcu_h
+            && by * 8U < (rects[r].y + rects[r].height + mcu_h - 1U) / mcu_h * mcu_h;
+        }
+
+        // Masked blocks are black, the others are untouched
+        TEST_CHECK(inside ? masked.luma[by][bx] <= TEST_TOLERANCE : masked.luma[by][bx] == original.luma[by][bx],
+                   "%s: %s block %u,%u is %d", image->name, inside ? "masked" : "unmasked", bx, by, masked.luma[by][bx]);
+      }
+    }
+
+    TEST_CHECK(CAM_JPEG_mask(image->buf, image->len, rects, 2, _out, len - 1U, &len) == EXIT_FAILURE,
+               "%s: mask into a small buffer is refused", image->name);
+  }
+
+  TEST_CHECK(CAM_JPEG_mask(_jpeg_420, sizeof(_jpeg_420), NULL, 0, _out, sizeof(_out), &len) == EXIT_SUCCESS
+             && test_scan_levels(_out, len, NULL, &masked) == EXIT_SUCCESS, "no rectangles");
+  TEST_CHECK(CAM_JPEG_mask(_jpeg_420, sizeof(_jpeg_420), rects, CAM_JPEG_MAX_RECTS + 1U, _out, sizeof(_out), &len) == EXIT_FAILURE,
+             "too many rectangles are refused");
+}
+
+// Copies the image with a segment inserted right after SOI
+static size_t test_insert_segment(const uint8_t *buf, size_t len, const uint8_t *seg, size_t seg_len, uint8_t *out)
+{
+  memcpy(out, buf, 2);
+  memcpy(out + 2, seg, seg_len);
+  memcpy(out + 2 + seg_len, buf + 2, len - 2);
+  return len + seg_len;
+}
+
+// Offset of the first marker of the given type, 0 if there is none
+static size_t test_find_marker(const uint8_t *buf, size_t len, uint8_t marker)
+{
+  for (size_t i = 2; i + 1 < len; ++i)
+  {
+    if (0xFF == buf[i] && marker == buf[i + 1])
+    {
+      return i;
+    }
+  }
+  return 0;
+}
+
+static void test_malformed()
+{
+  uint8_t seg[2 + 2 + 1 + 16 + 256];
+  test_levels_t levels;
+  cam_jpeg_info_t info;
+  size_t len = 0;
+  size_t sof = 0;
+  size_t fails = 0;
+
+  // More codes of length 1 than there are, building it would write past the
+  // lookup tables
+  memset(seg, 0, sizeof(seg));
+  seg[0] = 0xFF;
+  seg[1] = 0xC4;
+  seg[3] = 2 + 1 + 16 + 200;
+  seg[4] = 0x00;
+  seg[5] = 200;
+  len = test_insert_segment(_jpeg_420, sizeof(_jpeg_420), seg, 2 + seg[3], _out);
+  TEST_CHECK(test_scan_levels(_out, len, NULL, &levels) == EXIT_FAILURE, "oversubscribed DHT is refused");
+
+  // A DC difference wider than 8-bit samples can have
+  memset(seg, 0, sizeof(seg));
+  seg[0] = 0xFF;
+  seg[1] = 0xC4;
+  seg[3] = 2 + 1 + 16 + 1;
+  seg[4] = 0x00;
+  seg[6] = 1;
+  seg[5 + 16] = 12;
+  len = test_insert_segment(_jpeg_420, sizeof(_jpeg_420), seg, 2 + seg[3], _out);
+  TEST_CHECK(test_scan_levels(_out, len, NULL, &levels) == EXIT_FAILURE, "DC size 12 is refused");
+
+  // The tables are still usable after being refused
+  TEST_CHECK(test_scan_levels(_jpeg_420, sizeof(_jpeg_420), NULL, &levels) == EXIT_SUCCESS, "scan after refused DHT");
+
+  sof = test_find_marker(_jpeg_420, sizeof(_jpeg_420), 0xC0);
+  TEST_CHECK(sof > 0, "SOF0 found");
+
+  memcpy(_out, _jpeg_420, sizeof(_jpeg_420));
+  _out[sof + 7] = 0;
+  _out[sof + 8] = 0;
+  TEST_CHECK(CAM_JPEG_parse(_out, sizeof(_jpeg_420), &info) == EXIT_FAILURE, "width 0 is refused");
+
+  memcpy(_out, _jpeg_420, sizeof(_jpeg_420));
+  _out[sof + 9] = 4;
+  TEST_CHECK(CAM_JPEG_parse(_out, sizeof(_jpeg_420), &info) == EXIT_FAILURE, "4 components are refused");
+
+  memcpy(_out, _jpeg_420, sizeof(_jpeg_420));
+  _out[sof + 11] = 0x50;
+  TEST_CHECK(CAM_JPEG_parse(_out, sizeof(_jpeg_420), &info) == EXIT_FAILURE, "sampling factor 5 is refused");
+
+  memcpy(_out, _jpeg_420, sizeof(_jpeg_420));
+  _out[sof + 4] = 12;
+  TEST_CHECK(CAM_JPEG_parse(_out, sizeof(_jpeg_420), &info) == EXIT_FAILURE, "12-bit precision is refused");
+
+  // Cut anywhere, a frame is refused once its scan misses data, and nothing
+  // is read past the end of it
+  CAM_JPEG_parse(_jpeg_420, sizeof(_jpeg_420), &info);
+  for (len = 0; len < sizeof(_jpeg_420); ++len)
+  {
+    fails += test_scan_levels(_jpeg_420, len, NULL, &levels) != EXIT_SUCCESS;
+  }
+  TEST_CHECK(fails >= info.header_len + (sizeof(_jpeg_420) - info.header_len) / 2,
+             "only %u of %u truncated frames are refused", (uint32_t) fails, (uint32_t) sizeof(_jpeg_420));
+  TEST_CHECK(test_scan_levels(_jpeg_420, info.header_len + 16U, NULL, &levels) == EXIT_FAILURE, "truncated scan is refused");
+}
+
+int main()
+{
+  if (CAM_JPEG_init() != EXIT_SUCCESS)
+  {
+    printf("FAIL init\n");
+    return EXIT_FAILURE;
+  }
+
+  test_parse();
+  test_scan_dc();
+  test_scan_scaled();
+  test_crop();
+  test_mask();
+  test_malformed();
+
+  printf("%s, %u failures\n", _failures ? "FAILED" : "PASSED", _failures);
+
+  return _failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}